@@ -13,6 +13,7 @@
 #include "../HyperPlatform/HyperPlatform/log.h"
 #include "../HyperPlatform/HyperPlatform/util.h"
 #include "../HyperPlatform/HyperPlatform/ept.h"
+#include "fake_page.h"
 
 extern "C" {
 ////////////////////////////////////////////////////////////////////////////////
@@ -38,6 +39,9 @@ extern "C" {
 _IRQL_requires_max_(PASSIVE_LEVEL) static void FupCreateProcessNotifyRoutine(
     _In_ HANDLE parent_pid, _In_ HANDLE pid, _In_ BOOLEAN create);
 
+_IRQL_requires_(DISPATCH_LEVEL) static NTSTATUS
+    FupInvalidateEpt(_In_opt_ void* context);
+
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(INIT, FuInitialization)
 #pragma alloc_text(PAGE, FuTermination)
@@ -78,14 +82,38 @@ _Use_decl_annotations_ static void FupCreateProcessNotifyRoutine(
     return;
   }
 
+  // Most processes have no fake pages. Do not make every processor exit to
+  // the VMM for them. This routine runs in the context of the exiting process.
+  if (!FpMayOwnFakePages(__readcr3())) {
+    return;
+  }
+
+#if (HYPERPLATFORM_COMMON_SHARE_EPT != 0)
+  // EPT is shared. Disable fake pages once, and then have all processors exit
+  // to the VMM, which invalidates EPT on the way back, before shadow pages are
+  // freed. They would otherwise invalidate it only on their next VM-exit.
+  UtilVmCall(HypercallNumber::kApiMonDisableConcealment, nullptr);
+  UtilForEachProcessorInParallel(FupInvalidateEpt, nullptr, nullptr);
+#else
+  // The VMM finds fake pages to disable by guest CR3. Run the hypercall on
+  // each processor from this thread so that CR3 stays of the exiting process.
+  // A DPC would run in whatever process the processor happened to be in.
   UtilForEachProcessor(
       [](void* context) {
         UNREFERENCED_PARAMETER(context);
         return UtilVmCall(HypercallNumber::kApiMonDisableConcealment, nullptr);
       },
       nullptr);
+#endif
 
   UtilVmCall(HypercallNumber::kApiMonDeleteConcealment, nullptr);
 }
 
+// Makes the current processor invalidate EPT if it was changed
+_Use_decl_annotations_ static NTSTATUS FupInvalidateEpt(void* context) {
+  UNREFERENCED_PARAMETER(context);
+
+  return UtilVmCall(HypercallNumber::kInvalidateEpt, nullptr);
+}
+
 }  // extern "C"
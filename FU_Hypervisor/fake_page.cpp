@@ -6,6 +6,9 @@
 /// Implements fake page functions.
 
 #include "fake_page.h"
+#include "fake_page_index.h"
+#include "guest_memory.h"
+#include "load_emulator.h"
 #include "../HyperPlatform/HyperPlatform/common.h"
 #include "../HyperPlatform/HyperPlatform/log.h"
 #include "../HyperPlatform/HyperPlatform/util.h"
@@ -26,46 +29,279 @@
 // constants and macros
 //
 
+// The number of entries the first version of the fake page table can hold
+static const SIZE_T kFppInitialTableCapacity = 64;
+
+// The maximum number of descriptors accepted by one batched hypercall
+static const ULONG64 kFppMaxBatchDescriptors = 0x4000;
+
+// The number of shadow pages carved from one chunk of non-paged pool
+static const SIZE_T kFppShadowPagesPerChunk = 64;
+
+// The number of shadow pages reserved on initialization
+static const SIZE_T kFppReservedShadowPages = kFppShadowPagesPerChunk;
+
+// log2 of the number of counters in g_fpp_owner_filter
+static const ULONG kFppOwnerFilterBits = 12;
+
+// log2 of the number of locks in SharedFakePageData::page_locks
+static const ULONG kFppPageLockBits = 6;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
 //
 
+// Hands out pages for Page from large chunks of non-paged pool. Freed pages
+// are linked into a free list and reused; chunks are released only when the
+// pool is destroyed.
+class ShadowPagePool {
+ public:
+  ShadowPagePool();
+  ~ShadowPagePool();
+
+  // Adds chunks until at least number_of_pages pages are free
+  bool Reserve(SIZE_T number_of_pages);
+
+  // Returns a free page, or nullptr when no page is free and a new chunk
+  // cannot be allocated. Calls must be serialized by the caller.
+  UCHAR* Allocate();
+
+  // Returns a page to the free list. Can be called concurrently with
+  // Allocate().
+  void Free(UCHAR* address);
+
+ private:
+  bool AddChunk();
+
+  SLIST_HEADER free_pages_;  // Linked through the first bytes of free pages
+  std::vector<void*> chunks_;
+};
+
+ShadowPagePool::ShadowPagePool() { InitializeSListHead(&free_pages_); }
+
+// Frees all chunks. Every page must have been returned by then.
+ShadowPagePool::~ShadowPagePool() {
+  for (const auto chunk : chunks_) {
+    ExFreePoolWithTag(chunk, kHyperPlatformCommonPoolTag);
+  }
+}
+
+bool ShadowPagePool::Reserve(SIZE_T number_of_pages) {
+  while (ExQueryDepthSList(&free_pages_) < number_of_pages) {
+    if (!AddChunk()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+UCHAR* ShadowPagePool::Allocate() {
+  auto entry = InterlockedPopEntrySList(&free_pages_);
+  if (!entry) {
+    if (!AddChunk()) {
+      return nullptr;
+    }
+    entry = InterlockedPopEntrySList(&free_pages_);
+  }
+  return reinterpret_cast<UCHAR*>(entry);
+}
+
+void ShadowPagePool::Free(UCHAR* address) {
+  InterlockedPushEntrySList(&free_pages_,
+                            reinterpret_cast<SLIST_ENTRY*>(address));
+}
+
+// Allocates a chunk and links all of its pages into the free list. An
+// allocation of PAGE_SIZE or larger is always page aligned.
+bool ShadowPagePool::AddChunk() {
+  const auto chunk = reinterpret_cast<UCHAR*>(
+      ExAllocatePoolWithTag(NonPagedPool, kFppShadowPagesPerChunk * PAGE_SIZE,
+                            kHyperPlatformCommonPoolTag));
+  if (!chunk) {
+    return false;
+  }
+  chunks_.push_back(chunk);
+  for (SIZE_T i = 0; i < kFppShadowPagesPerChunk; ++i) {
+    Free(chunk + i * PAGE_SIZE);
+  }
+  return true;
+}
+
 // Copy of a page seen by a guest as a result of memory shadowing
 struct Page {
-  UCHAR* address;  // A page aligned copy of a page
-  Page();
+  UCHAR* address;  // A page aligned copy of a page, or nullptr on failure
+  ShadowPagePool* pool;  // The pool address belongs to
+
+  // The number of EPT entries in which the VMM granted a guest write access
+  // to the original page of this copy on EPT violation
+  volatile LONG writable_views;
+
+  // Set when write access to the original page was revoked since the copy was
+  // last synchronized with it
+  volatile LONG dirty;
+
+  // EPT invalidation requested when write access was last revoked. Processors
+  // may write through translations cached before it until it is completed.
+  volatile LONG64 revoked_generation;
+
+  explicit Page(ShadowPagePool* pool);
   ~Page();
 };
 
-// Allocates a non-paged, page-aligned page. Issues bug check on failure
-Page::Page()
-    : address(reinterpret_cast<UCHAR*>(ExAllocatePoolWithTag(
-          NonPagedPool, PAGE_SIZE, kHyperPlatformCommonPoolTag))) {
-  if (!address) {
-    HYPERPLATFORM_COMMON_BUG_CHECK(
-        HyperPlatformBugCheck::kCritialPoolAllocationFailure, 0, 0, 0);
+// Takes a page from the pool. Leaves address nullptr on failure
+Page::Page(ShadowPagePool* pool)
+    : address(pool->Allocate()),
+      pool(pool),
+      writable_views(0),
+      dirty(FALSE),
+      revoked_generation(0) {}
+
+// Returns the page to the pool
+Page::~Page() {
+  if (address) {
+    pool->Free(address);
   }
 }
 
-// De-allocates the allocated page
-Page::~Page() { ExFreePoolWithTag(address, kHyperPlatformCommonPoolTag); }
+// A range of bytes patched by a guest within a page
+struct PatchRange {
+  USHORT offset;  // A byte offset from page_base
+  USHORT size;
+};
 
-// Contains single fake page data
+// Contains single fake page data. Holds all patches in the page
 struct FakePageData {
-  void* patch_address;   // An address to be faked
+  void* page_base;       // A page aligned address to be faked
   ULONG_PTR target_cr3;  // CR3 of the target process
 
-  // A copy of a pages where patch_address belongs to. shadow_page_base_for_rw
+  // A copy of a pages where page_base belongs to. shadow_page_base_for_rw
   // is exposed to a guest for read and write operation against the page of
-  // patch_address, and shadow_page_base_for_exec is exposed for execution.
+  // page_base, and shadow_page_base_for_exec is exposed for execution.
   std::shared_ptr<Page> shadow_page_base_for_exec;
 
   // Physical address of the above two copied pages
   ULONG64 pa_base_for_rw;
   ULONG64 pa_base_for_exec;
 
-  std::array<UCHAR, 32> original_bytes;  // Bytes to show for read operations
+  // Patched ranges sorted by offset. Adjacent ranges are coalesced.
+  std::vector<PatchRange> ranges;
+
+  // Bytes to show for read operations, concatenated in the order of ranges
+  std::vector<UCHAR> original_bytes;
+
+  // An index in the latest version of FakePageTable. Recorded in the EPT
+  // entry of the page as a hint to find this entry on EPT violation.
+  ULONG slot;
+};
+
+// FakePageData being installed, and the published one it updates if any
+struct PendingFakePageData {
+  std::shared_ptr<FakePageData> fp_data;
+  const FakePageData* replaced;
+};
+
+// Describes a patch to conceal. Passed by a guest with
+// kApiMonCreateConcealment, or in an array for
+// kApiMonCreateAndEnableConcealments. Patches in the same page are concealed
+// by the same FakePageData.
+typedef struct {
+  ULONG64 start_address;
+  ULONG64 original_byte_size;
+  std::array<UCHAR, 32> original_bytes;
+} APIMON_CREATE_SHADOW_PARAMETERS;
+C_ASSERT(sizeof(APIMON_CREATE_SHADOW_PARAMETERS) == 48);
+
+// Passed by a guest with kApiMonCreateAndEnableConcealments
+typedef struct {
+  ULONG64 number_of_descriptors;
+  ULONG64 descriptors;  // Guest VA of APIMON_CREATE_SHADOW_PARAMETERS[]
+} APIMON_CREATE_SHADOW_BATCH_PARAMETERS;
+C_ASSERT(sizeof(APIMON_CREATE_SHADOW_BATCH_PARAMETERS) == 16);
+
+// Fake pages of one target process within a version of the fake page table.
+// Members are linked through FakePageTable::next_in_group in insertion order.
+struct FakePageGroup {
+  ULONG_PTR target_cr3;
+  LONG first;  // An index of the first member in FakePageTable::entries
+  LONG last;   // An index of the last member. Used only by a writer
+};
+
+// A version of the table of all FakePageData. Readers use a version without
+// taking a lock. A writer appends an entry to the current version in place
+// while it has room; otherwise, and when entries are removed, the writer
+// publishes a new version and retires the current one. Retired versions are
+// freed once no processor can still be reading them.
+struct FakePageTable {
+  explicit FakePageTable(SIZE_T capacity)
+      : capacity(capacity),
+        count(0),
+        pfn_index(capacity),
+        va_index(capacity),
+        group_index(capacity),
+        retired_epoch(0) {
+    entries.reserve(capacity);
+    next_in_group.resize(capacity, -1);
+    groups.reserve(capacity);
+  }
+
+  // Appends fp_data and makes it visible to readers. Requires room for it.
+  void Append(std::shared_ptr<FakePageData> fp_data) {
+    NT_ASSERT(!IsFull());
+    const auto index = static_cast<LONG>(entries.size());
+    entries.push_back(std::move(fp_data));
+    const auto appended = entries.back().get();
+    appended->slot = static_cast<ULONG>(index);
+    pfn_index.Insert(appended);
+    va_index.Insert(appended);
+
+    // Link the entry to the end of its group, or start a new group
+    auto group = group_index.Find(appended->target_cr3);
+    if (group) {
+      InterlockedExchange(
+          reinterpret_cast<volatile LONG*>(&next_in_group[group->last]), index);
+      group->last = index;
+    } else {
+      groups.push_back({appended->target_cr3, index, index});
+      group_index.Insert(&groups.back());
+    }
+    InterlockedIncrement(&count);
+  }
+
+  bool IsFull() const { return entries.size() == capacity; }
+
+  // Returns an index of the member following the given one, or -1
+  LONG NextInGroup(LONG index) const {
+    return *static_cast<const volatile LONG*>(&next_in_group[index]);
+  }
+
+  const SIZE_T capacity;  // The maximum number of entries
+
+  // Never re-allocated. Objects are shared between versions.
+  std::vector<std::shared_ptr<FakePageData>> entries;
+  volatile LONG count;  // The number of entries visible to readers
+
+  // Finds an entry by a faulting PA on EPT violation
+  FakePageIndex<FakePagePfnKeyTraits<FakePageData>> pfn_index;
+
+  // Finds an entry by CR3 and VA on fake page creation
+  FakePageIndex<FakePageVaKeyTraits<FakePageData>> va_index;
+
+  // Finds entries of a process on enabling, disabling and deleting fake pages.
+  // Neither vector is re-allocated.
+  std::vector<LONG> next_in_group;  // Parallel to entries
+  std::vector<FakePageGroup> groups;
+  FakePageIndex<FakePageGroupKeyTraits<FakePageGroup>> group_index;
+
+  LONG64 retired_epoch;  // The global epoch when this version was retired
+};
+
+// Per-processor state of a fake page table reader. Padded to a cache line as
+// it is written on every EPT violation.
+struct FakePageTableReader {
+  volatile LONG64 epoch;  // The global epoch at entry, or 0 when not reading
+  ULONG depth;            // Nesting level of FppEnterFakePageTable()
+  UCHAR padding[SYSTEM_CACHE_ALIGNMENT_SIZE - sizeof(LONG64) - sizeof(ULONG)];
 };
 
 struct Cpuinfo {
@@ -77,7 +313,34 @@ struct Cpuinfo {
 // Data structure shared across all processors
 struct SharedFakePageData {
   std::vector<std::unique_ptr<Cpuinfo>> cpuinfo;
-  std::vector<std::unique_ptr<FakePageData>> all_fp_data;
+
+  // Backs exec pages. Declared before tables so that it outlives them.
+  ShadowPagePool shadow_pages;
+
+  // The current version of the fake page table. Readers access it only
+  // between FppEnterFakePageTable() and FppLeaveFakePageTable().
+  FakePageTable* volatile table;
+  KSPIN_LOCK table_lock;  // Serializes writers of the table
+
+  // Serialize changes to EPT entries of original pages. Indexed by a hash of
+  // a PFN. See FppGetPageLock().
+  KSPIN_LOCK page_locks[1ul << kFppPageLockBits];
+
+  volatile LONG64 global_epoch;  // Advanced each time a version is retired
+  std::vector<FakePageTableReader> readers;  // Indexed by a processor number
+  std::vector<std::unique_ptr<FakePageTable>> retired_tables;
+
+  // The number of times exec pages were re-synchronized with original pages,
+  // and the number of times it was skipped as they were not written
+  volatile LONG64 exec_page_syncs;
+  volatile LONG64 exec_page_sync_skips;
+
+  // The number of reads from concealed pages completed by emulation
+  volatile LONG64 emulated_reads;
+
+  // The number of EPT violations where a slot in the EPT entry did not tell
+  // FakePageData and the table was looked up by PA
+  volatile LONG64 slot_misses;
 };
 
 // Data structure for each processor
@@ -91,22 +354,98 @@ struct ProcessorFakePageData {
 // prototypes
 //
 
+static bool FppCopyFromGuest(_Out_ void* destination, _In_ const void* source,
+                             _In_ SIZE_T size);
+
+static bool FppIsValidCreateShadowParameters(
+    _In_ const APIMON_CREATE_SHADOW_PARAMETERS& params);
+
+static void FppSplitPatchByPage(
+    _In_ const APIMON_CREATE_SHADOW_PARAMETERS& params,
+    _Inout_ std::vector<APIMON_CREATE_SHADOW_PARAMETERS>* patches);
+
+static bool FppInstallFakePages(
+    _In_ SharedFakePageData* shared_fp_data,
+    _In_ const std::vector<APIMON_CREATE_SHADOW_PARAMETERS>& descriptors,
+    _Out_ std::vector<const FakePageData*>* installed);
+
 _IRQL_requires_max_(PASSIVE_LEVEL) static std::unique_ptr<
     FakePageData> FppCreateFakePageData(_In_ SharedFakePageData* shared_fp_data,
-                                        _In_ void* context);
+                                        _In_ void* page_base,
+                                        _Out_ const FakePageData** replaced);
 
-static FakePageData* FppFindFakePageDataByPage(
-    _In_ const SharedFakePageData* shared_fp_data, _In_ void* address);
-_Use_decl_annotations_ static FakePageData* FppFindFakePageDataByPPage(
-    const SharedFakePageData* shared_fp_data, ULONG64 paddress);
+static void FppAddPatchRange(
+    _In_ FakePageData* fp_data,
+    _In_ const APIMON_CREATE_SHADOW_PARAMETERS& params);
+
+static void FppAddFakePageData(_In_ SharedFakePageData* shared_fp_data,
+                               _In_ std::shared_ptr<FakePageData> fp_data);
+
+static volatile LONG* FppGetOwnerFilterCounter(_In_ ULONG_PTR cr3);
+
+static FakePageData* FppFindFakePageDataByPage(_In_ const FakePageTable* table,
+                                               _In_ void* address);
+
+static FakePageData* FppFindFakePageDataByPPage(
+    _In_ const FakePageTable* table, _In_ ULONG64 paddress);
+
+static const FakePageData* FppFindFakePageDataByEptEntry(
+    _In_ SharedFakePageData* shared_fp_data, _In_ const FakePageTable* table,
+    _In_ const EptCommonEntry* ept_pt_entry, _In_ ULONG64 paddress);
+
+static const FakePageTable* FppEnterFakePageTable(
+    _In_ SharedFakePageData* shared_fp_data);
+
+static void FppLeaveFakePageTable(_In_ SharedFakePageData* shared_fp_data);
+
+static FakePageTableReader* FppGetFakePageTableReader(
+    _In_ SharedFakePageData* shared_fp_data);
+
+template <typename Mapper>
+static FakePageTable* FppCopyFakePageTable(_In_ const FakePageTable& table,
+                                           _In_ SIZE_T capacity,
+                                           _In_ Mapper map);
+
+static void FppReplaceFakePageTable(_In_ SharedFakePageData* shared_fp_data,
+                                    _In_ FakePageTable* new_table);
+
+static void FppReclaimFakePageTables(_In_ SharedFakePageData* shared_fp_data);
+
+static bool FppEmulateRead(_In_ SharedFakePageData* shared_fp_data,
+                           _In_ const FakePageTable* table,
+                           _Inout_ GpRegisters* gp_regs, _In_ void* fault_va);
+
+static SIZE_T FppFetchInstruction(_In_ const FakePageTable* table,
+                                  _In_ ULONG_PTR address,
+                                  _Out_writes_(size) UCHAR* bytes,
+                                  _In_ SIZE_T size);
+
+static void FppSyncExecPage(_In_ SharedFakePageData* shared_fp_data,
+                            _In_ EptData* ept_data,
+                            _In_ const FakePageData& fp_data);
+
+static void FppSetWriteAccess(_In_ EptCommonEntry* ept_pt_entry,
+                              _In_ Page* page, _In_ bool write_access,
+                              _In_ EptData* ept_data);
+
+static PKSPIN_LOCK FppGetPageLock(_In_ SharedFakePageData* shared_fp_data,
+                                  _In_ const FakePageData& fp_data);
+
+static bool FppIsFakePageEnabled(_In_ const EptCommonEntry* ept_pt_entry);
+
+static void FppEnableFakePage(_In_ SharedFakePageData* shared_fp_data,
+                              _In_ const FakePageData& fp_data,
+                              _In_ EptData* ept_data);
 
 static void FppEnableFakePageForExec(_In_ const FakePageData& fp_data,
+                                     _In_ EptCommonEntry* ept_pt_entry,
                                      _In_ EptData* ept_data);
 
 static void FppEnableFakePageForRw(_In_ const FakePageData& fp_data,
                                    _In_ EptData* ept_data);
 
-static void FppDisableFakePage(_In_ const FakePageData& fp_data,
+static void FppDisableFakePage(_In_ SharedFakePageData* shared_fp_data,
+                               _In_ const FakePageData& fp_data,
                                _In_ EptData* ept_data);
 
 static void FppSetMonitorTrapFlag(_In_ ProcessorFakePageData* processor_fp_data,
@@ -134,6 +473,11 @@ static int* FpfindCpuid(SharedFakePageData* sharedata, int index, int subfun);
 // variables
 //
 
+// Counts address spaces owning fake pages by hash of CR3. Updated by the VMM
+// and read by the guest so that it can skip hypercalls for address spaces
+// without fake pages.
+static volatile LONG g_fpp_owner_filter[1ul << kFppOwnerFilterBits];
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // implementations
@@ -166,7 +510,25 @@ _Use_decl_annotations_ EXTERN_C void FpFreeProcessorData(
 _Use_decl_annotations_ EXTERN_C SharedFakePageData*
 FpAllocateSharedProcessorData() {
   PAGED_CODE();
-  return new SharedFakePageData();
+
+  if (!NT_SUCCESS(GmInitialization())) {
+    return nullptr;
+  }
+  auto shared_fp_data = new SharedFakePageData();
+  if (!shared_fp_data->shadow_pages.Reserve(kFppReservedShadowPages)) {
+    delete shared_fp_data;
+    GmTermination();
+    return nullptr;
+  }
+  shared_fp_data->table = new FakePageTable(kFppInitialTableCapacity);
+  KeInitializeSpinLock(&shared_fp_data->table_lock);
+  for (auto& page_lock : shared_fp_data->page_locks) {
+    KeInitializeSpinLock(&page_lock);
+  }
+  shared_fp_data->global_epoch = 1;
+  shared_fp_data->readers.resize(
+      KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS));
+  return shared_fp_data;
 }
 
 // Frees processor-shared fake page data
@@ -174,7 +536,15 @@ _Use_decl_annotations_ EXTERN_C void FpFreeSharedProcessorData(
     SharedFakePageData* shared_fp_data) {
   PAGED_CODE();
 
+  HYPERPLATFORM_LOG_INFO("Exec page syncs: %lld, skipped: %lld",
+                         shared_fp_data->exec_page_syncs,
+                         shared_fp_data->exec_page_sync_skips);
+  HYPERPLATFORM_LOG_INFO("Emulated reads: %lld",
+                         shared_fp_data->emulated_reads);
+  HYPERPLATFORM_LOG_INFO("Slot misses: %lld", shared_fp_data->slot_misses);
+  delete shared_fp_data->table;
   delete shared_fp_data;
+  GmTermination();
 }
 
 //
@@ -184,26 +554,40 @@ _Use_decl_annotations_ EXTERN_C void FpFreeSharedProcessorData(
 // Handles MTF VM-exit
 _Use_decl_annotations_ void FpHandleMonitorTrapFlag(
     ProcessorFakePageData* processor_fp_data,
-    const SharedFakePageData* shared_fp_data, EptData* ept_data) {
+    SharedFakePageData* shared_fp_data, EptData* ept_data) {
   NT_VERIFY(FppIsFuActive(shared_fp_data));
 
   // Re-enable the shadow hook and clears MTF
   const auto fp_data = FppRestoreLastFakePageData(processor_fp_data);
-  const auto guest_cr3 = fp_data->target_cr3;
-  const auto vmm_cr3 = __readcr3();
-  __writecr3(guest_cr3);
-  UCHAR value = *(PUCHAR)processor_fp_data->fault_va;
-  __writecr3(vmm_cr3);
+  UCHAR value = 0;
+  GmReadGuestMemory(fp_data->target_cr3,
+                    reinterpret_cast<void*>(processor_fp_data->fault_va),
+                    &value, sizeof(value));
   HYPERPLATFORM_LOG_DEBUG_SAFE("fault_va= %p,newvalue=%2x",
                                processor_fp_data->fault_va, value);
-  FppEnableFakePageForExec(*fp_data, ept_data);
+
+  // The page keeps its own EPT entry while the fake page is enabled. Leave the
+  // entry as is if another processor has disabled it since EPT violation.
+  KLOCK_QUEUE_HANDLE lock_handle = {};
+  KeAcquireInStackQueuedSpinLockAtDpcLevel(
+      FppGetPageLock(shared_fp_data, *fp_data), &lock_handle);
+  const auto ept_pt_entry = EptGetEptPtEntry(ept_data, fp_data->pa_base_for_rw);
+  if (ept_pt_entry && FppIsFakePageEnabled(ept_pt_entry)) {
+    FppEnableFakePageForExec(*fp_data, ept_pt_entry, ept_data);
+    EptRequestInvalidation(ept_data);
+  }
+  KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
   FppSetMonitorTrapFlag(processor_fp_data, false);
+
+  // fp_data is no longer referenced. See FpHandleEptViolation().
+  FppLeaveFakePageTable(shared_fp_data);
 }
 
 // Handles EPT violation VM-exit
 _Use_decl_annotations_ void FpHandleEptViolation(
     ProcessorFakePageData* processor_fp_data,
-    const SharedFakePageData* shared_fp_data, EptData* ept_data, void* fault_va,
+    SharedFakePageData* shared_fp_data, EptData* ept_data,
+    EptCommonEntry* ept_pt_entry, GpRegisters* gp_regs, void* fault_va,
     ULONG64 fault_pa) {
   if (!FppIsFuActive(shared_fp_data)) {
     return;
@@ -211,15 +595,31 @@ _Use_decl_annotations_ void FpHandleEptViolation(
 
   const EptViolationQualification exit_qualification = {
       UtilVmRead(VmcsField::kExitQualification)};
-  const auto fp_data = FppFindFakePageDataByPPage(shared_fp_data, fault_pa);
+  const auto table = FppEnterFakePageTable(shared_fp_data);
+  const auto fp_data = FppFindFakePageDataByEptEntry(shared_fp_data, table,
+                                                     ept_pt_entry, fault_pa);
   if (!fp_data) {
+    FppLeaveFakePageTable(shared_fp_data);
+    return;
+  }
+
+  // Other processors may change the entry while handling their own EPT
+  // violations. Nothing is left to do if one has disabled the fake page since
+  // this EPT violation occurred.
+  KLOCK_QUEUE_HANDLE lock_handle = {};
+  KeAcquireInStackQueuedSpinLockAtDpcLevel(
+      FppGetPageLock(shared_fp_data, *fp_data), &lock_handle);
+  if (!FppIsFakePageEnabled(ept_pt_entry)) {
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+    FppLeaveFakePageTable(shared_fp_data);
     return;
   }
-  const auto ept_pt_entry = EptGetEptPtEntry(ept_data, fp_data->pa_base_for_rw);
   if (!exit_qualification.fields.caused_by_translation) {
     ept_pt_entry->fields.physial_address =
         UtilPfnFromPa(fp_data->pa_base_for_rw);
     ept_pt_entry->fields.execute_access = false;
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+    FppLeaveFakePageTable(shared_fp_data);
     return;
   }
 
@@ -229,7 +629,18 @@ _Use_decl_annotations_ void FpHandleEptViolation(
                              !exit_qualification.fields.ept_writeable;
   const auto execute_failure = exit_qualification.fields.execute_access &&
                                !exit_qualification.fields.ept_executable;
-  ept_pt_entry->fields.write_access = exit_qualification.fields.write_access;
+
+  // Complete a read by concealed code without showing the page for read and
+  // write, which would cause another EPT violation on the next execution
+  if (read_failure && !exit_qualification.fields.write_access &&
+      !exit_qualification.fields.execute_access &&
+      FppEmulateRead(shared_fp_data, table, gp_regs, fault_va)) {
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+    FppLeaveFakePageTable(shared_fp_data);
+    return;
+  }
+  FppSetWriteAccess(ept_pt_entry, fp_data->shadow_page_base_for_exec.get(),
+                    exit_qualification.fields.write_access, ept_data);
   ept_pt_entry->fields.read_access = exit_qualification.fields.read_access ||
                                      exit_qualification.fields.write_access;
   ept_pt_entry->fields.execute_access =
@@ -239,24 +650,21 @@ _Use_decl_annotations_ void FpHandleEptViolation(
         UtilPfnFromPa(fp_data->pa_base_for_rw);
   } else {
     //ڴ
-    const auto vmmcr3 = __readcr3();
-    __writecr3(fp_data->target_cr3);
-    int len = (ULONG64)fp_data->patch_address -
-              (ULONG64)PAGE_ALIGN(fp_data->patch_address);
-    RtlCopyMemory(fp_data->shadow_page_base_for_exec->address,
-                  PAGE_ALIGN(fp_data->patch_address), len);
-    len = PAGE_SIZE - len - fp_data->original_bytes.size();
-    RtlCopyMemory(
-        (PUCHAR)fp_data->shadow_page_base_for_exec->address + PAGE_SIZE - len,
-        (PUCHAR)fp_data->patch_address + fp_data->original_bytes.size(), len);
-    __writecr3(vmmcr3);
+    FppSyncExecPage(shared_fp_data, ept_data, *fp_data);
     ept_pt_entry->fields.physial_address =
         UtilPfnFromPa(fp_data->pa_base_for_exec);
   }
+  const auto single_step =
+      ept_pt_entry->fields.read_access && ept_pt_entry->fields.execute_access;
+  KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
 
-  if (ept_pt_entry->fields.read_access && ept_pt_entry->fields.execute_access) {
+  if (single_step) {
+    // Keep reading the table until MTF VM-exit so that fp_data saved here is
+    // not reclaimed even if it is deleted in the meantime
     FppSetMonitorTrapFlag(processor_fp_data, true);
     FppSaveLastFakePageData(processor_fp_data, *fp_data);
+  } else {
+    FppLeaveFakePageTable(shared_fp_data);
   }
 
   // EPT violation was caused because a guest tried to read or write to a page
@@ -271,63 +679,274 @@ _Use_decl_annotations_ void FpHandleEptViolation(
 // Create fake page data without activating it
 _Use_decl_annotations_ bool FpVmCallCreateFakePage(
     SharedFakePageData* shared_fp_data, void* context) {
-  auto fp_data = FppCreateFakePageData(shared_fp_data, context);
-  if (!fp_data) {
+  APIMON_CREATE_SHADOW_PARAMETERS params = {};
+  if (!FppCopyFromGuest(&params, context, sizeof(params)) ||
+      !FppIsValidCreateShadowParameters(params)) {
+    HYPERPLATFORM_LOG_DEBUG_SAFE("Invalid descriptor for %016llx",
+                                 params.start_address);
+    return false;
+  }
+
+  KLOCK_QUEUE_HANDLE lock_handle = {};
+  KeAcquireInStackQueuedSpinLockAtDpcLevel(&shared_fp_data->table_lock,
+                                           &lock_handle);
+  std::vector<const FakePageData*> installed;
+  if (!FppInstallFakePages(shared_fp_data, {params}, &installed)) {
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
     return false;
   }
 
+  const auto fp_data = installed.front();
   HYPERPLATFORM_LOG_DEBUG(
-      "CR3 = %016Ix, Patch = %p (%016llx), Exec = %p (%016llx)",
-      fp_data->target_cr3, fp_data->patch_address, fp_data->pa_base_for_rw,
+      "CR3 = %016Ix, Patch = %016llx (%016llx), Exec = %p (%016llx)",
+      fp_data->target_cr3, params.start_address, fp_data->pa_base_for_rw,
       fp_data->shadow_page_base_for_exec->address +
-          BYTE_OFFSET(fp_data->patch_address),
+          BYTE_OFFSET(params.start_address),
       fp_data->pa_base_for_exec);
 
-  // FIXME: lock here
-  shared_fp_data->all_fp_data.push_back(std::move(fp_data));
+  FppReclaimFakePageTables(shared_fp_data);
+  KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
   return true;
 }
 
-// Creates or reuses a couple of copied pages and initializes FakePageData
-_Use_decl_annotations_ static std::unique_ptr<FakePageData>
-FppCreateFakePageData(SharedFakePageData* shared_fp_data, void* context) {
-  typedef struct {
-    ULONG64 start_address;
-    ULONG64 original_byte_size;
-    std::array<UCHAR, 32> original_bytes;
-  } APIMON_CREATE_SHADOW_PARAMETERS;
-  C_ASSERT(sizeof(APIMON_CREATE_SHADOW_PARAMETERS) == 48);
+// Creates fake pages described by an array in a guest and enables them for
+// the current processor. Either all descriptors are installed or none is.
+_Use_decl_annotations_ bool FpVmCallCreateAndEnableFakePages(
+    EptData* ept_data, SharedFakePageData* shared_fp_data, void* context) {
+  APIMON_CREATE_SHADOW_BATCH_PARAMETERS batch = {};
+  if (!FppCopyFromGuest(&batch, context, sizeof(batch))) {
+    HYPERPLATFORM_LOG_DEBUG_SAFE("Invalid batch parameters at %p", context);
+    return false;
+  }
+  if (!batch.number_of_descriptors ||
+      batch.number_of_descriptors > kFppMaxBatchDescriptors) {
+    HYPERPLATFORM_LOG_DEBUG_SAFE("Invalid number of descriptors: %llu",
+                                 batch.number_of_descriptors);
+    return false;
+  }
 
-  APIMON_CREATE_SHADOW_PARAMETERS params = {};
+  // Validate all descriptors before creating anything
+  std::vector<APIMON_CREATE_SHADOW_PARAMETERS> descriptors(
+      static_cast<SIZE_T>(batch.number_of_descriptors));
+  if (!FppCopyFromGuest(descriptors.data(),
+                        reinterpret_cast<void*>(batch.descriptors),
+                        descriptors.size() * sizeof(descriptors[0]))) {
+    HYPERPLATFORM_LOG_DEBUG_SAFE("Invalid descriptors at %016llx",
+                                 batch.descriptors);
+    return false;
+  }
+  for (const auto& params : descriptors) {
+    if (!FppIsValidCreateShadowParameters(params)) {
+      HYPERPLATFORM_LOG_DEBUG_SAFE("Invalid descriptor for %016llx",
+                                   params.start_address);
+      return false;
+    }
+  }
+
+  KLOCK_QUEUE_HANDLE lock_handle = {};
+  KeAcquireInStackQueuedSpinLockAtDpcLevel(&shared_fp_data->table_lock,
+                                           &lock_handle);
+  std::vector<const FakePageData*> installed;
+  if (!FppInstallFakePages(shared_fp_data, descriptors, &installed)) {
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+    return false;
+  }
+
+  // Conceal contents of the original PAs. EPT entries are updated without
+  // invalidation and flushed once for the whole batch.
+  for (const auto fp_data : installed) {
+    FppEnableFakePage(shared_fp_data, *fp_data, ept_data);
+  }
+  EptRequestInvalidation(ept_data);
+
+  FppReclaimFakePageTables(shared_fp_data);
+  KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+  HYPERPLATFORM_LOG_DEBUG_SAFE("Installed and enabled %Iu fake pages",
+                               installed.size());
+  return true;
+}
 
+// Copies memory from the address space of the requester process. Returns false
+// if any of the bytes is not present.
+//
+// This is still bad code. The source is not paged-in when it was paged-out,
+// and what if start_address points to the kernel address space? This code
+// does not give good answers to those situations. A right thing to do is
+// reading the
+// parameter from kernel context where MmProbeAndLockPages() and
+// MmGetSystemAddressForMdlSafe() are available or using Buffered I/O via
+// IOCTL, and then verify that start_address points to a valid location. See
+// "User-Mode Interactions: Guidelines for Kernel-Mode Drivers" from
+// Microsoft.
+_Use_decl_annotations_ static bool FppCopyFromGuest(void* destination,
+                                                    const void* source,
+                                                    SIZE_T size) {
+  return GmReadGuestMemory(UtilVmRead(VmcsField::kGuestCr3), source,
+                           destination, size) == size;
+}
+
+// Checks if params can be used to create a fake page in the requester process
+_Use_decl_annotations_ static bool FppIsValidCreateShadowParameters(
+    const APIMON_CREATE_SHADOW_PARAMETERS& params) {
+  if (params.original_byte_size > params.original_bytes.size()) {
+    return false;
+  }
+
+  // Both pages need to be present when a patch crosses a page boundary
+  const auto last_byte =
+      params.start_address +
+      (params.original_byte_size ? params.original_byte_size - 1 : 0);
   const auto guest_cr3 = UtilVmRead(VmcsField::kGuestCr3);
-  const auto vmm_cr3 = __readcr3();
-
-  // Get parameters from an user supplied address.
-  //
-  // This is bad code for numerous reasons. What if the context points
-  // to an unmapped address? What if the address was already paged-out? What if
-  // start_address points to the kernel address space? This code does not give
-  // good answers to those situations. A right thing to do is reading the
-  // parameter from kernel context where MmProbeAndLockPages() and
-  // MmGetSystemAddressForMdlSafe() are available or using Buffered I/O via
-  // IOCTL, and then verify that start_address points to a valid location. See
-  // "User-Mode Interactions: Guidelines for Kernel-Mode Drivers" from
-  // Microsoft.
-  __writecr3(guest_cr3);
-  RtlCopyMemory(&params, context, sizeof(params));
-
-  // Get PA of the start_address in requester process's context
-  const auto page_base = PAGE_ALIGN(params.start_address);
-  const auto pa_base = UtilPaFromVa(page_base);
-  __writecr3(vmm_cr3);
+  const auto pa_base = GmPaFromVa(guest_cr3, PAGE_ALIGN(params.start_address));
+  const auto pa_last = GmPaFromVa(guest_cr3, PAGE_ALIGN(last_byte));
+  return pa_base != 0 && pa_last != 0;
+}
+
+// Splits a patch at a page boundary and appends each part to patches
+_Use_decl_annotations_ static void FppSplitPatchByPage(
+    const APIMON_CREATE_SHADOW_PARAMETERS& params,
+    std::vector<APIMON_CREATE_SHADOW_PARAMETERS>* patches) {
+  const auto first_size = std::min<ULONG64>(
+      params.original_byte_size, PAGE_SIZE - BYTE_OFFSET(params.start_address));
+  patches->push_back(params);
+  patches->back().original_byte_size = first_size;
+  if (first_size == params.original_byte_size) {
+    return;
+  }
+
+  APIMON_CREATE_SHADOW_PARAMETERS second = {};
+  second.start_address = params.start_address + first_size;
+  second.original_byte_size = params.original_byte_size - first_size;
+  std::copy(params.original_bytes.cbegin() + first_size,
+            params.original_bytes.cbegin() + params.original_byte_size,
+            second.original_bytes.begin());
+  patches->push_back(second);
+}
+
+// Creates FakePageData for pages of descriptors, or updated copies of ones
+// already published for the requester, and publishes them. A patch crossing a
+// page boundary is installed into both pages, together with the rest. Returns
+// false without publishing or patching anything when a shadow page cannot be
+// allocated.
+// The caller must hold table_lock.
+_Use_decl_annotations_ static bool FppInstallFakePages(
+    SharedFakePageData* shared_fp_data,
+    const std::vector<APIMON_CREATE_SHADOW_PARAMETERS>& descriptors,
+    std::vector<const FakePageData*>* installed) {
+  const auto guest_cr3 = UtilVmRead(VmcsField::kGuestCr3);
+  const auto had_fake_pages =
+      !!shared_fp_data->table->group_index.Find(guest_cr3);
+
+  std::vector<APIMON_CREATE_SHADOW_PARAMETERS> patches;
+  patches.reserve(descriptors.size());
+  for (const auto& params : descriptors) {
+    FppSplitPatchByPage(params, &patches);
+  }
+
+  // Visit patches page by page, and in the given order within a page
+  std::vector<ULONG> order(patches.size());
+  for (ULONG i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&patches](ULONG lhs, ULONG rhs) {
+    const auto lhs_page = PAGE_ALIGN(patches[lhs].start_address);
+    const auto rhs_page = PAGE_ALIGN(patches[rhs].start_address);
+    return lhs_page < rhs_page || (lhs_page == rhs_page && lhs < rhs);
+  });
+
+  // Allocate FakePageData for all pages before patching any of them, since an
+  // exec page may be shared with published FakePageData and patching it cannot
+  // be undone. pending is sorted by page_base.
+  std::vector<PendingFakePageData> pending;
+  for (const auto index : order) {
+    const auto page_base = PAGE_ALIGN(patches[index].start_address);
+    if (pending.empty() || pending.back().fp_data->page_base != page_base) {
+      const FakePageData* replaced = nullptr;
+      auto fp_data =
+          FppCreateFakePageData(shared_fp_data, page_base, &replaced);
+      if (!fp_data) {
+        HYPERPLATFORM_LOG_DEBUG_SAFE("Failed to allocate a shadow page");
+        return false;
+      }
+      pending.push_back({std::move(fp_data), replaced});
+    }
+  }
+
+  // Nothing can fail from here. Apply patches to their pages.
+  auto current = pending.begin();
+  for (const auto index : order) {
+    const auto& params = patches[index];
+    if (current->fp_data->page_base != PAGE_ALIGN(params.start_address)) {
+      ++current;
+    }
+    FppAddPatchRange(current->fp_data.get(), params);
+  }
+
+  // Publish updated copies in place of the old ones with a single new version
+  const auto has_replacements =
+      std::any_of(pending.cbegin(), pending.cend(),
+                  [](const PendingFakePageData& p) { return !!p.replaced; });
+  if (has_replacements) {
+    const auto table = shared_fp_data->table;
+    const auto replace = [&pending, guest_cr3](
+        const std::shared_ptr<FakePageData>& fp_data) {
+      if (fp_data->target_cr3 != guest_cr3) {
+        return fp_data;
+      }
+      const auto it = std::lower_bound(
+          pending.cbegin(), pending.cend(), fp_data->page_base,
+          [](const PendingFakePageData& p, void* page_base) {
+            return p.fp_data->page_base < page_base;
+          });
+      return (it != pending.cend() && it->replaced == fp_data.get())
+                 ? it->fp_data
+                 : fp_data;
+    };
+    FppReplaceFakePageTable(
+        shared_fp_data,
+        FppCopyFakePageTable(*table, table->capacity, replace));
+  }
+
+  // Then, append new ones
+  installed->clear();
+  for (const auto& p : pending) {
+    if (!p.replaced) {
+      FppAddFakePageData(shared_fp_data, p.fp_data);
+    }
+    installed->push_back(p.fp_data.get());
+  }
+
+  // Let the guest know this address space needs hypercalls to clean up
+  if (!had_fake_pages) {
+    InterlockedIncrement(FppGetOwnerFilterCounter(guest_cr3));
+  }
+  return true;
+}
+
+// Creates FakePageData without patches for page_base of the requester
+// process, or copies the one already published for it so that patches can be
+// added without affecting readers. In the latter case, returns the published
+// one with replaced. Returns nullptr when a shadow page cannot be allocated.
+// The caller must hold table_lock.
+_Use_decl_annotations_ static std::unique_ptr<FakePageData>
+FppCreateFakePageData(SharedFakePageData* shared_fp_data, void* page_base,
+                      const FakePageData** replaced) {
+  const auto guest_cr3 = UtilVmRead(VmcsField::kGuestCr3);
+
+  *replaced = nullptr;
+  auto reusable_fp_data =
+      FppFindFakePageDataByPage(shared_fp_data->table, page_base);
+  if (reusable_fp_data && reusable_fp_data->target_cr3 == guest_cr3) {
+    *replaced = reusable_fp_data;
+    return std::make_unique<FakePageData>(*reusable_fp_data);
+  }
+
+  // Get PA of the page_base in requester process's context
+  const auto pa_base = GmPaFromVa(guest_cr3, page_base);
 
   auto fp_data = std::make_unique<FakePageData>();
-  fp_data->patch_address = reinterpret_cast<void*>(params.start_address);
+  fp_data->page_base = page_base;
   fp_data->target_cr3 = guest_cr3;
-
-  auto reusable_fp_data = FppFindFakePageDataByPage(
-      shared_fp_data, reinterpret_cast<void*>(params.start_address));
   if (reusable_fp_data) {
     // Found an existing FakePageData object targeting the same page as this
     // one. re-use shadow pages.
@@ -335,89 +954,418 @@ FppCreateFakePageData(SharedFakePageData* shared_fp_data, void* context) {
         reusable_fp_data->shadow_page_base_for_exec;
   } else {
     // No associated FakePageData for the address. Create a fake page.
-    fp_data->shadow_page_base_for_exec = std::make_shared<Page>();
-    __writecr3(fp_data->target_cr3);
-    RtlCopyMemory(fp_data->shadow_page_base_for_exec->address, page_base,
-                  PAGE_SIZE);
-    __writecr3(vmm_cr3);
+    fp_data->shadow_page_base_for_exec =
+        std::make_shared<Page>(&shared_fp_data->shadow_pages);
+    if (!fp_data->shadow_page_base_for_exec->address) {
+      return nullptr;
+    }
+    GmReadGuestMemory(fp_data->target_cr3, page_base,
+                      fp_data->shadow_page_base_for_exec->address, PAGE_SIZE);
   }
-  fp_data->original_bytes = params.original_bytes;
   fp_data->pa_base_for_rw = pa_base;
   fp_data->pa_base_for_exec =
       UtilPaFromVa(fp_data->shadow_page_base_for_exec->address);
   return fp_data;
 }
 
+// Merges a patch described by params into ranges of fp_data. Bytes already
+// covered by a range keep their original bytes. Newly covered bytes are
+// copied from the guest, which has already written the patch there, onto the
+// exec page.
+_Use_decl_annotations_ static void FppAddPatchRange(
+    FakePageData* fp_data, const APIMON_CREATE_SHADOW_PARAMETERS& params) {
+  const auto offset = BYTE_OFFSET(params.start_address);
+  const auto size = static_cast<ULONG>(params.original_byte_size);
+  const auto exec_page = fp_data->shadow_page_base_for_exec->address;
+
+  const auto append = [fp_data](ULONG byte_offset, UCHAR original_byte) {
+    auto& ranges = fp_data->ranges;
+    if (!ranges.empty() &&
+        ranges.back().offset + ranges.back().size == byte_offset) {
+      ranges.back().size++;
+    } else {
+      ranges.push_back({static_cast<USHORT>(byte_offset), 1});
+    }
+    fp_data->original_bytes.push_back(original_byte);
+  };
+
+  const auto old_ranges = std::move(fp_data->ranges);
+  const auto old_bytes = std::move(fp_data->original_bytes);
+  fp_data->ranges.clear();
+  fp_data->original_bytes.clear();
+
+  // Validated not to exceed original_bytes and to be present
+  decltype(params.original_bytes) patch = {};
+  GmReadGuestMemory(fp_data->target_cr3,
+                    reinterpret_cast<void*>(params.start_address),
+                    patch.data(), size);
+
+  ULONG i = 0;
+  SIZE_T old_byte_index = 0;
+  for (const auto& range : old_ranges) {
+    for (; i < size && offset + i < range.offset; ++i) {
+      append(offset + i, params.original_bytes[i]);
+      exec_page[offset + i] = patch[i];
+    }
+    for (ULONG j = 0; j < range.size; ++j) {
+      append(range.offset + j, old_bytes[old_byte_index++]);
+    }
+    // Skip new bytes already covered by this range
+    const auto range_end = static_cast<ULONG>(range.offset) + range.size;
+    while (i < size && offset + i < range_end) {
+      ++i;
+    }
+  }
+  for (; i < size; ++i) {
+    append(offset + i, params.original_bytes[i]);
+    exec_page[offset + i] = patch[i];
+  }
+}
+
+// Appends fp_data to the current version of the fake page table, or to a new
+// larger version when the current one is full. The caller must hold
+// table_lock.
+_Use_decl_annotations_ static void FppAddFakePageData(
+    SharedFakePageData* shared_fp_data, std::shared_ptr<FakePageData> fp_data) {
+  auto table = shared_fp_data->table;
+  if (table->IsFull()) {
+    // Publish a larger version as the current one cannot be extended in place
+    table = FppCopyFakePageTable(
+        *table, table->capacity * 2,
+        [](const std::shared_ptr<FakePageData>& fp_data) { return fp_data; });
+    table->Append(std::move(fp_data));
+    FppReplaceFakePageTable(shared_fp_data, table);
+  } else {
+    table->Append(std::move(fp_data));
+  }
+}
+
 // Find a FakePageData instance by address
 _Use_decl_annotations_ static FakePageData* FppFindFakePageDataByPage(
-    const SharedFakePageData* shared_fp_data, void* address) {
+    const FakePageTable* table, void* address) {
   const auto guest_cr3 = UtilVmRead(VmcsField::kGuestCr3);
-  const auto found = std::find_if(
-      shared_fp_data->all_fp_data.cbegin(), shared_fp_data->all_fp_data.cend(),
-      [address, guest_cr3](const auto& fp_data) {
-        return PAGE_ALIGN(fp_data->patch_address) == PAGE_ALIGN(address) &&
-               fp_data->target_cr3 == guest_cr3;
-      });
-  if (found == shared_fp_data->all_fp_data.cend()) {
-    return nullptr;
-  }
-  return found->get();
+  return table->va_index.Find(
+      {guest_cr3 & kFakePageCr3PageMask, PAGE_ALIGN(address)});
 }
 
+// Find a FakePageData instance by PA of the page seen for read and write
 _Use_decl_annotations_ static FakePageData* FppFindFakePageDataByPPage(
-    const SharedFakePageData* shared_fp_data, ULONG64 paddress) {
-  const auto found = std::find_if(
-      shared_fp_data->all_fp_data.cbegin(), shared_fp_data->all_fp_data.cend(),
-      [paddress](const auto& fp_data) {
-        return fp_data->pa_base_for_rw >> 12 == paddress >> 12;
-      });
-  if (found == shared_fp_data->all_fp_data.cend()) {
-    return nullptr;
+    const FakePageTable* table, ULONG64 paddress) {
+  return table->pfn_index.Find(UtilPfnFromPa(paddress));
+}
+
+// Find a FakePageData instance by a slot recorded in the EPT entry of the
+// page. Falls back to the PA when the entry has no slot, or the slot was
+// recorded for another version of the table and points to another page.
+_Use_decl_annotations_ static const FakePageData*
+FppFindFakePageDataByEptEntry(SharedFakePageData* shared_fp_data,
+                              const FakePageTable* table,
+                              const EptCommonEntry* ept_pt_entry,
+                              ULONG64 paddress) {
+  const auto slot = ept_pt_entry->fields.software_slot;
+  if (slot && slot - 1 < static_cast<ULONG64>(table->count)) {
+    const auto fp_data = table->entries[slot - 1].get();
+    if (UtilPfnFromPa(fp_data->pa_base_for_rw) == UtilPfnFromPa(paddress)) {
+      return fp_data;
+    }
+  }
+  InterlockedIncrement64(&shared_fp_data->slot_misses);
+  return FppFindFakePageDataByPPage(table, paddress);
+}
+
+// Marks the current processor as a reader of the fake page table and returns
+// the current version. The version and its entries remain valid until the
+// matching FppLeaveFakePageTable() call. Calls can be nested.
+_Use_decl_annotations_ static const FakePageTable* FppEnterFakePageTable(
+    SharedFakePageData* shared_fp_data) {
+  const auto reader = FppGetFakePageTableReader(shared_fp_data);
+  if (reader->depth++ == 0) {
+    // A full barrier orders the store against the load of the table below.
+    // A writer that retires the table loaded here is then guaranteed to see
+    // this epoch when it scans readers.
+    InterlockedExchange64(&reader->epoch, shared_fp_data->global_epoch);
+  }
+  return shared_fp_data->table;
+}
+
+// Ends access started by FppEnterFakePageTable()
+_Use_decl_annotations_ static void FppLeaveFakePageTable(
+    SharedFakePageData* shared_fp_data) {
+  const auto reader = FppGetFakePageTableReader(shared_fp_data);
+  NT_ASSERT(reader->depth);
+  if (--reader->depth == 0) {
+    InterlockedExchange64(&reader->epoch, 0);
+  }
+}
+
+// Returns reader state of the current processor
+_Use_decl_annotations_ static FakePageTableReader* FppGetFakePageTableReader(
+    SharedFakePageData* shared_fp_data) {
+  const auto index = KeGetCurrentProcessorNumberEx(nullptr);
+  NT_ASSERT(index < shared_fp_data->readers.size());
+  return &shared_fp_data->readers[index];
+}
+
+// Builds a new version holding what map() returns for each entry of table in
+// order. An entry is dropped when map() returns nullptr.
+template <typename Mapper>
+_Use_decl_annotations_ static FakePageTable* FppCopyFakePageTable(
+    const FakePageTable& table, SIZE_T capacity, Mapper map) {
+  auto new_table = new FakePageTable(capacity);
+  for (const auto& fp_data : table.entries) {
+    auto mapped = map(fp_data);
+    if (mapped) {
+      new_table->Append(std::move(mapped));
+    }
+  }
+  return new_table;
+}
+
+// Publishes new_table as the current version and retires the previous one.
+// The caller must hold table_lock.
+_Use_decl_annotations_ static void FppReplaceFakePageTable(
+    SharedFakePageData* shared_fp_data, FakePageTable* new_table) {
+  const auto old_table =
+      reinterpret_cast<FakePageTable*>(InterlockedExchangePointer(
+          reinterpret_cast<void* volatile*>(&shared_fp_data->table),
+          new_table));
+
+  // Readers that entered before this increment may still use old_table
+  old_table->retired_epoch =
+      InterlockedIncrement64(&shared_fp_data->global_epoch);
+  shared_fp_data->retired_tables.emplace_back(old_table);
+}
+
+// Frees retired versions that no processor can be reading anymore. The
+// caller must hold table_lock.
+_Use_decl_annotations_ static void FppReclaimFakePageTables(
+    SharedFakePageData* shared_fp_data) {
+  auto oldest_epoch = MAXLONG64;
+  for (const auto& reader : shared_fp_data->readers) {
+    const auto epoch = reader.epoch;
+    if (epoch && epoch < oldest_epoch) {
+      oldest_epoch = epoch;
+    }
   }
-  return found->get();
+
+  auto& retired_tables = shared_fp_data->retired_tables;
+  const auto new_end = std::remove_if(
+      retired_tables.begin(), retired_tables.end(),
+      [oldest_epoch](const auto& table) {
+        return table->retired_epoch <= oldest_epoch;
+      });
+  retired_tables.erase(new_end, retired_tables.end());
 }
+
 // Enables all fake pages for the current process
 _Use_decl_annotations_ NTSTATUS FpVmCallEnableFakePages(
-    EptData* ept_data, const SharedFakePageData* shared_fp_data) {
+    EptData* ept_data, SharedFakePageData* shared_fp_data) {
   const auto requester_cr3 = UtilVmRead(VmcsField::kGuestCr3);
-  const auto vmm_cr3 = __readcr3();
 
   // conceal contents of the original PA
-  Cr0 cr0_old = {__readcr0()};
-  Cr0 cr0_new = cr0_old;
-  cr0_new.fields.wp = false;
-  __writecr0(cr0_new.all);
-
-  for (auto& fp_data : shared_fp_data->all_fp_data) {
-    if (fp_data->target_cr3 != requester_cr3) {
-      continue;
+  const auto table = FppEnterFakePageTable(shared_fp_data);
+  const auto group = table->group_index.Find(requester_cr3);
+  for (auto i = group ? group->first : -1; i != -1; i = table->NextInGroup(i)) {
+    FppEnableFakePage(shared_fp_data, *table->entries[i], ept_data);
+  }
+  FppLeaveFakePageTable(shared_fp_data);
+  EptRequestInvalidation(ept_data);
+  return STATUS_SUCCESS;
+}
+
+// Emulates an instruction that read a concealed page when the instruction is
+// also in a concealed page. A read from elsewhere, such as an integrity scan,
+// is left to the caller since the read and write view serves subsequent reads
+// without VM-exit.
+_Use_decl_annotations_ static bool FppEmulateRead(
+    SharedFakePageData* shared_fp_data, const FakePageTable* table,
+    GpRegisters* gp_regs, void* fault_va) {
+  if (!fault_va) {
+    return false;
+  }
+
+  UCHAR instruction[kLeMaxInstructionLength] = {};
+  const auto guest_ip = UtilVmRead(VmcsField::kGuestRip);
+  const auto size =
+      FppFetchInstruction(table, guest_ip, instruction, sizeof(instruction));
+  if (!size || !LeEmulateLoad(gp_regs, instruction, size,
+                              reinterpret_cast<ULONG_PTR>(fault_va))) {
+    return false;
+  }
+  InterlockedIncrement64(&shared_fp_data->emulated_reads);
+  return true;
+}
+
+// Reads up to size bytes at the guest address as a processor fetches them for
+// execution, that is, from exec pages for concealed pages. Returns the number
+// of bytes read, or 0 if the address is not in a concealed page.
+_Use_decl_annotations_ static SIZE_T FppFetchInstruction(
+    const FakePageTable* table, ULONG_PTR address, UCHAR* bytes, SIZE_T size) {
+  const auto guest_cr3 = UtilVmRead(VmcsField::kGuestCr3);
+  SIZE_T fetched = 0;
+  while (fetched < size) {
+    const auto va = address + fetched;
+    const auto pa = GmPaFromVa(guest_cr3, reinterpret_cast<void*>(va));
+    if (!pa) {
+      break;
+    }
+    const auto fp_data = FppFindFakePageDataByPPage(table, pa);
+    if (!fp_data && !fetched) {
+      break;
     }
 
-    __writecr3(fp_data->target_cr3);
-    RtlCopyMemory(fp_data->patch_address, fp_data->original_bytes.data(),
-                  fp_data->original_bytes.size());
-    __writecr3(vmm_cr3);
+    const auto offset = BYTE_OFFSET(va);
+    const auto chunk = std::min<SIZE_T>(size - fetched, PAGE_SIZE - offset);
+    if (fp_data) {
+      RtlCopyMemory(bytes + fetched,
+                    fp_data->shadow_page_base_for_exec->address + offset,
+                    chunk);
+    } else if (GmReadGuestMemory(guest_cr3, reinterpret_cast<void*>(va),
+                                 bytes + fetched, chunk) != chunk) {
+      break;
+    }
+    fetched += chunk;
+  }
+  return fetched;
+}
 
-    HYPERPLATFORM_LOG_DEBUG_SAFE("Shadowing %016Ix:%p", fp_data->target_cr3,
-                                 fp_data->patch_address);
-    FppEnableFakePageForExec(*fp_data, ept_data);
+// Copies the original page onto the exec page except patched ranges, only
+// when the original page may have been written since the last copy
+_Use_decl_annotations_ static void FppSyncExecPage(
+    SharedFakePageData* shared_fp_data, EptData* ept_data,
+    const FakePageData& fp_data) {
+  const auto page = fp_data.shadow_page_base_for_exec.get();
+
+  // A processor revoking write access records revoked_generation and sets
+  // dirty before decrementing writable_views. Thus, once the count is observed
+  // to be zero and all processors have invalidated EPT for the generation, no
+  // write is possible and any write made is recorded as dirty. Until then,
+  // dirty is left set as a processor may still write through a translation it
+  // cached.
+  if (!page->writable_views &&
+      EptIsInvalidationCompleted(ept_data, page->revoked_generation) &&
+      !InterlockedExchange(&page->dirty, FALSE)) {
+    InterlockedIncrement64(&shared_fp_data->exec_page_sync_skips);
+    return;
   }
-  __writecr0(cr0_old.all);
-  return STATUS_SUCCESS;
+  InterlockedIncrement64(&shared_fp_data->exec_page_syncs);
+
+  // Copy gaps between patched ranges
+  const auto page_base = reinterpret_cast<UCHAR*>(fp_data.page_base);
+  ULONG offset = 0;
+  for (const auto& range : fp_data.ranges) {
+    GmReadGuestMemory(fp_data.target_cr3, page_base + offset,
+                      page->address + offset, range.offset - offset);
+    offset = range.offset + range.size;
+  }
+  GmReadGuestMemory(fp_data.target_cr3, page_base + offset,
+                    page->address + offset, PAGE_SIZE - offset);
 }
 
-// Show a shadowed page for execution
-_Use_decl_annotations_ static void FppEnableFakePageForExec(
-    const FakePageData& fp_data, EptData* ept_data) {
-  const auto old_cr3 = __readcr3();
-  __writecr3(fp_data.target_cr3);
+// Changes write access of an EPT entry for an original page, keeping track of
+// whether its copy may be out of date. Only write access granted here is
+// counted in writable_views, and software_write_granted records whether the
+// entry holds such a grant. Write access the entry had otherwise, such as that
+// of an identity mapping, is revoked without being uncounted. Revoking write
+// access requests EPT invalidation on all processors.
+_Use_decl_annotations_ static void FppSetWriteAccess(
+    EptCommonEntry* ept_pt_entry, Page* page, bool write_access,
+    EptData* ept_data) {
+  const auto granted = !!ept_pt_entry->fields.software_write_granted;
+  const auto revoked = !write_access && ept_pt_entry->fields.write_access;
+  ept_pt_entry->fields.software_write_granted = write_access;
+  ept_pt_entry->fields.write_access = write_access;
+  if (write_access && !granted) {
+    InterlockedIncrement(&page->writable_views);
+  } else if (revoked) {
+    // Processors keep writing through translations cached before this change
+    // until they invalidate EPT. Record the latest generation that makes
+    // writes impossible.
+    const auto generation = EptRequestInvalidation(ept_data);
+    auto revoked_generation = page->revoked_generation;
+    while (revoked_generation < generation) {
+      const auto old_generation = InterlockedCompareExchange64(
+          &page->revoked_generation, generation, revoked_generation);
+      if (old_generation == revoked_generation) {
+        break;
+      }
+      revoked_generation = old_generation;
+    }
 
-  const auto ept_pt_entry =
-      EptGetEptPtEntry(ept_data, UtilPaFromVa(fp_data.patch_address));
+    // The original page may have been written through this entry whether or
+    // not the access was counted
+    InterlockedExchange(&page->dirty, TRUE);
+    if (granted) {
+      InterlockedDecrement(&page->writable_views);
+    }
+  }
+}
 
+// Returns a lock serializing changes to the EPT entry of the original page of
+// fp_data. Pages share locks by a hash of their PFNs.
+_Use_decl_annotations_ static PKSPIN_LOCK FppGetPageLock(
+    SharedFakePageData* shared_fp_data, const FakePageData& fp_data) {
+  const auto hash =
+      UtilPfnFromPa(fp_data.pa_base_for_rw) * kFakePageHashMultiplier;
+  return &shared_fp_data->page_locks[hash >> (64 - kFppPageLockBits)];
+}
+
+// Checks if the EPT entry of an original page shows a fake page. An enabled
+// fake page always denies some access, while FppDisableFakePage() grants all.
+_Use_decl_annotations_ static bool FppIsFakePageEnabled(
+    const EptCommonEntry* ept_pt_entry) {
+  return !ept_pt_entry->fields.read_access ||
+         !ept_pt_entry->fields.write_access ||
+         !ept_pt_entry->fields.execute_access;
+}
+
+// Writes original bytes to patched ranges and shows the exec page. The
+// caller must invalidate EPT afterward.
+_Use_decl_annotations_ static void FppEnableFakePage(
+    SharedFakePageData* shared_fp_data, const FakePageData& fp_data,
+    EptData* ept_data) {
+  // Use the PA recorded at creation. Translating page_base again may give
+  // another PA, or none, if the guest has changed its page tables since.
+  if (!fp_data.pa_base_for_rw) {
+    return;
+  }
+
+  KLOCK_QUEUE_HANDLE lock_handle = {};
+  KeAcquireInStackQueuedSpinLockAtDpcLevel(
+      FppGetPageLock(shared_fp_data, fp_data), &lock_handle);
+
+  // The page may be mapped with a 2 MB EPT entry. Give it its own entry.
+  const auto ept_pt_entry = EptSplitLargePage(ept_data, fp_data.pa_base_for_rw);
+  if (!ept_pt_entry) {
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+    return;
+  }
+
+  auto original_bytes = fp_data.original_bytes.data();
+  for (const auto& range : fp_data.ranges) {
+    GmWriteGuestMemory(fp_data.target_cr3,
+                       reinterpret_cast<UCHAR*>(fp_data.page_base) +
+                           range.offset,
+                       original_bytes, range.size);
+    original_bytes += range.size;
+  }
+
+  HYPERPLATFORM_LOG_DEBUG_SAFE("Shadowing %016Ix:%p (%Iu ranges)",
+                               fp_data.target_cr3, fp_data.page_base,
+                               fp_data.ranges.size());
+  FppEnableFakePageForExec(fp_data, ept_pt_entry, ept_data);
+  KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+}
+
+// Show a shadowed page for execution through the EPT entry of the original
+// page. The caller must hold the page lock and invalidate EPT.
+_Use_decl_annotations_ static void FppEnableFakePageForExec(
+    const FakePageData& fp_data, EptCommonEntry* ept_pt_entry,
+    EptData* ept_data) {
   // Allow the VMM to redirect read and write access to the address by denying
   // those accesses and handling them on EPT violation
-  ept_pt_entry->fields.write_access = false;
+  FppSetWriteAccess(ept_pt_entry, fp_data.shadow_page_base_for_exec.get(),
+                    false, ept_data);
   ept_pt_entry->fields.read_access = false;
 
   // Only execution is allowed on the address. Show the copied page for exec
@@ -425,8 +1373,11 @@ _Use_decl_annotations_ static void FppEnableFakePageForExec(
   ept_pt_entry->fields.physial_address =
       UtilPfnFromPa(fp_data.pa_base_for_exec);
 
-  __writecr3(old_cr3);
-  UtilInveptGlobal();
+  // Record the slot so that EPT violation finds fp_data without a lookup. 0
+  // means none, and is left when the slot does not fit so that the PFN index
+  // is used instead.
+  ept_pt_entry->fields.software_slot =
+      (fp_data.slot + 1ull < kEptSoftwareSlotCount) ? fp_data.slot + 1 : 0;
 }
 
 // Show a shadowed page for read and write
@@ -445,68 +1396,108 @@ _Use_decl_annotations_ static void FppEnableFakePageForRw(
   ept_pt_entry->fields.physial_address = UtilPfnFromPa(fp_data.pa_base_for_rw);
 
   //__writecr3(old_cr3);
-  UtilInveptGlobal();
+  EptRequestInvalidation(ept_data);
 }
 
 // Disables all fake pages for the current process
 _Use_decl_annotations_ void FpVmCallDisableFakePages(
     EptData* ept_data, SharedFakePageData* shared_fp_data) {
   const auto requester_cr3 = UtilVmRead(VmcsField::kGuestCr3);
-  const auto vmm_cr3 = __readcr3();
-
-  Cr0 cr0_old = {__readcr0()};
-  Cr0 cr0_new = cr0_old;
-  cr0_new.fields.wp = false;
-  __writecr0(cr0_new.all);
-
-  for (auto& fp_data : shared_fp_data->all_fp_data) {
-    if (fp_data->target_cr3 != requester_cr3) {
-      continue;
-    }
 
+  const auto table = FppEnterFakePageTable(shared_fp_data);
+  const auto group = table->group_index.Find(requester_cr3);
+  for (auto i = group ? group->first : -1; i != -1; i = table->NextInGroup(i)) {
+    const auto& fp_data = table->entries[i];
     HYPERPLATFORM_LOG_DEBUG_SAFE("Unshadowing %016Ix:%p", fp_data->target_cr3,
-                                 fp_data->patch_address);
-    FppDisableFakePage(*fp_data, ept_data);
-
-    // Write back contents of EXEC page onto a patched address
-    __writecr3(fp_data->target_cr3);
-    RtlCopyMemory(fp_data->patch_address,
-                  fp_data->shadow_page_base_for_exec->address +
-                      BYTE_OFFSET(fp_data->patch_address),
-                  fp_data->original_bytes.size());
-    __writecr3(vmm_cr3);
+                                 fp_data->page_base);
+    FppDisableFakePage(shared_fp_data, *fp_data, ept_data);
+
+    // Write back contents of EXEC page onto patched ranges
+    for (const auto& range : fp_data->ranges) {
+      GmWriteGuestMemory(
+          fp_data->target_cr3,
+          reinterpret_cast<UCHAR*>(fp_data->page_base) + range.offset,
+          fp_data->shadow_page_base_for_exec->address + range.offset,
+          range.size);
+    }
   }
-  __writecr0(cr0_old.all);
+  FppLeaveFakePageTable(shared_fp_data);
 }
 
 // Stop showing a shadow page
 _Use_decl_annotations_ static void FppDisableFakePage(
-    const FakePageData& fp_data, EptData* ept_data) {
-  const auto old_cr3 = __readcr3();
-  __writecr3(fp_data.target_cr3);
-
-  const auto page_base = (UCHAR*)PAGE_ALIGN(fp_data.patch_address);
-  const auto pa_base = UtilPaFromVa(page_base);
+    SharedFakePageData* shared_fp_data, const FakePageData& fp_data,
+    EptData* ept_data) {
+  // Restore the entry FppEnableFakePageForExec() changed
+  const auto pa_base = fp_data.pa_base_for_rw;
+  if (!pa_base) {
+    return;
+  }
+  KLOCK_QUEUE_HANDLE lock_handle = {};
+  KeAcquireInStackQueuedSpinLockAtDpcLevel(
+      FppGetPageLock(shared_fp_data, fp_data), &lock_handle);
   const auto ept_pt_entry = EptGetEptPtEntry(ept_data, pa_base);
+  if (!ept_pt_entry) {
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+    return;
+  }
+
+  // Writes are no longer tracked. Stop counting this view and have the copy
+  // synchronized when the fake page is enabled again. Write access restored
+  // here is not a grant and is not counted.
+  const auto page = fp_data.shadow_page_base_for_exec.get();
+  FppSetWriteAccess(ept_pt_entry, page, false, ept_data);
+  InterlockedExchange(&page->dirty, TRUE);
   ept_pt_entry->fields.write_access = true;
   ept_pt_entry->fields.read_access = true;
+  ept_pt_entry->fields.execute_access = true;
   ept_pt_entry->fields.physial_address = UtilPfnFromPa(pa_base);
+  ept_pt_entry->fields.software_slot = 0;
 
-  __writecr3(old_cr3);
-  UtilInveptGlobal();
+  // Map the surrounding 2 MB with a large page again if this was the last
+  // fake page in it
+  EptMergeLargePage(ept_data, pa_base);
+  EptRequestInvalidation(ept_data);
+  KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
 }
 
 _Use_decl_annotations_ void FpVmCallDeleteFakePages(
     SharedFakePageData* shared_fp_data) {
   const auto requester_cr3 = UtilVmRead(VmcsField::kGuestCr3);
 
-  // FIXME: lock the structure
-  const auto new_end = std::remove_if(
-      shared_fp_data->all_fp_data.begin(), shared_fp_data->all_fp_data.end(),
-      [requester_cr3](auto& fp_data) {
-        return fp_data->target_cr3 == requester_cr3;
+  KLOCK_QUEUE_HANDLE lock_handle = {};
+  KeAcquireInStackQueuedSpinLockAtDpcLevel(&shared_fp_data->table_lock,
+                                           &lock_handle);
+  // Nothing to do unless the requester has fake pages. Otherwise, a version
+  // without them needs to be built as indexes do not support removal.
+  const auto table = shared_fp_data->table;
+  if (!table->group_index.Find(requester_cr3)) {
+    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+    return;
+  }
+  const auto new_table = FppCopyFakePageTable(
+      *table, table->capacity,
+      [requester_cr3](const std::shared_ptr<FakePageData>& fp_data) {
+        return fp_data->target_cr3 != requester_cr3 ? fp_data : nullptr;
       });
-  shared_fp_data->all_fp_data.erase(new_end, shared_fp_data->all_fp_data.end());
+  FppReplaceFakePageTable(shared_fp_data, new_table);
+  FppReclaimFakePageTables(shared_fp_data);
+  InterlockedDecrement(FppGetOwnerFilterCounter(requester_cr3));
+  KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+}
+
+// Checks if the address space may own fake pages. Called by the guest.
+_Use_decl_annotations_ bool FpMayOwnFakePages(ULONG_PTR cr3) {
+  return *FppGetOwnerFilterCounter(cr3) != 0;
+}
+
+// Returns a counter in g_fpp_owner_filter for the address space. Address
+// spaces that share a counter are counted together.
+_Use_decl_annotations_ static volatile LONG* FppGetOwnerFilterCounter(
+    ULONG_PTR cr3) {
+  const auto hash =
+      ((cr3 & kFakePageCr3PageMask) >> PAGE_SHIFT) * kFakePageHashMultiplier;
+  return &g_fpp_owner_filter[hash >> (64 - kFppOwnerFilterBits)];
 }
 
 // Set MTF on the current processor
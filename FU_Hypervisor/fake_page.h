@@ -9,6 +9,7 @@
 #define FU_HYPERVISOR_FAKE_PAGE_H_
 
 #include <fltKernel.h>
+#include "../HyperPlatform/HyperPlatform/ia32_type.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -26,6 +27,7 @@
 //
 
 struct EptData;
+union EptCommonEntry;
 struct ProcessorFakePageData;
 struct SharedFakePageData;
 
@@ -50,20 +52,24 @@ _IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C
 
 _IRQL_requires_min_(DISPATCH_LEVEL) void FpHandleMonitorTrapFlag(
     _In_ ProcessorFakePageData* processor_fp_data,
-    _In_ const SharedFakePageData* shared_fp_data, _In_ EptData* ept_data);
+    _In_ SharedFakePageData* shared_fp_data, _In_ EptData* ept_data);
 
 _IRQL_requires_min_(DISPATCH_LEVEL) void FpHandleEptViolation(
     _In_ ProcessorFakePageData* processor_fp_data,
-    _In_ const SharedFakePageData* shared_fp_data, _In_ EptData* ept_data,
-    _In_ void* fault_va, ULONG64 fault_pa
-  );
+    _In_ SharedFakePageData* shared_fp_data, _In_ EptData* ept_data,
+    _Inout_ EptCommonEntry* ept_pt_entry, _Inout_ GpRegisters* gp_regs,
+    _In_ void* fault_va, _In_ ULONG64 fault_pa);
 
 _IRQL_requires_max_(PASSIVE_LEVEL) bool FpVmCallCreateFakePage(
     _In_ SharedFakePageData* shared_fp_data, _In_ void* context);
 
+_IRQL_requires_min_(DISPATCH_LEVEL) bool FpVmCallCreateAndEnableFakePages(
+    _In_ EptData* ept_data, _In_ SharedFakePageData* shared_fp_data,
+    _In_ void* context);
+
 _IRQL_requires_min_(DISPATCH_LEVEL) NTSTATUS
     FpVmCallEnableFakePages(_In_ EptData* ept_data,
-                            _In_ const SharedFakePageData* shared_fp_data);
+                            _In_ SharedFakePageData* shared_fp_data);
 
 _IRQL_requires_min_(DISPATCH_LEVEL) void FpVmCallDisableFakePages(
     _In_ EptData* ept_data, _In_ SharedFakePageData* shared_fp_data);
@@ -71,6 +77,14 @@ _IRQL_requires_min_(DISPATCH_LEVEL) void FpVmCallDisableFakePages(
 _IRQL_requires_min_(DISPATCH_LEVEL) void FpVmCallDeleteFakePages(
     _In_ SharedFakePageData* shared_fp_data);
 
+/// Checks if an address space may own fake pages without calling the VMM
+/// @param cr3   CR3 of the address space
+/// @return false if the address space surely owns no fake pages
+///
+/// May return true for an address space without fake pages, but never returns
+/// false for one with them.
+bool FpMayOwnFakePages(_In_ ULONG_PTR cr3);
+
 _IRQL_requires_min_(PASSIVE_LEVEL) EXTERN_C
     void SaveCpuinfo(
     SharedFakePageData* sharedata);
@@ -0,0 +1,169 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares a hash index of fake pages.
+///
+/// The index does not depend on the kernel so that it can be tested and
+/// measured in user mode.
+
+#ifndef FU_HYPERVISOR_FAKE_PAGE_INDEX_H_
+#define FU_HYPERVISOR_FAKE_PAGE_INDEX_H_
+
+#include <fltKernel.h>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// 2^64 divided by the golden ratio. Multiplying a key by this value spreads
+/// sequential PFNs and addresses across the top bits (Fibonacci hashing).
+static const ULONG64 kFakePageHashMultiplier = 0x9e3779b97f4a7c15;
+
+/// Bits of CR3 that hold the PML4 base. PCID (bits 0:11) and the no-flush bit
+/// (bit 63) are masked out so that the same address space is always matched.
+static const ULONG64 kFakePageCr3PageMask = 0x000ffffffffff000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// Open addressing hash index over fake pages or groups of them
+///
+/// Slots hold non-owning pointers to objects owned by the caller. Only the
+/// first object inserted for a key is indexed so that Find() returns the same
+/// object as a linear scan of the objects in insertion order would do.
+///
+/// The number of slots is fixed at construction. Insert() may run concurrently
+/// with Find() on other processors since a slot changes only once from nullptr
+/// to a fully initialized object.
+template <typename KeyTraits>
+class FakePageIndex {
+ public:
+  using KeyType = typename KeyTraits::KeyType;
+  using ValueType = typename KeyTraits::ValueType;
+
+  /// Creates slots enough to index capacity objects at the load factor of 0.5
+  /// @param capacity   The maximum number of objects to be inserted
+  explicit FakePageIndex(SIZE_T capacity) : shift_(63) {
+    SIZE_T number_of_slots = 2;
+    while (number_of_slots < capacity * 2) {
+      number_of_slots *= 2;
+      shift_--;
+    }
+    slots_.resize(number_of_slots, nullptr);
+  }
+
+  /// Returns the first object registered with the key
+  /// @param key   A key to look up
+  /// @return The object, or nullptr when no object has the key
+  ValueType* Find(const KeyType& key) const {
+    const auto mask = slots_.size() - 1;
+    for (auto i = HomeSlot(key);; i = (i + 1) & mask) {
+      const auto value = ReadSlot(i);
+      if (!value) {
+        return nullptr;
+      }
+      if (KeyTraits::KeyOf(*value) == key) {
+        return value;
+      }
+    }
+  }
+
+  /// Registers value unless an object with the same key is already indexed
+  /// @param value   An object to index. Must outlive the index.
+  ///
+  /// Must not be called more than capacity times.
+  void Insert(ValueType* value) {
+    const auto key = KeyTraits::KeyOf(*value);
+    const auto mask = slots_.size() - 1;
+    for (auto i = HomeSlot(key);; i = (i + 1) & mask) {
+      const auto indexed = ReadSlot(i);
+      if (!indexed) {
+        InterlockedExchangePointer(
+            reinterpret_cast<void* volatile*>(&slots_[i]), value);
+        return;
+      }
+      if (KeyTraits::KeyOf(*indexed) == key) {
+        return;
+      }
+    }
+  }
+
+ private:
+  // Takes the top bits of the hash, which are the best mixed ones
+  SIZE_T HomeSlot(const KeyType& key) const {
+    return static_cast<SIZE_T>(KeyTraits::Hash(key) >> shift_);
+  }
+
+  ValueType* ReadSlot(SIZE_T index) const {
+    return *static_cast<ValueType* const volatile*>(&slots_[index]);
+  }
+
+  std::vector<ValueType*> slots_;  // Size is a power of two
+  ULONG shift_;                    // 64 - log2(slots_.size())
+};
+
+/// Indexes a fake page by the PFN of the page seen for read and write.
+/// FakePage must have pa_base_for_rw.
+template <typename FakePage>
+struct FakePagePfnKeyTraits {
+  using KeyType = PFN_NUMBER;
+  using ValueType = FakePage;
+  static KeyType KeyOf(const FakePage& fp_data) {
+    return static_cast<PFN_NUMBER>(fp_data.pa_base_for_rw >> PAGE_SHIFT);
+  }
+  static ULONG64 Hash(const KeyType& key) {
+    return key * kFakePageHashMultiplier;
+  }
+};
+
+/// A pair of a masked CR3 and a page aligned VA of a patch address
+struct FakePageVaKey {
+  ULONG_PTR cr3;
+  void* page_base;
+
+  bool operator==(const FakePageVaKey& other) const {
+    return cr3 == other.cr3 && page_base == other.page_base;
+  }
+};
+
+/// Indexes a fake page by the target process and page of the patch address.
+/// FakePage must have target_cr3 and page_base.
+template <typename FakePage>
+struct FakePageVaKeyTraits {
+  using KeyType = FakePageVaKey;
+  using ValueType = FakePage;
+  static KeyType KeyOf(const FakePage& fp_data) {
+    return {fp_data.target_cr3 & kFakePageCr3PageMask, fp_data.page_base};
+  }
+  static ULONG64 Hash(const KeyType& key) {
+    const auto cr3_hash = (key.cr3 >> PAGE_SHIFT) * kFakePageHashMultiplier;
+    const auto va = reinterpret_cast<ULONG_PTR>(key.page_base);
+    return (cr3_hash ^ (va >> PAGE_SHIFT)) * kFakePageHashMultiplier;
+  }
+};
+
+/// Indexes a group of fake pages by CR3 of the target process as is, so that
+/// members are exactly what comparing target_cr3 with a requester's CR3 would
+/// select. Group must have target_cr3.
+template <typename Group>
+struct FakePageGroupKeyTraits {
+  using KeyType = ULONG_PTR;
+  using ValueType = Group;
+  static KeyType KeyOf(const Group& group) { return group.target_cr3; }
+  static ULONG64 Hash(const KeyType& key) {
+    return key * kFakePageHashMultiplier;
+  }
+};
+
+#endif  // FU_HYPERVISOR_FAKE_PAGE_INDEX_H_
@@ -0,0 +1,304 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements guest memory access functions.
+
+#include "guest_memory.h"
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/util.h"
+#include <intrin.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Bits of CR3 and paging-structure entries that hold a physical address of a
+// table or a 4 KB page. PCID (bits 0:11) and the no-flush bit (bit 63) of CR3
+// are masked out.
+static const ULONG64 kGmpPageFrameMask = 0x000ffffffffff000;
+
+// Bits of paging-structure entries used for a walk
+static const ULONG64 kGmpEntryPresent = 1ull << 0;
+static const ULONG64 kGmpEntryAccessed = 1ull << 5;
+static const ULONG64 kGmpEntryDirty = 1ull << 6;
+static const ULONG64 kGmpEntryLargePage = 1ull << 7;
+
+// Each level of tables is indexed by 9 bits of a linear address
+static const ULONG64 kGmpTableIndexMask = 0x1ff;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A page of VA used by one processor to access guest physical memory
+struct GuestMemoryWindow {
+  UCHAR* address;    // A reserved mapping address
+  HardwarePte* pte;  // PTE mapping address
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static GuestMemoryWindow* GmpGetWindow();
+
+static UCHAR* GmpMapPhysicalAddress(_In_ GuestMemoryWindow* window,
+                                    _In_ ULONG64 pa);
+
+static void GmpUnmap(_In_ GuestMemoryWindow* window);
+
+static ULONG64 GmpTranslate(_In_ GuestMemoryWindow* window,
+                            _In_ ULONG_PTR cr3, _In_ ULONG_PTR va,
+                            _Out_ ULONG64* entry_pa);
+
+static void GmpSetDirty(_In_ GuestMemoryWindow* window, _In_ ULONG64 entry_pa);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, GmInitialization)
+#pragma alloc_text(PAGE, GmTermination)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Windows indexed by a processor index
+static GuestMemoryWindow* g_gmp_windows;
+static ULONG g_gmp_number_of_windows;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Reserves a page of VA for each processor. The VMM maps guest physical pages
+// there by updating its PTE, instead of loading guest CR3.
+_Use_decl_annotations_ NTSTATUS GmInitialization() {
+  PAGED_CODE();
+
+  const auto number_of_windows =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto windows_size = sizeof(GuestMemoryWindow) * number_of_windows;
+  const auto windows = reinterpret_cast<GuestMemoryWindow*>(
+      ExAllocatePoolWithTag(NonPagedPool, windows_size,
+                            kHyperPlatformCommonPoolTag));
+  if (!windows) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(windows, windows_size);
+
+  for (ULONG i = 0; i < number_of_windows; ++i) {
+    const auto address =
+        MmAllocateMappingAddress(PAGE_SIZE, kHyperPlatformCommonPoolTag);
+    if (!address) {
+      for (ULONG j = 0; j < i; ++j) {
+        MmFreeMappingAddress(windows[j].address, kHyperPlatformCommonPoolTag);
+      }
+      ExFreePoolWithTag(windows, kHyperPlatformCommonPoolTag);
+      return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    windows[i].address = reinterpret_cast<UCHAR*>(address);
+    windows[i].pte = UtilAddressToPte(address);
+  }
+
+  g_gmp_windows = windows;
+  g_gmp_number_of_windows = number_of_windows;
+  return STATUS_SUCCESS;
+}
+
+// Releases windows. None of them is mapped as each is unmapped after use.
+_Use_decl_annotations_ void GmTermination() {
+  PAGED_CODE();
+
+  if (!g_gmp_windows) {
+    return;
+  }
+  for (ULONG i = 0; i < g_gmp_number_of_windows; ++i) {
+    MmFreeMappingAddress(g_gmp_windows[i].address,
+                         kHyperPlatformCommonPoolTag);
+  }
+  ExFreePoolWithTag(g_gmp_windows, kHyperPlatformCommonPoolTag);
+  g_gmp_windows = nullptr;
+  g_gmp_number_of_windows = 0;
+}
+
+// Translates a guest linear address to a physical address
+_Use_decl_annotations_ ULONG64 GmPaFromVa(ULONG_PTR cr3, const void* va) {
+  const auto window = GmpGetWindow();
+  if (!window) {
+    return 0;
+  }
+
+  ULONG64 entry_pa = 0;
+  const auto pa =
+      GmpTranslate(window, cr3, reinterpret_cast<ULONG_PTR>(va), &entry_pa);
+  GmpUnmap(window);
+  return pa;
+}
+
+// Reads guest memory page by page until a page that is not present
+_Use_decl_annotations_ SIZE_T GmReadGuestMemory(ULONG_PTR cr3, const void* va,
+                                                void* buffer, SIZE_T size) {
+  const auto window = GmpGetWindow();
+  if (!window) {
+    return 0;
+  }
+
+  const auto address = reinterpret_cast<ULONG_PTR>(va);
+  const auto bytes = reinterpret_cast<UCHAR*>(buffer);
+  SIZE_T copied = 0;
+  while (copied < size) {
+    ULONG64 entry_pa = 0;
+    const auto pa = GmpTranslate(window, cr3, address + copied, &entry_pa);
+    if (!pa) {
+      break;
+    }
+    auto chunk = PAGE_SIZE - BYTE_OFFSET(address + copied);
+    if (chunk > size - copied) {
+      chunk = size - copied;
+    }
+    RtlCopyMemory(bytes + copied, GmpMapPhysicalAddress(window, pa), chunk);
+    copied += chunk;
+  }
+  GmpUnmap(window);
+  return copied;
+}
+
+// Writes guest memory page by page until a page that is not present
+_Use_decl_annotations_ SIZE_T GmWriteGuestMemory(ULONG_PTR cr3, void* va,
+                                                 const void* buffer,
+                                                 SIZE_T size) {
+  const auto window = GmpGetWindow();
+  if (!window) {
+    return 0;
+  }
+
+  const auto address = reinterpret_cast<ULONG_PTR>(va);
+  const auto bytes = reinterpret_cast<const UCHAR*>(buffer);
+  SIZE_T copied = 0;
+  while (copied < size) {
+    ULONG64 entry_pa = 0;
+    const auto pa = GmpTranslate(window, cr3, address + copied, &entry_pa);
+    if (!pa) {
+      break;
+    }
+    auto chunk = PAGE_SIZE - BYTE_OFFSET(address + copied);
+    if (chunk > size - copied) {
+      chunk = size - copied;
+    }
+
+    // Mark the page as modified before writing it, as a processor does, so
+    // that the guest does not discard the contents as a clean page
+    GmpSetDirty(window, entry_pa);
+    RtlCopyMemory(GmpMapPhysicalAddress(window, pa), bytes + copied, chunk);
+    copied += chunk;
+  }
+  GmpUnmap(window);
+  return copied;
+}
+
+// Returns the window of the current processor, or nullptr if it is not
+// available
+_Use_decl_annotations_ static GuestMemoryWindow* GmpGetWindow() {
+  const auto index = KeGetCurrentProcessorNumberEx(nullptr);
+  if (index >= g_gmp_number_of_windows) {
+    return nullptr;
+  }
+  return &g_gmp_windows[index];
+}
+
+// Maps a physical page into the window and returns an address of pa in it.
+// The PTE is left unchanged when the page is already mapped.
+_Use_decl_annotations_ static UCHAR* GmpMapPhysicalAddress(
+    GuestMemoryWindow* window, ULONG64 pa) {
+  const auto pfn = UtilPfnFromPa(pa);
+  if (!window->pte->valid || window->pte->page_frame_number != pfn) {
+    HardwarePte pte = {};
+    pte.valid = true;
+    pte.write = true;
+    pte.accessed = true;
+    pte.dirty = true;
+    pte.page_frame_number = pfn;
+    *window->pte = pte;
+    __invlpg(window->address);
+  }
+  return window->address + BYTE_OFFSET(pa);
+}
+
+// Unmaps the window so that no stale translation of it is left on any
+// processor
+_Use_decl_annotations_ static void GmpUnmap(GuestMemoryWindow* window) {
+  if (!window->pte->valid) {
+    return;
+  }
+  const HardwarePte pte = {};
+  *window->pte = pte;
+  __invlpg(window->address);
+}
+
+// Walks 4-level paging tables from the PML4 down to the PT or a large page.
+// Returns a physical address of va and that of the entry that mapped it, or 0
+// if va is not present. Translations are not cached, since other processors
+// may change any level of the tables while the VMM runs on this processor.
+_Use_decl_annotations_ static ULONG64 GmpTranslate(GuestMemoryWindow* window,
+                                                   ULONG_PTR cr3,
+                                                   ULONG_PTR va,
+                                                   ULONG64* entry_pa) {
+  *entry_pa = 0;
+
+  auto table_pa = cr3 & kGmpPageFrameMask;
+  for (auto table_level = 4ul; table_level; --table_level) {
+    const auto shift = PAGE_SHIFT + (table_level - 1) * 9;
+    const auto current_entry_pa =
+        table_pa + ((va >> shift) & kGmpTableIndexMask) * sizeof(ULONG64);
+    const auto current_entry = *reinterpret_cast<volatile ULONG64*>(
+        GmpMapPhysicalAddress(window, current_entry_pa));
+    if (!(current_entry & kGmpEntryPresent)) {
+      return 0;
+    }
+
+    // A PDPTE and a PDE may map a 1 GB and a 2 MB page respectively. Bit 12
+    // of such an entry is PAT and masked out with the offset.
+    const auto is_leaf = table_level == 1 ||
+                         (table_level <= 3 &&
+                          (current_entry & kGmpEntryLargePage));
+    if (is_leaf) {
+      const auto offset_mask = (1ull << shift) - 1;
+      *entry_pa = current_entry_pa;
+      return (current_entry & kGmpPageFrameMask & ~offset_mask) |
+             (va & offset_mask);
+    }
+    table_pa = current_entry & kGmpPageFrameMask;
+  }
+  return 0;
+}
+
+// Sets the accessed and dirty bits of an entry mapping a page unless the entry
+// has been made not present since the walk
+_Use_decl_annotations_ static void GmpSetDirty(GuestMemoryWindow* window,
+                                               ULONG64 entry_pa) {
+  const auto bits = kGmpEntryAccessed | kGmpEntryDirty;
+  const auto entry_address = reinterpret_cast<volatile LONG64*>(
+      GmpMapPhysicalAddress(window, entry_pa));
+  auto entry = static_cast<ULONG64>(*entry_address);
+  while ((entry & kGmpEntryPresent) && (entry & bits) != bits) {
+    const auto old_entry = static_cast<ULONG64>(InterlockedCompareExchange64(
+        entry_address, static_cast<LONG64>(entry | bits),
+        static_cast<LONG64>(entry)));
+    if (old_entry == entry) {
+      break;
+    }
+    entry = old_entry;
+  }
+}
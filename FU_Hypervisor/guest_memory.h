@@ -0,0 +1,87 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to guest memory access functions.
+
+#ifndef FU_HYPERVISOR_GUEST_MEMORY_H_
+#define FU_HYPERVISOR_GUEST_MEMORY_H_
+
+#include <fltKernel.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Reserves a mapping window for each processor
+/// @return STATUS_SUCCESS on success
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS GmInitialization();
+
+/// Releases mapping windows
+_IRQL_requires_max_(PASSIVE_LEVEL) void GmTermination();
+
+/// Translates a guest linear address by walking guest page tables
+/// @param cr3   Guest CR3 selecting the address space
+/// @param va   A linear address to translate
+/// @return A physical address, or 0 if \a va is not present
+///
+/// Walks 4-level paging tables in software, so that the VMM does not have to
+/// load \a cr3. PCID and other control bits in \a cr3 are ignored. 2 MB and
+/// 1 GB pages are supported.
+_IRQL_requires_min_(DISPATCH_LEVEL) ULONG64
+    GmPaFromVa(_In_ ULONG_PTR cr3, _In_ const void* va);
+
+/// Reads guest memory as seen through guest page tables
+/// @param cr3   Guest CR3 selecting the address space
+/// @param va   A linear address to read from
+/// @param buffer   A buffer to receive bytes
+/// @param size   The number of bytes to read
+/// @return The number of bytes read. Smaller than \a size when reading stopped
+///         at a page that is not present.
+_IRQL_requires_min_(DISPATCH_LEVEL) SIZE_T
+    GmReadGuestMemory(_In_ ULONG_PTR cr3, _In_ const void* va,
+                      _Out_writes_bytes_(size) void* buffer, _In_ SIZE_T size);
+
+/// Writes guest memory as seen through guest page tables
+/// @param cr3   Guest CR3 selecting the address space
+/// @param va   A linear address to write to
+/// @param buffer   Bytes to write
+/// @param size   The number of bytes to write
+/// @return The number of bytes written. Smaller than \a size when writing
+///         stopped at a page that is not present.
+///
+/// Writes regardless of write access in guest page tables, as writing with
+/// CR0.WP cleared does, and sets the accessed and dirty bits of pages written.
+_IRQL_requires_min_(DISPATCH_LEVEL) SIZE_T
+    GmWriteGuestMemory(_In_ ULONG_PTR cr3, _In_ void* va,
+                       _In_reads_bytes_(size) const void* buffer,
+                       _In_ SIZE_T size);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // FU_HYPERVISOR_GUEST_MEMORY_H_
@@ -0,0 +1,488 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements load instruction emulation functions.
+
+#include "load_emulator.h"
+#include "guest_memory.h"
+#include "../HyperPlatform/HyperPlatform/util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// An encoding of RSP in ModRM and SIB
+static const ULONG kLepRegisterRsp = 4;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// An operation of a supported instruction
+enum class LoadOperation {
+  kMov,                     // MOV r, r/m
+  kMovZeroExtend,           // MOVZX r, r/m
+  kMovSignExtend,           // MOVSX r, r/m and MOVSXD r, r/m
+  kCmpRegisterWithMemory,   // CMP r, r/m
+  kCmpMemoryWithRegister,   // CMP r/m, r
+  kCmpMemoryWithImmediate,  // CMP r/m, imm
+};
+
+// A decoded instruction
+struct DecodedLoad {
+  LoadOperation operation;
+  SIZE_T length;         // The length of the instruction in bytes
+  ULONG operand_size;    // The size of a register or immediate operand
+  ULONG memory_size;     // The size of the memory operand
+  ULONG reg;             // ModRM.reg extended with REX.R
+  bool has_rex;          // Selects SPL-DIL over AH-BH for 8-bit registers
+  ULONG_PTR address;     // A linear address of the memory operand
+  ULONG64 immediate;     // Sign extended to 64 bits
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static bool LepDecode(_In_ GpRegisters* gp_regs,
+                      _In_reads_(size) const UCHAR* instruction,
+                      _In_ SIZE_T size, _Out_ DecodedLoad* decoded);
+
+static bool LepReadImmediate(_In_reads_(size) const UCHAR* instruction,
+                             _In_ SIZE_T size, _Inout_ SIZE_T* index,
+                             _In_ ULONG immediate_size, _Out_ ULONG64* value);
+
+static ULONG_PTR* LepSelectRegister(_In_ GpRegisters* gp_regs,
+                                    _In_ ULONG index);
+
+static ULONG_PTR LepReadRegister(_In_ GpRegisters* gp_regs, _In_ ULONG index);
+
+static void LepWriteRegister(_Inout_ GpRegisters* gp_regs, _In_ ULONG index,
+                             _In_ ULONG_PTR value);
+
+static ULONG64 LepReadRegisterOperand(_In_ GpRegisters* gp_regs,
+                                      _In_ const DecodedLoad& decoded);
+
+static void LepWriteRegisterOperand(_Inout_ GpRegisters* gp_regs,
+                                    _In_ const DecodedLoad& decoded,
+                                    _In_ ULONG64 value);
+
+static bool LepReadGuestMemory(_In_ ULONG_PTR address, _In_ ULONG size,
+                               _Out_ ULONG64* value);
+
+static ULONG64 LepSizeMask(_In_ ULONG size);
+
+static ULONG64 LepSignExtend(_In_ ULONG64 value, _In_ ULONG size);
+
+static FlagRegister LepCompare(_In_ FlagRegister flags, _In_ ULONG64 lhs,
+                               _In_ ULONG64 rhs, _In_ ULONG size);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Emulates a supported instruction that read fault_va
+_Use_decl_annotations_ bool LeEmulateLoad(GpRegisters* gp_regs,
+                                          const UCHAR* instruction,
+                                          SIZE_T instruction_size,
+                                          ULONG_PTR fault_va) {
+  // Only 64-bit code is decoded
+  const VmxRegmentDescriptorAccessRight cs_ar = {
+      static_cast<unsigned int>(UtilVmRead(VmcsField::kGuestCsArBytes))};
+  if (!cs_ar.fields.l) {
+    return false;
+  }
+
+  // Let the processor deal with single-stepping and interrupt shadow
+  FlagRegister flags = {UtilVmRead(VmcsField::kGuestRflags)};
+  if (flags.fields.tf ||
+      (UtilVmRead(VmcsField::kGuestInterruptibilityInfo) & 3)) {
+    return false;
+  }
+
+  DecodedLoad decoded = {};
+  if (!LepDecode(gp_regs, instruction, instruction_size, &decoded)) {
+    return false;
+  }
+
+  // Make sure that the instruction is what caused the violation
+  if (fault_va < decoded.address ||
+      fault_va - decoded.address >= decoded.memory_size) {
+    return false;
+  }
+
+  ULONG64 memory = 0;
+  if (!LepReadGuestMemory(decoded.address, decoded.memory_size, &memory)) {
+    return false;
+  }
+
+  switch (decoded.operation) {
+    case LoadOperation::kMov:
+    case LoadOperation::kMovZeroExtend:
+      LepWriteRegisterOperand(gp_regs, decoded, memory);
+      break;
+    case LoadOperation::kMovSignExtend:
+      LepWriteRegisterOperand(gp_regs, decoded,
+                              LepSignExtend(memory, decoded.memory_size));
+      break;
+    case LoadOperation::kCmpRegisterWithMemory:
+      flags = LepCompare(flags, LepReadRegisterOperand(gp_regs, decoded),
+                         memory, decoded.operand_size);
+      break;
+    case LoadOperation::kCmpMemoryWithRegister:
+      flags = LepCompare(flags, memory,
+                         LepReadRegisterOperand(gp_regs, decoded),
+                         decoded.operand_size);
+      break;
+    case LoadOperation::kCmpMemoryWithImmediate:
+      flags = LepCompare(flags, memory, decoded.immediate,
+                         decoded.operand_size);
+      break;
+  }
+  UtilVmWrite(VmcsField::kGuestRflags, flags.all);
+  UtilVmWrite(VmcsField::kGuestRip,
+              UtilVmRead(VmcsField::kGuestRip) + decoded.length);
+  return true;
+}
+
+// Decodes a supported instruction and computes the address of its memory
+// operand. Returns false for anything else.
+_Use_decl_annotations_ static bool LepDecode(GpRegisters* gp_regs,
+                                             const UCHAR* instruction,
+                                             SIZE_T size,
+                                             DecodedLoad* decoded) {
+  SIZE_T i = 0;
+
+  // Legacy prefixes. Other than these, prefixes are not supported and fail as
+  // unknown opcodes.
+  auto operand_size_override = false;
+  ULONG_PTR segment_base = 0;
+  for (; i < size; ++i) {
+    const auto prefix = instruction[i];
+    if (prefix == 0x66) {
+      operand_size_override = true;
+    } else if (prefix == 0x64) {
+      segment_base = UtilVmRead(VmcsField::kGuestFsBase);
+    } else if (prefix == 0x65) {
+      segment_base = UtilVmRead(VmcsField::kGuestGsBase);
+    } else if (prefix == 0x26 || prefix == 0x2e || prefix == 0x36 ||
+               prefix == 0x3e) {
+      // Segment overrides that are ignored in 64-bit mode
+    } else {
+      break;
+    }
+  }
+
+  // REX prefix
+  UCHAR rex = 0;
+  if (i < size && (instruction[i] & 0xf0) == 0x40) {
+    rex = instruction[i++];
+  }
+  const auto rex_w = !!(rex & 8);
+  const auto rex_r = (rex & 4) ? 8ul : 0ul;
+  const auto rex_x = (rex & 2) ? 8ul : 0ul;
+  const auto rex_b = (rex & 1) ? 8ul : 0ul;
+  const ULONG operand_size = rex_w ? 8 : operand_size_override ? 2 : 4;
+
+  // Opcode
+  if (i >= size) {
+    return false;
+  }
+  ULONG immediate_size = 0;
+  const auto opcode = instruction[i++];
+  switch (opcode) {
+    case 0x8a:  // MOV r8, r/m8
+      *decoded = {LoadOperation::kMov, 0, 1, 1};
+      break;
+    case 0x8b:  // MOV r, r/m
+      *decoded = {LoadOperation::kMov, 0, operand_size, operand_size};
+      break;
+    case 0x63:  // MOVSXD r64, r/m32
+      if (!rex_w) {
+        return false;
+      }
+      *decoded = {LoadOperation::kMovSignExtend, 0, 8, 4};
+      break;
+    case 0x3a:  // CMP r8, r/m8
+      *decoded = {LoadOperation::kCmpRegisterWithMemory, 0, 1, 1};
+      break;
+    case 0x3b:  // CMP r, r/m
+      *decoded = {LoadOperation::kCmpRegisterWithMemory, 0, operand_size,
+                  operand_size};
+      break;
+    case 0x38:  // CMP r/m8, r8
+      *decoded = {LoadOperation::kCmpMemoryWithRegister, 0, 1, 1};
+      break;
+    case 0x39:  // CMP r/m, r
+      *decoded = {LoadOperation::kCmpMemoryWithRegister, 0, operand_size,
+                  operand_size};
+      break;
+    case 0x80:  // CMP r/m8, imm8
+      *decoded = {LoadOperation::kCmpMemoryWithImmediate, 0, 1, 1};
+      immediate_size = 1;
+      break;
+    case 0x81:  // CMP r/m, imm16/32
+      *decoded = {LoadOperation::kCmpMemoryWithImmediate, 0, operand_size,
+                  operand_size};
+      immediate_size = (operand_size == 2) ? 2 : 4;
+      break;
+    case 0x83:  // CMP r/m, imm8
+      *decoded = {LoadOperation::kCmpMemoryWithImmediate, 0, operand_size,
+                  operand_size};
+      immediate_size = 1;
+      break;
+    case 0x0f:
+      if (i >= size) {
+        return false;
+      }
+      switch (instruction[i++]) {
+        case 0xb6:  // MOVZX r, r/m8
+          *decoded = {LoadOperation::kMovZeroExtend, 0, operand_size, 1};
+          break;
+        case 0xb7:  // MOVZX r, r/m16
+          *decoded = {LoadOperation::kMovZeroExtend, 0, operand_size, 2};
+          break;
+        case 0xbe:  // MOVSX r, r/m8
+          *decoded = {LoadOperation::kMovSignExtend, 0, operand_size, 1};
+          break;
+        case 0xbf:  // MOVSX r, r/m16
+          *decoded = {LoadOperation::kMovSignExtend, 0, operand_size, 2};
+          break;
+        default:
+          return false;
+      }
+      break;
+    default:
+      return false;
+  }
+  decoded->has_rex = !!rex;
+
+  // ModRM. Only a memory operand is supported.
+  if (i >= size) {
+    return false;
+  }
+  const auto modrm = instruction[i++];
+  const auto mod = modrm >> 6;
+  const auto rm = modrm & 7ul;
+  decoded->reg = ((modrm >> 3) & 7ul) | rex_r;
+  if (mod == 3) {
+    return false;
+  }
+  if (decoded->operation == LoadOperation::kCmpMemoryWithImmediate &&
+      (decoded->reg & 7) != 7) {
+    return false;  // Not CMP but other group 1 instructions
+  }
+
+  // SIB and base register
+  ULONG_PTR address = 0;
+  auto rip_relative = false;
+  auto has_disp32 = (mod == 2);
+  if (rm == 4) {
+    if (i >= size) {
+      return false;
+    }
+    const auto sib = instruction[i++];
+    const auto scale = sib >> 6;
+    const auto index = ((sib >> 3) & 7ul) | rex_x;
+    const auto base = sib & 7ul;
+    if (index != kLepRegisterRsp) {
+      address += LepReadRegister(gp_regs, index) << scale;
+    }
+    if (base == 5 && mod == 0) {
+      has_disp32 = true;  // No base register
+    } else {
+      address += LepReadRegister(gp_regs, base | rex_b);
+    }
+  } else if (rm == 5 && mod == 0) {
+    rip_relative = true;
+    has_disp32 = true;
+  } else {
+    address += LepReadRegister(gp_regs, rm | rex_b);
+  }
+
+  // Displacement and immediate
+  ULONG64 displacement = 0;
+  if (mod == 1 || has_disp32) {
+    if (!LepReadImmediate(instruction, size, &i, (mod == 1) ? 1 : 4,
+                          &displacement)) {
+      return false;
+    }
+  }
+  if (immediate_size &&
+      !LepReadImmediate(instruction, size, &i, immediate_size,
+                        &decoded->immediate)) {
+    return false;
+  }
+
+  decoded->length = i;
+  address += static_cast<ULONG_PTR>(displacement);
+  if (rip_relative) {
+    address += UtilVmRead(VmcsField::kGuestRip) + decoded->length;
+  }
+  decoded->address = address + segment_base;
+  return true;
+}
+
+// Reads a little endian immediate value at *index and sign extends it
+_Use_decl_annotations_ static bool LepReadImmediate(const UCHAR* instruction,
+                                                    SIZE_T size, SIZE_T* index,
+                                                    ULONG immediate_size,
+                                                    ULONG64* value) {
+  if (*index + immediate_size > size) {
+    return false;
+  }
+  ULONG64 immediate = 0;
+  for (ULONG i = 0; i < immediate_size; ++i) {
+    immediate |= static_cast<ULONG64>(instruction[*index + i]) << (i * 8);
+  }
+  *index += immediate_size;
+  *value = LepSignExtend(immediate, immediate_size);
+  return true;
+}
+
+// Selects a guest register encoded as index in ModRM or SIB. Returns nullptr
+// for RSP, which is not saved on the stack on VM-exit.
+_Use_decl_annotations_ static ULONG_PTR* LepSelectRegister(
+    GpRegisters* gp_regs, ULONG index) {
+  ULONG_PTR* register_used = nullptr;
+  // clang-format off
+  switch (index) {
+    case 0: register_used = &gp_regs->ax; break;
+    case 1: register_used = &gp_regs->cx; break;
+    case 2: register_used = &gp_regs->dx; break;
+    case 3: register_used = &gp_regs->bx; break;
+    case 5: register_used = &gp_regs->bp; break;
+    case 6: register_used = &gp_regs->si; break;
+    case 7: register_used = &gp_regs->di; break;
+#if defined(_AMD64_)
+    case 8: register_used = &gp_regs->r8; break;
+    case 9: register_used = &gp_regs->r9; break;
+    case 10: register_used = &gp_regs->r10; break;
+    case 11: register_used = &gp_regs->r11; break;
+    case 12: register_used = &gp_regs->r12; break;
+    case 13: register_used = &gp_regs->r13; break;
+    case 14: register_used = &gp_regs->r14; break;
+    case 15: register_used = &gp_regs->r15; break;
+#endif
+    default: break;
+  }
+  // clang-format on
+  return register_used;
+}
+
+// Reads a guest register encoded as index in ModRM or SIB
+_Use_decl_annotations_ static ULONG_PTR LepReadRegister(GpRegisters* gp_regs,
+                                                        ULONG index) {
+  if (index == kLepRegisterRsp) {
+    return UtilVmRead(VmcsField::kGuestRsp);
+  }
+  return *LepSelectRegister(gp_regs, index);
+}
+
+// Writes a guest register encoded as index in ModRM
+_Use_decl_annotations_ static void LepWriteRegister(GpRegisters* gp_regs,
+                                                    ULONG index,
+                                                    ULONG_PTR value) {
+  if (index == kLepRegisterRsp) {
+    UtilVmWrite(VmcsField::kGuestRsp, value);
+    return;
+  }
+  *LepSelectRegister(gp_regs, index) = value;
+}
+
+// Reads the register operand. Without REX, 8-bit registers 4 to 7 are AH, CH,
+// DH and BH.
+_Use_decl_annotations_ static ULONG64 LepReadRegisterOperand(
+    GpRegisters* gp_regs, const DecodedLoad& decoded) {
+  if (decoded.operand_size == 1 && !decoded.has_rex && decoded.reg >= 4) {
+    return (LepReadRegister(gp_regs, decoded.reg - 4) >> 8) & 0xff;
+  }
+  return LepReadRegister(gp_regs, decoded.reg) &
+         LepSizeMask(decoded.operand_size);
+}
+
+// Writes the register operand. A 32-bit write clears the upper 32 bits, and
+// 8- and 16-bit writes preserve the other bits as a processor does.
+_Use_decl_annotations_ static void LepWriteRegisterOperand(
+    GpRegisters* gp_regs, const DecodedLoad& decoded, ULONG64 value) {
+  auto index = decoded.reg;
+  auto shift = 0ul;
+  if (decoded.operand_size == 1 && !decoded.has_rex && index >= 4) {
+    index -= 4;
+    shift = 8;
+  }
+
+  const auto mask = LepSizeMask(decoded.operand_size) << shift;
+  auto new_value = (value << shift) & mask;
+  if (decoded.operand_size < 4) {
+    new_value |= LepReadRegister(gp_regs, index) & ~mask;
+  }
+  LepWriteRegister(gp_regs, index, static_cast<ULONG_PTR>(new_value));
+}
+
+// Reads size bytes at the guest linear address. Fails if any of them is not
+// present.
+_Use_decl_annotations_ static bool LepReadGuestMemory(ULONG_PTR address,
+                                                      ULONG size,
+                                                      ULONG64* value) {
+  ULONG64 bytes = 0;
+  const auto present =
+      GmReadGuestMemory(UtilVmRead(VmcsField::kGuestCr3),
+                        reinterpret_cast<void*>(address), &bytes, size) == size;
+  *value = present ? bytes : 0;
+  return present;
+}
+
+// Returns a mask for an operand of size bytes
+_Use_decl_annotations_ static ULONG64 LepSizeMask(ULONG size) {
+  return (size == 8) ? MAXULONG64 : (1ull << (size * 8)) - 1;
+}
+
+// Sign extends a value of size bytes to 64 bits
+_Use_decl_annotations_ static ULONG64 LepSignExtend(ULONG64 value,
+                                                    ULONG size) {
+  const auto sign_bit = 1ull << (size * 8 - 1);
+  value &= LepSizeMask(size);
+  return (value & sign_bit) ? value | ~LepSizeMask(size) : value;
+}
+
+// Returns flags updated as CMP lhs, rhs with operands of size bytes does
+_Use_decl_annotations_ static FlagRegister LepCompare(FlagRegister flags,
+                                                      ULONG64 lhs, ULONG64 rhs,
+                                                      ULONG size) {
+  const auto mask = LepSizeMask(size);
+  const auto sign_bit = 1ull << (size * 8 - 1);
+  lhs &= mask;
+  rhs &= mask;
+  const auto result = (lhs - rhs) & mask;
+
+  // PF is set when the low byte has an even number of set bits
+  auto parity = static_cast<UCHAR>(result);
+  parity ^= parity >> 4;
+  parity ^= parity >> 2;
+  parity ^= parity >> 1;
+
+  flags.fields.cf = lhs < rhs;
+  flags.fields.pf = !(parity & 1);
+  flags.fields.af = !!((lhs ^ rhs ^ result) & 0x10);
+  flags.fields.zf = !result;
+  flags.fields.sf = !!(result & sign_bit);
+  flags.fields.of = !!((lhs ^ rhs) & (lhs ^ result) & sign_bit);
+  return flags;
+}
@@ -0,0 +1,63 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to load instruction emulation functions.
+
+#ifndef FU_HYPERVISOR_LOAD_EMULATOR_H_
+#define FU_HYPERVISOR_LOAD_EMULATOR_H_
+
+#include <fltKernel.h>
+#include "../HyperPlatform/HyperPlatform/ia32_type.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// The maximum length of an x86 instruction in bytes
+static const SIZE_T kLeMaxInstructionLength = 15;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Emulates an instruction that caused EPT violation by reading memory
+/// @param gp_regs   Guest general purpose registers
+/// @param instruction   Bytes at the guest RIP as fetched for execution
+/// @param instruction_size   The number of valid bytes in \a instruction
+/// @param fault_va   A linear address of the read access
+/// @return true if the instruction was emulated and the guest RIP was advanced
+///
+/// Supports MOV, MOVZX, MOVSX, MOVSXD and CMP with a memory operand in 64-bit
+/// mode. The memory operand is read from the guest as seen by the VMM, that
+/// is, without EPT. Returns false without changing guest state for anything
+/// else so that a caller can fall back to letting the guest access the page.
+_IRQL_requires_min_(DISPATCH_LEVEL) bool LeEmulateLoad(
+    _Inout_ GpRegisters* gp_regs,
+    _In_reads_(instruction_size) const UCHAR* instruction,
+    _In_ SIZE_T instruction_size, _In_ ULONG_PTR fault_va);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // FU_HYPERVISOR_LOAD_EMULATOR_H_
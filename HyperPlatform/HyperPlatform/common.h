@@ -86,6 +86,21 @@
 /// negative performance impact.
 #define HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER 1
 
+/// Share one EPT across all processors
+///
+/// When set to non 0, all processors use the same EptData owned by
+/// SharedProcessorData, and changes to EPT are made once instead of on every
+/// processor. Each change requests invalidation with EptRequestInvalidation(),
+/// and every processor invalidates EPT before it next returns to the guest.
+#define HYPERPLATFORM_COMMON_SHARE_EPT 1
+
+/// Populate EPT on first access instead of at initialization
+///
+/// When set to non 0, EptInitialization() maps only the APIC page, and any
+/// other guest physical page is mapped on its first EPT violation. It makes
+/// loading faster and EPT smaller, at the cost of VM-exits on first touch.
+#define HYPERPLATFORM_COMMON_LAZY_EPT 0
+
 /// A pool tag
 static const ULONG kHyperPlatformCommonPoolTag = 'PpyH';
 
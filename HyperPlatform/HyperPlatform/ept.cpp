@@ -6,9 +6,11 @@
 /// Implements EPT functions.
 
 #include "ept.h"
+#include <intrin.h>
 #include "asm.h"
 #include "common.h"
 #include "log.h"
+#include "mtrr.h"
 #include "util.h"
 #include "performance.h"
 #include "../../FU_Hypervisor/fake_page.h"
@@ -48,46 +50,138 @@ static const auto kEptpPtiShift = 12ull;
 // Use 9 bits; 0b0000_0000_0000_0000_0000_0000_0001_1111_1111
 static const auto kEptpPtxMask = 0x1ffull;
 
-// How many EPT entries are preallocated. When the number exceeds it, the
-// hypervisor issues a bugcheck.
-static const auto kEptpNumberOfPreallocatedEntries = 50;
+// How many free EPT tables are kept for VMX-root mode, where no more can be
+// allocated. A worker thread refills them up to the high watermark when fewer
+// than the low watermark are left. When they run out, the hypervisor issues a
+// bugcheck. Page tables to split large pages are taken from them as well.
+static const auto kEptpLowWatermarkOfFreeTables = 256l;
+static const auto kEptpHighWatermarkOfFreeTables = 1024l;
 
-// Architecture defined number of variable range MTRRs
-static const auto kEptpNumOfMaxVariableRangeMtrrs = 255;
+// An interval in milliseconds the worker thread checks the number of free
+// tables and retired tables
+static const auto kEptpRefillIntervalMsec = 50l;
 
-// Architecture defined number of fixed range MTRRs (1 for 64k, 2 for 16k, 8
-// for 4k)
-static const auto kEptpNumOfFixedRangeMtrrs = 1 + 2 + 8;
+// The maximum number of threads building EPT in parallel, including the
+// thread calling EptInitialization()
+static const auto kEptpMaxBuildThreads = 16ul;
 
-// A size of array to store all possible MTRRs
-static const auto kEptpMtrrEntriesSize =
-    kEptpNumOfMaxVariableRangeMtrrs + kEptpNumOfFixedRangeMtrrs;
+// Whether a page accessed first time is mapped with a 2 MB page when possible
+// under HYPERPLATFORM_COMMON_LAZY_EPT, instead of a 4 KB page
+static const auto kEptpPopulateLazilyWithLargePages = true;
+
+// How many EPT tables are carved from a single chunk of contiguous memory
+static const auto kEptpTablesPerChunk = 64ul;
+
+// A size of memory mapped by a single EPT PDE with the large page bit
+static const auto kEptpLargePageSize = 512ull * PAGE_SIZE;
+
+// A size of memory mapped by a single EPT PDPTE with the large page bit
+static const auto kEptpHugePageSize = 512ull * kEptpLargePageSize;
+
+// A number of entries in a per-processor translation cache. Must be a power of
+// two.
+static const auto kEptpTranslationCacheSize = 64ul;
+
+// How many tables removed by merging large pages can wait until all processors
+// invalidate EPT before being freed. Merging is skipped while all are waiting.
+static const auto kEptpRetiredTablesSize = 64ul;
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
 //
 
-#include <pshpack1.h>
-struct MtrrData {
-  bool enabled;        //<! Whether this entry is valid
-  bool fixedMtrr;      //<! Whether this entry manages a fixed range MTRR
-  UCHAR type;          //<! Memory Type (such as WB, UC)
-  bool reserverd1;     //<! Padding
-  ULONG reserverd2;    //<! Padding
-  ULONG64 range_base;  //<! A base address of a range managed by this entry
-  ULONG64 range_end;   //<! An end address of a range managed by this entry
+// Caches an EPT entry found for a guest physical page
+struct EptTranslationCacheEntry {
+  ULONG64 pfn;            // A guest physical page number
+  EptCommonEntry *entry;  // An EPT entry mapping it, or nullptr if not cached
+};
+
+// A direct-mapped cache of EPT entries used by one processor
+struct EptTranslationCache {
+  long generation;  // EptData::generation that entries are valid for
+  EptTranslationCacheEntry entries[kEptpTranslationCacheSize];
+};
+
+// A physically contiguous block of memory EPT tables are carved from
+struct EptTableChunk {
+  EptTableChunk *next;   // A chunk added before this chunk
+  EptCommonEntry *base;  // kEptpTablesPerChunk tables
+};
+
+// Allocates EPT tables from chunks and recycles freed tables. Free tables are
+// kept in a lock-free list since VMX-root mode takes them while the worker
+// thread adds them.
+struct EptTableArena {
+  SLIST_HEADER free_tables;  // Free tables linked by their first bytes
+  EptTableChunk *volatile chunks;  // The latest chunk
+  volatile long used_count;  // # of tables in use
+  volatile long lowest_free_count;  // The fewest free tables seen in VMX-root
+  volatile long refill_count;       // # of times the worker added tables
+  volatile bool refill_thread_should_be_alive;
+  HANDLE refill_thread_handle;
+};
+
+// A table removed from EPT. It may still be walked by processors until they
+// invalidate EPT for the generation.
+struct EptRetiredTable {
+  EptCommonEntry *table;
+  LONG64 generation;  // Requested after the table was removed
+};
+
+// Per-processor state of deferred invalidation. Padded to a cache line as it
+// is written on VM-exits after EPT was changed.
+struct EptInvalidationBatch {
+  // EptData::invalidation_generation this processor last invalidated EPT for
+  volatile LONG64 flushed_generation;
+  UCHAR padding[SYSTEM_CACHE_ALIGNMENT_SIZE - sizeof(LONG64)];
+};
+
+// Describes EPT being built by threads. Physical memory is split into 1 GB
+// slices, each of which is mapped by one PDPT entry, so that threads never
+// write the same entry nor a table under it.
+struct EptBuildContext {
+  struct EptData *ept_data;
+  EptCommonEntry *ept_pml4;
+  const PhysicalMemoryDescriptor *pm_ranges;
+  ULONG max_leaf_level;
+  ULONG64 *slices;           // Base addresses of slices to map
+  long number_of_slices;     // # of slices
+  volatile long next_slice;  // An index of the slice to be mapped next
+  volatile long failed;      // Non zero when any thread failed to map a slice
 };
-#include <poppack.h>
-static_assert(sizeof(MtrrData) == 24, "Size check");
 
 // EPT related data stored in ProcessorData
 struct EptData {
   EptPointer *ept_pointer;
   EptCommonEntry *ept_pml4;
 
-  EptCommonEntry **preallocated_entries;  // An array of pre-allocated entries
-  volatile long preallocated_entries_count;  // # of used pre-allocated entries
+  EptTableArena table_arena;  // Backs all EPT tables including ept_pml4
+
+  ULONG max_leaf_level;  // The highest level that can map a page (1 to 3)
+
+  EptTranslationCache *translation_caches;  // Per-processor caches
+  ULONG number_of_translation_caches;       // # of translation_caches
+  volatile long generation;  // Incremented when tables are split or merged
+  volatile long first_touch_count;  // # of pages populated on first access
+  volatile long device_memory_miss_count;  // # of device pages mapped on miss
+
+  EptInvalidationBatch *invalidation_batches;  // Per-processor, as caches
+  bool single_context_invept;  // Whether single-context INVEPT is supported
+  volatile LONG64 invalidation_generation;  // # of EptRequestInvalidation()
+  volatile LONG64 invalidations_issued;     // # of INVEPT executed for them
+
+  // Serializes changes to the structure of tables in VMX-root mode, that is,
+  // splitting and merging large pages and adding tables on EPT violation.
+  // Entries of existing tables are changed without it.
+  KSPIN_LOCK table_lock;
+
+  // A ring of tables removed by merging, oldest first. Protected by table_lock.
+  EptRetiredTable retired_tables[kEptpRetiredTablesSize];
+  ULONG oldest_retired_table;      // An index of the oldest one
+  ULONG number_of_retired_tables;  // # of tables waiting to be freed
+
+  volatile long skipped_merge_count;  // # of merges skipped for a full ring
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -95,32 +189,82 @@ struct EptData {
 // prototypes
 //
 
+_IRQL_requires_max_(PASSIVE_LEVEL) static void EptpBuildMemoryTypeRanges();
+
+static ULONG EptpFindMemoryTypeRange(_In_ ULONG64 physical_address);
+
 static memory_type EptpGetMemoryType(_In_ ULONG64 physical_address);
 
-_When_(ept_data == nullptr,
-       _IRQL_requires_max_(DISPATCH_LEVEL)) static EptCommonEntry
-    *EptpConstructTables(_In_ EptCommonEntry *table, _In_ ULONG table_level,
-                         _In_ ULONG64 physical_address,
-                         _In_opt_ EptData *ept_data);
+static bool EptpIsMemoryTypeUniform(_In_ ULONG64 physical_address,
+                                    _In_ ULONG64 size);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool EptpBuildIdentityMap(
+    _In_ EptData *ept_data, _In_ EptCommonEntry *ept_pml4,
+    _In_ ULONG max_leaf_level);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool EptpMapPhysicalMemory(
+    _In_ EptData *ept_data, _In_ EptCommonEntry *ept_pml4,
+    _In_ ULONG64 base_address, _In_ ULONG64 end_address,
+    _In_ ULONG max_leaf_level);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void EptpMapSlices(
+    _Inout_ EptBuildContext *context);
 
-static void EptpDestructTables(_In_ EptCommonEntry *table,
+static KSTART_ROUTINE EptpBuildThreadRoutine;
+
+static EptCommonEntry *EptpConstructTables(_In_ EptCommonEntry *table,
+                                           _In_ ULONG table_level,
+                                           _In_ ULONG64 physical_address,
+                                           _In_ EptData *ept_data,
+                                           _In_ ULONG leaf_level);
+
+static bool EptpSplitLargePage(_Inout_ EptCommonEntry *entry,
+                               _In_ ULONG table_level,
+                               _In_ EptData *ept_data);
+
+static bool EptpMergeLargePage(_In_ EptData *ept_data,
+                               _Inout_ EptCommonEntry *entry,
                                _In_ ULONG table_level);
 
-_Must_inspect_result_ __drv_allocatesMem(Mem)
-    _When_(ept_data == nullptr,
-           _IRQL_requires_max_(DISPATCH_LEVEL)) static EptCommonEntry
-        *EptpAllocateEptEntry(_In_opt_ EptData *ept_data);
+static void EptpRetireTable(_In_ EptData *ept_data,
+                            _In_ EptCommonEntry *table);
+
+static void EptpReclaimRetiredTables(_In_ EptData *ept_data);
 
-static EptCommonEntry *EptpAllocateEptEntryFromPreAllocated(
+_IRQL_requires_max_(DISPATCH_LEVEL) static bool EptpAddTableChunk(
+    _Inout_ EptTableArena *arena);
+
+_IRQL_requires_max_(DISPATCH_LEVEL) static bool EptpReserveTables(
+    _Inout_ EptTableArena *arena, _In_ long count);
+
+_Must_inspect_result_ static EptCommonEntry *EptpAllocateEptEntry(
     _In_ EptData *ept_data);
 
-_Must_inspect_result_ __drv_allocatesMem(Mem) _IRQL_requires_max_(
-    DISPATCH_LEVEL) static EptCommonEntry *EptpAllocateEptEntryFromPool();
+static void EptpFreeEptEntry(_In_ EptData *ept_data,
+                             _In_ EptCommonEntry *ept_entry);
+
+_IRQL_requires_max_(DISPATCH_LEVEL) static void EptpFreeTableArena(
+    _Inout_ EptTableArena *arena);
+
+static KSTART_ROUTINE EptpRefillThreadRoutine;
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    EptpStartRefillThread(_Inout_ EptData *ept_data);
+
+_IRQL_requires_(DISPATCH_LEVEL) static NTSTATUS
+    EptpExitToVmm(_In_opt_ void *context);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void EptpStopRefillThread(
+    _Inout_ EptTableArena *arena);
 
 static void EptpInitTableEntry(_In_ EptCommonEntry *Entry,
                                _In_ ULONG table_level,
                                _In_ ULONG64 physical_address);
 
+static void EptpInitLargePageEntry(_In_ EptCommonEntry *entry,
+                                   _In_ ULONG table_level,
+                                   _In_ ULONG64 physical_address);
+
 static ULONG64 EptpAddressToPxeIndex(_In_ ULONG64 physical_address);
 
 static ULONG64 EptpAddressToPpeIndex(_In_ ULONG64 physical_address);
@@ -131,18 +275,36 @@ static ULONG64 EptpAddressToPteIndex(_In_ ULONG64 physical_address);
 
 static bool EptpIsDeviceMemory(_In_ ULONG64 physical_address);
 
+_IRQL_requires_min_(DISPATCH_LEVEL) static EptCommonEntry *
+    EptpPopulateOnFirstTouch(_In_ EptData *ept_data,
+                             _In_ ULONG64 physical_address);
+
 static EptCommonEntry *EptpGetEptPtEntry(_In_ EptCommonEntry *table,
                                          _In_ ULONG table_level,
                                          _In_ ULONG64 physical_address);
 
-static void EptpFreeUnusedPreAllocatedEntries(
-    _Pre_notnull_ __drv_freesMem(Mem) EptCommonEntry **preallocated_entries,
-    _In_ long used_count);
+static EptTranslationCache *EptpGetTranslationCache(_In_ EptData *ept_data);
+
+static void EptpInvalidateTranslationCaches(_In_opt_ EptData *ept_data);
+
+static EptCommonEntry *EptpGetEptPdptEntry(_In_ EptCommonEntry *ept_pml4,
+                                           _In_ ULONG64 physical_address);
+
+static EptCommonEntry *EptpGetEptPdEntry(_In_ EptCommonEntry *ept_pml4,
+                                         _In_ ULONG64 physical_address);
 
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(PAGE, EptIsEptAvailable)
 #pragma alloc_text(PAGE, EptInitialization)
 #pragma alloc_text(PAGE, EptInitializeMtrrEntries)
+#pragma alloc_text(PAGE, EptpBuildMemoryTypeRanges)
+#pragma alloc_text(PAGE, EptpBuildIdentityMap)
+#pragma alloc_text(PAGE, EptpMapPhysicalMemory)
+#pragma alloc_text(PAGE, EptpMapSlices)
+#pragma alloc_text(PAGE, EptpBuildThreadRoutine)
+#pragma alloc_text(PAGE, EptpRefillThreadRoutine)
+#pragma alloc_text(PAGE, EptpStartRefillThread)
+#pragma alloc_text(PAGE, EptpStopRefillThread)
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -150,9 +312,12 @@ static void EptpFreeUnusedPreAllocatedEntries(
 // variables
 //
 
-static MtrrData g_eptp_mtrr_entries[kEptpMtrrEntriesSize];
+static MtrrData g_eptp_mtrr_entries[kMtrrEntriesSize];
 static UCHAR g_eptp_mtrr_default_type;
 
+static MemoryTypeRange g_eptp_memory_type_ranges[kMtrrMemoryTypeRangesSize];
+static ULONG g_eptp_memory_type_ranges_count;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // implementations
@@ -165,14 +330,14 @@ _Use_decl_annotations_ bool EptIsEptAvailable() {
   // Check the followings:
   // - page walk length is 4 steps
   // - extended page tables can be laid out in write-back memory
-  // - INVEPT instruction with all possible types is supported
+  // - INVEPT instruction with the global type is supported. Single-context
+  //   one is used when supported.
   // - INVVPID instruction with all possible types is supported
   Ia32VmxEptVpidCapMsr capability = {UtilReadMsr64(Msr::kIa32VmxEptVpidCap)};
   if (!capability.fields.support_page_walk_length4 ||
       !capability.fields.support_execute_only_pages ||
       !capability.fields.support_write_back_memory_type ||
       !capability.fields.support_invept ||
-      !capability.fields.support_single_context_invept ||
       !capability.fields.support_all_context_invept ||
       !capability.fields.support_invvpid ||
       !capability.fields.support_individual_address_invvpid ||
@@ -335,67 +500,54 @@ _Use_decl_annotations_ void EptInitializeMtrrEntries() {
     mtrr_entries[index].range_end = end;
     index++;
   }
-}
-
-// Returns a memory type based on MTRRs
-_Use_decl_annotations_ static memory_type EptpGetMemoryType(
-    ULONG64 physical_address) {
-  // Indicate that MTRR is not defined (as a default)
-  UCHAR result_type = MAXUCHAR;
-
-  // Looks for MTRR that includes the specified physical_address
-  for (const auto mtrr_entry : g_eptp_mtrr_entries) {
-    if (!mtrr_entry.enabled) {
-      // Reached out the end of stored MTRRs
-      break;
-    }
 
-    if (!UtilIsInBounds(physical_address, mtrr_entry.range_base,
-                        mtrr_entry.range_end)) {
-      // This MTRR does not describe a memory type of the physical_address
-      continue;
-    }
-
-    // See: MTRR Precedences
-    if (mtrr_entry.fixedMtrr) {
-      // If a fixed MTRR describes a memory type, it is priority
-      result_type = mtrr_entry.type;
-      break;
-    }
+  EptpBuildMemoryTypeRanges();
+}
 
-    if (mtrr_entry.type == static_cast<UCHAR>(memory_type::kUncacheable)) {
-      // If a memory type is UC, it is priority. Do not continue to search as
-      // UC has the highest priority
-      result_type = mtrr_entry.type;
-      break;
-    }
+// Compiles MTRRs into sorted, non-overlapping ranges of memory types so that
+// a memory type can be looked up with binary search
+_Use_decl_annotations_ static void EptpBuildMemoryTypeRanges() {
+  PAGED_CODE();
 
-    if (result_type == static_cast<UCHAR>(memory_type::kWriteThrough) ||
-        mtrr_entry.type == static_cast<UCHAR>(memory_type::kWriteThrough)) {
-      if (result_type == static_cast<UCHAR>(memory_type::kWriteBack)) {
-        // If two or more MTRRs describes an over-wrapped memory region, and
-        // one is WT and the other one is WB, use WT. However, look for other
-        // MTRRs, as the other MTRR specifies the memory address as UC, which is
-        // priority.
-        result_type = static_cast<UCHAR>(memory_type::kWriteThrough);
-        continue;
-      }
-    }
+  g_eptp_memory_type_ranges_count = MtrrBuildMemoryTypeRanges(
+      g_eptp_mtrr_entries, kMtrrEntriesSize, g_eptp_mtrr_default_type,
+      g_eptp_memory_type_ranges);
+  NT_ASSERT(g_eptp_memory_type_ranges_count);
 
-    // Otherwise, processor behavior is undefined. We just use the last MTRR
-    // describes the memory address.
-    result_type = mtrr_entry.type;
+  for (auto i = 0ul; i < g_eptp_memory_type_ranges_count; ++i) {
+    HYPERPLATFORM_LOG_DEBUG(
+        "Memory type %2lu from %016llx",
+        static_cast<ULONG>(g_eptp_memory_type_ranges[i].type),
+        g_eptp_memory_type_ranges[i].range_base);
   }
+}
 
-  // Use the default MTRR if no MTRR entry is found
-  if (result_type == MAXUCHAR) {
-    result_type = g_eptp_mtrr_default_type;
-  }
+// Returns an index of the memory type range that includes the
+// physical_address
+_Use_decl_annotations_ static ULONG EptpFindMemoryTypeRange(
+    ULONG64 physical_address) {
+  return MtrrFindMemoryTypeRange(g_eptp_memory_type_ranges,
+                                 g_eptp_memory_type_ranges_count,
+                                 physical_address);
+}
 
-  return static_cast<memory_type>(result_type);
+// Returns a memory type based on MTRRs
+_Use_decl_annotations_ static memory_type EptpGetMemoryType(
+    ULONG64 physical_address) {
+  const auto index = EptpFindMemoryTypeRange(physical_address);
+  return g_eptp_memory_type_ranges[index].type;
 }
 
-// Builds EPT, allocates pre-allocated entires, initializes and returns EptData
+// Checks if all bytes in the range have the same memory type. That is the case
+// when the first and the last bytes are in the same memory type range.
+_Use_decl_annotations_ static bool EptpIsMemoryTypeUniform(
+    ULONG64 physical_address, ULONG64 size) {
+  const auto end_address = physical_address + size - 1;
+  return EptpFindMemoryTypeRange(physical_address) ==
+         EptpFindMemoryTypeRange(end_address);
+}
+
+// Builds EPT, reserves EPT tables, initializes and returns EptData
 _Use_decl_annotations_ EptData *EptInitialization() {
   PAGED_CODE();
 
@@ -408,6 +560,8 @@ _Use_decl_annotations_ EptData *EptInitialization() {
     return nullptr;
   }
   RtlZeroMemory(ept_data, sizeof(EptData));
+  InitializeSListHead(&ept_data->table_arena.free_tables);
+  KeInitializeSpinLock(&ept_data->table_lock);
 
   // Allocate EptPointer
   const auto ept_poiner = reinterpret_cast<EptPointer *>(ExAllocatePoolWithTag(
@@ -419,89 +573,302 @@ _Use_decl_annotations_ EptData *EptInitialization() {
   RtlZeroMemory(ept_poiner, PAGE_SIZE);
 
   // Allocate EPT_PML4 and initialize EptPointer
-  const auto ept_pml4 =
-      reinterpret_cast<EptCommonEntry *>(ExAllocatePoolWithTag(
-          NonPagedPool, PAGE_SIZE, kHyperPlatformCommonPoolTag));
+  const auto ept_pml4 = EptpAllocateEptEntry(ept_data);
   if (!ept_pml4) {
+    EptpFreeTableArena(&ept_data->table_arena);
     ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
     ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
     return nullptr;
   }
-  RtlZeroMemory(ept_pml4, PAGE_SIZE);
   ept_poiner->fields.memory_type =
       static_cast<ULONG64>(EptpGetMemoryType(UtilPaFromVa(ept_pml4)));
   ept_poiner->fields.page_walk_length = kEptPageWalkLevel - 1;
   ept_poiner->fields.pml4_address = UtilPfnFromPa(UtilPaFromVa(ept_pml4));
 
-  // Initialize all EPT entries for all physical memory pages
-  const auto pm_ranges = UtilGetPhysicalMemoryRanges();
-  for (auto run_index = 0ul; run_index < pm_ranges->number_of_runs;
-       ++run_index) {
-    const auto run = &pm_ranges->run[run_index];
-    const auto base_addr = run->base_page * PAGE_SIZE;
-    for (auto page_index = 0ull; page_index < run->page_count; ++page_index) {
-      const auto indexed_addr = base_addr + page_index * PAGE_SIZE;
-      const auto ept_pt_entry =
-          EptpConstructTables(ept_pml4, 4, indexed_addr, nullptr);
-      if (!ept_pt_entry) {
-        EptpDestructTables(ept_pml4, 4);
-        ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
-        ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
-        return nullptr;
-      }
-    }
+  // Initialize all EPT entries for all physical memory pages unless they are
+  // populated on first access
+  const Ia32VmxEptVpidCapMsr capability = {
+      UtilReadMsr64(Msr::kIa32VmxEptVpidCap)};
+  const auto max_leaf_level = EptEntryGetMaxLeafLevel(capability);
+#if (HYPERPLATFORM_COMMON_LAZY_EPT == 0)
+  if (!EptpBuildIdentityMap(ept_data, ept_pml4, max_leaf_level)) {
+    EptpFreeTableArena(&ept_data->table_arena);
+    ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
+    ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
+    return nullptr;
   }
+#endif
 
   // Initialize an EPT entry for APIC_BASE. It is required to allocated it now
   // for some reasons, or else, system hangs.
   const Ia32ApicBaseMsr apic_msr = {UtilReadMsr64(Msr::kIa32ApicBase)};
   if (!EptpConstructTables(ept_pml4, 4, apic_msr.fields.apic_base * PAGE_SIZE,
-                           nullptr)) {
-    EptpDestructTables(ept_pml4, 4);
+                           ept_data, 1)) {
+    EptpFreeTableArena(&ept_data->table_arena);
+    ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
+    ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
+    return nullptr;
+  }
+
+  // Keep tables available for VMX-root mode where the arena cannot grow
+  if (!EptpReserveTables(&ept_data->table_arena,
+                         kEptpHighWatermarkOfFreeTables)) {
+    EptpFreeTableArena(&ept_data->table_arena);
     ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
     ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
     return nullptr;
   }
 
-  // Allocate preallocated_entries
-  const auto preallocated_entries_size =
-      sizeof(EptCommonEntry *) * kEptpNumberOfPreallocatedEntries;
-  const auto preallocated_entries = reinterpret_cast<EptCommonEntry **>(
-      ExAllocatePoolWithTag(NonPagedPool, preallocated_entries_size,
+  // Allocate translation caches for all processors
+  const auto number_of_translation_caches =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto translation_caches_size =
+      sizeof(EptTranslationCache) * number_of_translation_caches;
+  const auto translation_caches = reinterpret_cast<EptTranslationCache *>(
+      ExAllocatePoolWithTag(NonPagedPool, translation_caches_size,
                             kHyperPlatformCommonPoolTag));
-  if (!preallocated_entries) {
-    EptpDestructTables(ept_pml4, 4);
+  if (!translation_caches) {
+    EptpFreeTableArena(&ept_data->table_arena);
     ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
     ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
     return nullptr;
   }
-  RtlZeroMemory(preallocated_entries, preallocated_entries_size);
+  RtlZeroMemory(translation_caches, translation_caches_size);
 
-  // And fill preallocated_entries with newly created entries
-  for (auto i = 0ul; i < kEptpNumberOfPreallocatedEntries; ++i) {
-    const auto ept_entry = EptpAllocateEptEntry(nullptr);
-    if (!ept_entry) {
-      EptpFreeUnusedPreAllocatedEntries(preallocated_entries, 0);
-      EptpDestructTables(ept_pml4, 4);
-      ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
-      ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
-      return nullptr;
+  // Allocate states of deferred invalidation for all processors
+  const auto invalidation_batches_size =
+      sizeof(EptInvalidationBatch) * number_of_translation_caches;
+  const auto invalidation_batches = reinterpret_cast<EptInvalidationBatch *>(
+      ExAllocatePoolWithTag(NonPagedPool, invalidation_batches_size,
+                            kHyperPlatformCommonPoolTag));
+  if (!invalidation_batches) {
+    ExFreePoolWithTag(translation_caches, kHyperPlatformCommonPoolTag);
+    EptpFreeTableArena(&ept_data->table_arena);
+    ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
+    ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
+    return nullptr;
+  }
+  RtlZeroMemory(invalidation_batches, invalidation_batches_size);
+#if (HYPERPLATFORM_COMMON_SHARE_EPT == 0)
+  // Only this processor uses this EptData. Others are never behind it.
+  const auto current_index = KeGetCurrentProcessorNumberEx(nullptr);
+  for (auto i = 0ul; i < number_of_translation_caches; ++i) {
+    if (i != current_index) {
+      invalidation_batches[i].flushed_generation = MAXLONG64;
     }
-    preallocated_entries[i] = ept_entry;
+  }
+#endif
+
+  // Start refilling free tables as VMX-root mode uses them
+  ept_data->table_arena.lowest_free_count = kEptpHighWatermarkOfFreeTables;
+  if (!NT_SUCCESS(EptpStartRefillThread(ept_data))) {
+    ExFreePoolWithTag(invalidation_batches, kHyperPlatformCommonPoolTag);
+    ExFreePoolWithTag(translation_caches, kHyperPlatformCommonPoolTag);
+    EptpFreeTableArena(&ept_data->table_arena);
+    ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
+    ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
+    return nullptr;
   }
 
   // Initialization completed
   ept_data->ept_pointer = ept_poiner;
   ept_data->ept_pml4 = ept_pml4;
-  ept_data->preallocated_entries = preallocated_entries;
-  ept_data->preallocated_entries_count = 0;
+  ept_data->max_leaf_level = max_leaf_level;
+  ept_data->translation_caches = translation_caches;
+  ept_data->number_of_translation_caches = number_of_translation_caches;
+  ept_data->invalidation_batches = invalidation_batches;
+  ept_data->single_context_invept =
+      capability.fields.support_single_context_invept;
   return ept_data;
 }
 
+// Maps all physical memory pages with threads working on different 1 GB slices
+// of physical memory in parallel
+_Use_decl_annotations_ static bool EptpBuildIdentityMap(
+    EptData *ept_data, EptCommonEntry *ept_pml4, ULONG max_leaf_level) {
+  PAGED_CODE();
+
+  const auto pm_ranges = UtilGetPhysicalMemoryRanges();
+
+  // Count slices. Runs are sorted, so a slice shared by adjacent runs is
+  // always the last one counted.
+  long number_of_slices = 0;
+  ULONG64 last_slice = MAXULONG64;
+  for (auto run_index = 0ul; run_index < pm_ranges->number_of_runs;
+       ++run_index) {
+    const auto run = &pm_ranges->run[run_index];
+    const auto base_addr = static_cast<ULONG64>(run->base_page) * PAGE_SIZE;
+    const auto end_addr = base_addr + run->page_count * PAGE_SIZE;
+    for (auto slice = base_addr & ~(kEptpHugePageSize - 1); slice < end_addr;
+         slice += kEptpHugePageSize) {
+      if (slice != last_slice) {
+        number_of_slices++;
+        last_slice = slice;
+      }
+    }
+  }
+
+  const auto slices = reinterpret_cast<ULONG64 *>(
+      ExAllocatePoolWithTag(NonPagedPool, sizeof(ULONG64) * number_of_slices,
+                            kHyperPlatformCommonPoolTag));
+  if (!slices) {
+    return false;
+  }
+
+  // Save slices and create PDPTs for them beforehand so that threads do not
+  // race on PML4 entries
+  auto index = 0l;
+  last_slice = MAXULONG64;
+  for (auto run_index = 0ul; run_index < pm_ranges->number_of_runs;
+       ++run_index) {
+    const auto run = &pm_ranges->run[run_index];
+    const auto base_addr = static_cast<ULONG64>(run->base_page) * PAGE_SIZE;
+    const auto end_addr = base_addr + run->page_count * PAGE_SIZE;
+    for (auto slice = base_addr & ~(kEptpHugePageSize - 1); slice < end_addr;
+         slice += kEptpHugePageSize) {
+      if (slice == last_slice) {
+        continue;
+      }
+      last_slice = slice;
+      slices[index++] = slice;
+
+      const auto ept_pml4_entry = &ept_pml4[EptpAddressToPxeIndex(slice)];
+      if (ept_pml4_entry->all) {
+        continue;
+      }
+      const auto ept_pdpt = EptpAllocateEptEntry(ept_data);
+      if (!ept_pdpt) {
+        ExFreePoolWithTag(slices, kHyperPlatformCommonPoolTag);
+        return false;
+      }
+      EptpInitTableEntry(ept_pml4_entry, 4, UtilPaFromVa(ept_pdpt));
+    }
+  }
+
+  EptBuildContext context = {};
+  context.ept_data = ept_data;
+  context.ept_pml4 = ept_pml4;
+  context.pm_ranges = pm_ranges;
+  context.max_leaf_level = max_leaf_level;
+  context.slices = slices;
+  context.number_of_slices = number_of_slices;
+
+  // Start one thread per processor, but no more than slices. This thread
+  // works too, so failure of starting threads only makes building slower.
+  auto number_of_threads =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  if (number_of_threads > kEptpMaxBuildThreads) {
+    number_of_threads = kEptpMaxBuildThreads;
+  }
+  if (number_of_threads > static_cast<ULONG>(number_of_slices)) {
+    number_of_threads = number_of_slices;
+  }
+  HANDLE thread_handles[kEptpMaxBuildThreads] = {};
+  auto number_of_started_threads = 0ul;
+  for (auto i = 1ul; i < number_of_threads; ++i) {
+    const auto status = PsCreateSystemThread(
+        &thread_handles[number_of_started_threads], GENERIC_ALL, nullptr,
+        nullptr, nullptr, EptpBuildThreadRoutine, &context);
+    if (!NT_SUCCESS(status)) {
+      HYPERPLATFORM_LOG_WARN("Failed to start a thread building EPT (%08x)",
+                             status);
+      break;
+    }
+    number_of_started_threads++;
+  }
+
+  EptpMapSlices(&context);
+
+  for (auto i = 0ul; i < number_of_started_threads; ++i) {
+    const auto status =
+        ZwWaitForSingleObject(thread_handles[i], FALSE, nullptr);
+    if (!NT_SUCCESS(status)) {
+      HYPERPLATFORM_COMMON_DBG_BREAK();
+    }
+    ZwClose(thread_handles[i]);
+  }
+  HYPERPLATFORM_LOG_DEBUG("Mapped %ld slices of memory with %lu threads",
+                          number_of_slices, number_of_started_threads + 1);
+
+  ExFreePoolWithTag(slices, kHyperPlatformCommonPoolTag);
+  return !context.failed;
+}
+
+// Maps physical memory pages in the range. Use 1 GB and 2 MB pages where
+// supported and the whole page is in the range and has the same memory type,
+// and 4 KB pages for the rest.
+_Use_decl_annotations_ static bool EptpMapPhysicalMemory(
+    EptData *ept_data, EptCommonEntry *ept_pml4, ULONG64 base_address,
+    ULONG64 end_address, ULONG max_leaf_level) {
+  PAGED_CODE();
+
+  for (auto indexed_addr = base_address; indexed_addr < end_address;) {
+    const auto leaf_level = EptEntryGetLeafLevel(
+        indexed_addr, end_address, max_leaf_level, g_eptp_memory_type_ranges,
+        g_eptp_memory_type_ranges_count);
+    if (!EptpConstructTables(ept_pml4, 4, indexed_addr, ept_data,
+                             leaf_level)) {
+      return false;
+    }
+    indexed_addr += EptEntryGetPageSize(leaf_level);
+  }
+  return true;
+}
+
+// Takes slices one by one and maps physical memory in them until all slices
+// are taken or any thread fails
+_Use_decl_annotations_ static void EptpMapSlices(EptBuildContext *context) {
+  PAGED_CODE();
+
+  const auto pm_ranges = context->pm_ranges;
+  for (;;) {
+    const auto index = InterlockedIncrement(&context->next_slice) - 1;
+    if (index >= context->number_of_slices || context->failed) {
+      break;
+    }
+
+    // Map parts of runs within the slice
+    const auto slice_base = context->slices[index];
+    const auto slice_end = slice_base + kEptpHugePageSize;
+    for (auto run_index = UtilFindPhysicalMemoryRun(slice_base);
+         run_index < pm_ranges->number_of_runs; ++run_index) {
+      const auto run = &pm_ranges->run[run_index];
+      auto base_addr = static_cast<ULONG64>(run->base_page) * PAGE_SIZE;
+      auto end_addr = base_addr + run->page_count * PAGE_SIZE;
+      if (slice_end <= base_addr) {
+        break;
+      }
+      if (base_addr < slice_base) {
+        base_addr = slice_base;
+      }
+      if (end_addr > slice_end) {
+        end_addr = slice_end;
+      }
+      if (!EptpMapPhysicalMemory(context->ept_data, context->ept_pml4,
+                                 base_addr, end_addr,
+                                 context->max_leaf_level)) {
+        InterlockedExchange(&context->failed, 1);
+        return;
+      }
+    }
+  }
+}
+
+// Maps slices of physical memory along with the thread that started it
+_Use_decl_annotations_ static VOID EptpBuildThreadRoutine(
+    void *start_context) {
+  PAGED_CODE();
+
+  EptpMapSlices(reinterpret_cast<EptBuildContext *>(start_context));
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
 // Allocate and initialize all EPT entries associated with the physical_address
+// down to the leaf_level, where 3 makes a 1 GB page, 2 makes a 2 MB page and 1
+// makes a 4 KB page
 _Use_decl_annotations_ static EptCommonEntry *EptpConstructTables(
     EptCommonEntry *table, ULONG table_level, ULONG64 physical_address,
-    EptData *ept_data) {
+    EptData *ept_data, ULONG leaf_level) {
   switch (table_level) {
     case 4: {
       // table == PML4 (512 GB)
@@ -517,13 +884,22 @@ _Use_decl_annotations_ static EptCommonEntry *EptpConstructTables(
       return EptpConstructTables(
           reinterpret_cast<EptCommonEntry *>(
               UtilVaFromPfn(ept_pml4_entry->fields.physial_address)),
-          table_level - 1, physical_address, ept_data);
+          table_level - 1, physical_address, ept_data, leaf_level);
     }
     case 3: {
       // table == PDPT (1 GB)
       const auto ppe_index = EptpAddressToPpeIndex(physical_address);
       const auto ept_pdpt_entry = &table[ppe_index];
-      if (!ept_pdpt_entry->all) {
+      if (leaf_level == table_level) {
+        NT_ASSERT(!ept_pdpt_entry->all);
+        EptpInitLargePageEntry(ept_pdpt_entry, table_level, physical_address);
+        return ept_pdpt_entry;
+      }
+      if (ept_pdpt_entry->fields.large_page) {
+        if (!EptpSplitLargePage(ept_pdpt_entry, table_level, ept_data)) {
+          return nullptr;
+        }
+      } else if (!ept_pdpt_entry->all) {
         const auto ept_pdt = EptpAllocateEptEntry(ept_data);
         if (!ept_pdt) {
           return nullptr;
@@ -533,13 +909,22 @@ _Use_decl_annotations_ static EptCommonEntry *EptpConstructTables(
       return EptpConstructTables(
           reinterpret_cast<EptCommonEntry *>(
               UtilVaFromPfn(ept_pdpt_entry->fields.physial_address)),
-          table_level - 1, physical_address, ept_data);
+          table_level - 1, physical_address, ept_data, leaf_level);
     }
     case 2: {
       // table == PDT (2 MB)
       const auto pde_index = EptpAddressToPdeIndex(physical_address);
       const auto ept_pdt_entry = &table[pde_index];
-      if (!ept_pdt_entry->all) {
+      if (leaf_level == table_level) {
+        NT_ASSERT(!ept_pdt_entry->all);
+        EptpInitLargePageEntry(ept_pdt_entry, table_level, physical_address);
+        return ept_pdt_entry;
+      }
+      if (ept_pdt_entry->fields.large_page) {
+        if (!EptpSplitLargePage(ept_pdt_entry, table_level, ept_data)) {
+          return nullptr;
+        }
+      } else if (!ept_pdt_entry->all) {
         const auto ept_pt = EptpAllocateEptEntry(ept_data);
         if (!ept_pt) {
           return nullptr;
@@ -549,7 +934,7 @@ _Use_decl_annotations_ static EptCommonEntry *EptpConstructTables(
       return EptpConstructTables(
           reinterpret_cast<EptCommonEntry *>(
               UtilVaFromPfn(ept_pdt_entry->fields.physial_address)),
-          table_level - 1, physical_address, ept_data);
+          table_level - 1, physical_address, ept_data, leaf_level);
     }
     case 1: {
       // table == PT (4 KB)
@@ -565,41 +950,185 @@ _Use_decl_annotations_ static EptCommonEntry *EptpConstructTables(
   }
 }
 
-// Return a new EPT entry either by creating new one or from pre-allocated ones
+// Adds a chunk of contiguous memory to the arena. Threads building EPT and the
+// worker thread may add chunks at the same time.
+_Use_decl_annotations_ static bool EptpAddTableChunk(EptTableArena *arena) {
+  static const auto kChunkSize = kEptpTablesPerChunk * PAGE_SIZE;
+
+  const auto chunk = reinterpret_cast<EptTableChunk *>(ExAllocatePoolWithTag(
+      NonPagedPool, sizeof(EptTableChunk), kHyperPlatformCommonPoolTag));
+  if (!chunk) {
+    return false;
+  }
+  const auto base = reinterpret_cast<EptCommonEntry *>(
+      UtilAllocateContiguousMemory(kChunkSize));
+  if (!base) {
+    ExFreePoolWithTag(chunk, kHyperPlatformCommonPoolTag);
+    return false;
+  }
+  RtlZeroMemory(base, kChunkSize);
+
+  chunk->base = base;
+  do {
+    chunk->next = arena->chunks;
+  } while (InterlockedCompareExchangePointer(
+               reinterpret_cast<void *volatile *>(&arena->chunks), chunk,
+               chunk->next) != chunk->next);
+
+  // Push tables in the reverse order so that they are taken in address order
+  for (auto i = kEptpTablesPerChunk; i > 0; --i) {
+    InterlockedPushEntrySList(
+        &arena->free_tables,
+        reinterpret_cast<PSLIST_ENTRY>(base + (i - 1) * 512));
+  }
+  return true;
+}
+
+// Adds chunks until at least count tables are free
+_Use_decl_annotations_ static bool EptpReserveTables(EptTableArena *arena,
+                                                     long count) {
+  while (ExQueryDepthSList(&arena->free_tables) < count) {
+    if (!EptpAddTableChunk(arena)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Return a new EPT table from the arena. A chunk is added when needed unless
+// in VMX-root mode, which runs at DISPATCH_LEVEL or higher; free tables
+// refilled by the worker thread are used there and the hypervisor issues a
+// bugcheck when they run out.
 _Use_decl_annotations_ static EptCommonEntry *EptpAllocateEptEntry(
     EptData *ept_data) {
-  if (ept_data) {
-    return EptpAllocateEptEntryFromPreAllocated(ept_data);
-  } else {
-    return EptpAllocateEptEntryFromPool();
+  const auto arena = &ept_data->table_arena;
+  PSLIST_ENTRY entry = nullptr;
+  while ((entry = InterlockedPopEntrySList(&arena->free_tables)) == nullptr) {
+    if (KeGetCurrentIrql() >= DISPATCH_LEVEL) {
+      HYPERPLATFORM_COMMON_BUG_CHECK(
+          HyperPlatformBugCheck::kExhaustedPreallocatedEntries,
+          arena->used_count, reinterpret_cast<ULONG_PTR>(ept_data), 0);
+    }
+    // Other threads may take tables in the new chunk first; try again then
+    if (!EptpAddTableChunk(arena)) {
+      return nullptr;
+    }
   }
+  const auto table = reinterpret_cast<EptCommonEntry *>(entry);
+  RtlZeroMemory(table, sizeof(SLIST_ENTRY));
+  InterlockedIncrement(&arena->used_count);
+
+  // Record how close VMX-root mode came to running out of tables
+  if (KeGetCurrentIrql() >= DISPATCH_LEVEL) {
+    const long free_count = ExQueryDepthSList(&arena->free_tables);
+    for (auto lowest = arena->lowest_free_count; free_count < lowest;
+         lowest = arena->lowest_free_count) {
+      if (InterlockedCompareExchange(&arena->lowest_free_count, free_count,
+                                     lowest) == lowest) {
+        break;
+      }
+    }
+  }
+  return table;
+}
+
+// Returns an EPT table to the arena so that it can be used again
+_Use_decl_annotations_ static void EptpFreeEptEntry(EptData *ept_data,
+                                                    EptCommonEntry *ept_entry) {
+  const auto arena = &ept_data->table_arena;
+  RtlZeroMemory(ept_entry, PAGE_SIZE);
+  InterlockedPushEntrySList(&arena->free_tables,
+                            reinterpret_cast<PSLIST_ENTRY>(ept_entry));
+  InterlockedDecrement(&arena->used_count);
 }
 
-// Return a new EPT entry from pre-allocated ones.
-_Use_decl_annotations_ static EptCommonEntry *
-EptpAllocateEptEntryFromPreAllocated(EptData *ept_data) {
-  const auto count =
-      InterlockedIncrement(&ept_data->preallocated_entries_count);
-  if (count > kEptpNumberOfPreallocatedEntries) {
-    HYPERPLATFORM_COMMON_BUG_CHECK(
-        HyperPlatformBugCheck::kExhaustedPreallocatedEntries, count,
-        reinterpret_cast<ULONG_PTR>(ept_data), 0);
+// Frees all chunks, and so all EPT tables, at once
+_Use_decl_annotations_ static void EptpFreeTableArena(EptTableArena *arena) {
+  for (auto chunk = arena->chunks; chunk;) {
+    const auto next = chunk->next;
+    UtilFreeContiguousMemory(chunk->base);
+    ExFreePoolWithTag(chunk, kHyperPlatformCommonPoolTag);
+    chunk = next;
   }
-  return ept_data->preallocated_entries[count - 1];
+  arena->chunks = nullptr;
+  InitializeSListHead(&arena->free_tables);
 }
 
-// Return a new EPT entry either by creating new one
-_Use_decl_annotations_ static EptCommonEntry *EptpAllocateEptEntryFromPool() {
-  static const auto kAllocSize = 512 * sizeof(EptCommonEntry);
-  static_assert(kAllocSize == PAGE_SIZE, "Size check");
+// Refills free tables up to the high watermark whenever fewer than the low
+// watermark are left. Also makes processors that have not invalidated EPT for
+// retired tables do so, since retired tables are freed only after all
+// processors invalidate EPT, and a processor without VM-exits never does.
+_Use_decl_annotations_ static VOID EptpRefillThreadRoutine(
+    void *start_context) {
+  PAGED_CODE();
 
-  const auto entry = reinterpret_cast<EptCommonEntry *>(ExAllocatePoolWithTag(
-      NonPagedPool, kAllocSize, kHyperPlatformCommonPoolTag));
-  if (!entry) {
-    return nullptr;
+  const auto ept_data = reinterpret_cast<EptData *>(start_context);
+  const auto arena = &ept_data->table_arena;
+  while (arena->refill_thread_should_be_alive) {
+    UtilSleep(kEptpRefillIntervalMsec);
+    if (ept_data->number_of_retired_tables &&
+        !EptIsInvalidationCompleted(ept_data,
+                                    ept_data->invalidation_generation)) {
+      UtilForEachProcessorInParallel(EptpExitToVmm, nullptr, nullptr);
+    }
+    if (ExQueryDepthSList(&arena->free_tables) >=
+        kEptpLowWatermarkOfFreeTables) {
+      continue;
+    }
+    if (EptpReserveTables(arena, kEptpHighWatermarkOfFreeTables)) {
+      InterlockedIncrement(&arena->refill_count);
+    } else {
+      HYPERPLATFORM_LOG_WARN("Failed to refill EPT tables (%u left)",
+                             ExQueryDepthSList(&arena->free_tables));
+    }
   }
-  RtlZeroMemory(entry, kAllocSize);
-  return entry;
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Starts the worker thread refilling free tables of the arena
+_Use_decl_annotations_ static NTSTATUS EptpStartRefillThread(
+    EptData *ept_data) {
+  PAGED_CODE();
+
+  const auto arena = &ept_data->table_arena;
+  arena->refill_thread_should_be_alive = true;
+  const auto status = PsCreateSystemThread(
+      &arena->refill_thread_handle, GENERIC_ALL, nullptr, nullptr, nullptr,
+      EptpRefillThreadRoutine, ept_data);
+  if (!NT_SUCCESS(status)) {
+    arena->refill_thread_should_be_alive = false;
+    arena->refill_thread_handle = nullptr;
+  }
+  return status;
+}
+
+// Causes a VM-exit on the current processor so that it invalidates EPT before
+// returning to the guest if EPT was changed. CPUID is used instead of a
+// hypercall as it exits unconditionally yet is harmless on a processor that is
+// not virtualized yet or anymore.
+_Use_decl_annotations_ static NTSTATUS EptpExitToVmm(void *context) {
+  UNREFERENCED_PARAMETER(context);
+
+  int cpu_info[4] = {};
+  __cpuid(cpu_info, 0);
+  return STATUS_SUCCESS;
+}
+
+// Stops the worker thread and waits for its exit
+_Use_decl_annotations_ static void EptpStopRefillThread(EptTableArena *arena) {
+  PAGED_CODE();
+
+  if (!arena->refill_thread_handle) {
+    return;
+  }
+  arena->refill_thread_should_be_alive = false;
+  const auto status =
+      ZwWaitForSingleObject(arena->refill_thread_handle, FALSE, nullptr);
+  if (!NT_SUCCESS(status)) {
+    HYPERPLATFORM_COMMON_DBG_BREAK();
+  }
+  ZwClose(arena->refill_thread_handle);
+  arena->refill_thread_handle = nullptr;
 }
 
 // Initialize an EPT entry with a "pass through" attribute
@@ -615,6 +1144,158 @@ _Use_decl_annotations_ static void EptpInitTableEntry(
   }
 }
 
+// Initialize an EPT PDE mapping 2 MB or PDPTE mapping 1 GB with a "pass
+// through" attribute
+_Use_decl_annotations_ static void EptpInitLargePageEntry(
+    EptCommonEntry *entry, ULONG table_level, ULONG64 physical_address) {
+  NT_ASSERT(table_level == 2 || table_level == 3);
+  NT_ASSERT((physical_address % (table_level == 3 ? kEptpHugePageSize
+                                                  : kEptpLargePageSize)) == 0);
+  EptpInitTableEntry(entry, table_level, physical_address);
+  entry->fields.memory_type =
+      static_cast<ULONG64>(EptpGetMemoryType(physical_address));
+  entry->fields.large_page = true;
+}
+
+// Replaces a 1 GB EPT PDPTE or 2 MB EPT PDE with a table mapping the same
+// memory with the same attributes. A 1 GB page is split into 2 MB pages.
+_Use_decl_annotations_ static bool EptpSplitLargePage(
+    EptCommonEntry *entry, ULONG table_level, EptData *ept_data) {
+  NT_ASSERT(entry->fields.large_page);
+  const auto sub_table = EptpAllocateEptEntry(ept_data);
+  if (!sub_table) {
+    return false;
+  }
+
+  EptEntryFillSubTable(*entry, table_level, sub_table);
+
+  EptCommonEntry new_entry = {};
+  EptpInitTableEntry(&new_entry, table_level, UtilPaFromVa(sub_table));
+  entry->all = new_entry.all;
+  EptpInvalidateTranslationCaches(ept_data);
+  return true;
+}
+
+// Replaces a table referenced by a PDPTE or PDE with a 1 GB or 2 MB page if
+// all of its entries map contiguous memory with full access and the same
+// memory type, and the table can be retired
+_Use_decl_annotations_ static bool EptpMergeLargePage(EptData *ept_data,
+                                                      EptCommonEntry *entry,
+                                                      ULONG table_level) {
+  NT_ASSERT(entry->all && !entry->fields.large_page);
+  if (ept_data->number_of_retired_tables == kEptpRetiredTablesSize) {
+    InterlockedIncrement(&ept_data->skipped_merge_count);
+    return false;
+  }
+
+  const auto sub_table = reinterpret_cast<EptCommonEntry *>(
+      UtilVaFromPfn(entry->fields.physial_address));
+  EptCommonEntry new_entry = {};
+  if (!EptEntryGetMergedEntry(sub_table, table_level, &new_entry)) {
+    return false;
+  }
+
+  entry->all = new_entry.all;
+  EptpInvalidateTranslationCaches(ept_data);
+  EptpRetireTable(ept_data, sub_table);
+  return true;
+}
+
+// Requests invalidation for a table removed from EPT, and keeps the table
+// until all processors complete it. Until then, processors may walk it with
+// translations cached in TLBs or entry pointers obtained before the removal.
+// The caller must hold table_lock.
+_Use_decl_annotations_ static void EptpRetireTable(EptData *ept_data,
+                                                   EptCommonEntry *table) {
+  NT_ASSERT(ept_data->number_of_retired_tables < kEptpRetiredTablesSize);
+  const auto index =
+      (ept_data->oldest_retired_table + ept_data->number_of_retired_tables) %
+      kEptpRetiredTablesSize;
+  ept_data->retired_tables[index].table = table;
+  ept_data->retired_tables[index].generation =
+      EptRequestInvalidation(ept_data);
+  ept_data->number_of_retired_tables++;
+}
+
+// Frees retired tables no processor can walk anymore. The caller must hold
+// table_lock.
+_Use_decl_annotations_ static void EptpReclaimRetiredTables(
+    EptData *ept_data) {
+  while (ept_data->number_of_retired_tables) {
+    const auto retired =
+        &ept_data->retired_tables[ept_data->oldest_retired_table];
+    if (!EptIsInvalidationCompleted(ept_data, retired->generation)) {
+      break;
+    }
+    EptpFreeEptEntry(ept_data, retired->table);
+    ept_data->oldest_retired_table =
+        (ept_data->oldest_retired_table + 1) % kEptpRetiredTablesSize;
+    ept_data->number_of_retired_tables--;
+  }
+}
+
+// Makes the physical_address mapped with a 4 KB EPT entry and returns it
+_Use_decl_annotations_ EptCommonEntry *EptSplitLargePage(
+    EptData *ept_data, ULONG64 physical_address) {
+  KLOCK_QUEUE_HANDLE lock_handle = {};
+  KeAcquireInStackQueuedSpinLockAtDpcLevel(&ept_data->table_lock,
+                                           &lock_handle);
+  EptpReclaimRetiredTables(ept_data);
+
+  auto split = false;
+  const auto ept_pdpt_entry =
+      EptpGetEptPdptEntry(ept_data->ept_pml4, physical_address);
+  if (ept_pdpt_entry && ept_pdpt_entry->fields.large_page) {
+    split |= EptpSplitLargePage(ept_pdpt_entry, 3, ept_data);
+  }
+  const auto ept_pd_entry =
+      EptpGetEptPdEntry(ept_data->ept_pml4, physical_address);
+  if (ept_pd_entry && ept_pd_entry->fields.large_page) {
+    split |= EptpSplitLargePage(ept_pd_entry, 2, ept_data);
+  }
+  if (split) {
+    EptRequestInvalidation(ept_data);
+  }
+
+  auto ept_entry = EptGetEptPtEntry(ept_data, physical_address);
+#if (HYPERPLATFORM_COMMON_LAZY_EPT != 0)
+  // The page may not have been accessed yet
+  if (!ept_entry || !ept_entry->all) {
+    ept_entry = EptpConstructTables(ept_data->ept_pml4, 4, physical_address,
+                                    ept_data, 1);
+    EptRequestInvalidation(ept_data);
+  }
+#endif
+  KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+  return ept_entry;
+}
+
+// Maps a region including the physical_address with a 2 MB page, and then
+// with a 1 GB page, when the EPT entries in the region allow it
+_Use_decl_annotations_ void EptMergeLargePage(EptData *ept_data,
+                                              ULONG64 physical_address) {
+  if (ept_data->max_leaf_level < 2) {
+    return;
+  }
+
+  KLOCK_QUEUE_HANDLE lock_handle = {};
+  KeAcquireInStackQueuedSpinLockAtDpcLevel(&ept_data->table_lock,
+                                           &lock_handle);
+  EptpReclaimRetiredTables(ept_data);
+
+  const auto ept_pd_entry =
+      EptpGetEptPdEntry(ept_data->ept_pml4, physical_address);
+  if (ept_pd_entry && ept_pd_entry->all &&
+      (ept_pd_entry->fields.large_page ||
+       EptpMergeLargePage(ept_data, ept_pd_entry, 2)) &&
+      ept_data->max_leaf_level >= 3) {
+    const auto ept_pdpt_entry =
+        EptpGetEptPdptEntry(ept_data->ept_pml4, physical_address);
+    EptpMergeLargePage(ept_data, ept_pdpt_entry, 3);
+  }
+  KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+}
+
 // Return an address of PXE
 _Use_decl_annotations_ static ULONG64 EptpAddressToPxeIndex(
     ULONG64 physical_address) {
@@ -646,7 +1327,7 @@ _Use_decl_annotations_ static ULONG64 EptpAddressToPteIndex(
 // Deal with EPT violation VM-exit.
 _Use_decl_annotations_ void EptHandleEptViolation(
     EptData *ept_data, ProcessorFakePageData *fp_data,
-    SharedFakePageData *shared_fp_data) {
+    SharedFakePageData *shared_fp_data, GpRegisters *gp_regs) {
   const EptViolationQualification exit_qualification = {
       UtilVmRead(VmcsField::kExitQualification)};
 
@@ -660,149 +1341,232 @@ _Use_decl_annotations_ void EptHandleEptViolation(
   if (ept_entry && ept_entry->all) {
     HYPERPLATFORM_COMMON_DBG_BREAK();
  
-    FpHandleEptViolation(fp_data, shared_fp_data, ept_data, fault_va,
-                            fault_pa);
+    FpHandleEptViolation(fp_data, shared_fp_data, ept_data, ept_entry, gp_regs,
+                         fault_va, fault_pa);
     return;
   }
 
-  // EPT entry miss. It should be device memory.
+  // EPT entry miss. It should be device memory unless EPT is populated on
+  // first access. Another processor may have mapped the page in the meantime.
   HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE();
-  if (!IsReleaseBuild()) {
-    NT_VERIFY(EptpIsDeviceMemory(fault_pa));
+  KLOCK_QUEUE_HANDLE lock_handle = {};
+  KeAcquireInStackQueuedSpinLockAtDpcLevel(&ept_data->table_lock,
+                                           &lock_handle);
+  const auto current_entry = EptGetEptPtEntry(ept_data, fault_pa);
+  if (!current_entry || !current_entry->all) {
+#if (HYPERPLATFORM_COMMON_LAZY_EPT != 0)
+    InterlockedIncrement(&ept_data->first_touch_count);
+    EptpPopulateOnFirstTouch(ept_data, fault_pa);
+#else
+    if (!IsReleaseBuild()) {
+      NT_VERIFY(EptpIsDeviceMemory(fault_pa));
+    }
+    InterlockedIncrement(&ept_data->device_memory_miss_count);
+    EptpConstructTables(ept_data->ept_pml4, 4, fault_pa, ept_data, 1);
+#endif
+    EptRequestInvalidation(ept_data);
   }
-  EptpConstructTables(ept_data->ept_pml4, 4, fault_pa, ept_data);
+  KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+}
 
-  UtilInveptGlobal();
+// Maps a page including the physical_address that has not been mapped yet. A
+// 2 MB page is used when allowed and no part of it is mapped yet.
+_Use_decl_annotations_ static EptCommonEntry *EptpPopulateOnFirstTouch(
+    EptData *ept_data, ULONG64 physical_address) {
+  if (kEptpPopulateLazilyWithLargePages && ept_data->max_leaf_level >= 2) {
+    const auto large_page_base = physical_address & ~(kEptpLargePageSize - 1);
+    const auto ept_pd_entry =
+        EptpGetEptPdEntry(ept_data->ept_pml4, physical_address);
+    if ((!ept_pd_entry || !ept_pd_entry->all) &&
+        EptpIsMemoryTypeUniform(large_page_base, kEptpLargePageSize)) {
+      return EptpConstructTables(ept_data->ept_pml4, 4, large_page_base,
+                                 ept_data, 2);
+    }
+  }
+  return EptpConstructTables(ept_data->ept_pml4, 4, physical_address,
+                             ept_data, 1);
 }
 
 // Returns if the physical_address is device memory (which could not have a
 // corresponding PFN entry)
 _Use_decl_annotations_ static bool EptpIsDeviceMemory(
     ULONG64 physical_address) {
-  const auto pm_ranges = UtilGetPhysicalMemoryRanges();
-  for (auto i = 0ul; i < pm_ranges->number_of_runs; ++i) {
-    const auto current_run = &pm_ranges->run[i];
-    const auto base_addr =
-        static_cast<ULONG64>(current_run->base_page) * PAGE_SIZE;
-    const auto endAddr = base_addr + current_run->page_count * PAGE_SIZE - 1;
-    if (UtilIsInBounds(physical_address, base_addr, endAddr)) {
-      return false;
-    }
-  }
-  return true;
+  return !UtilIsPhysicalMemory(physical_address);
 }
 
 // Returns an EPT entry corresponds to the physical_address
 _Use_decl_annotations_ EptCommonEntry *EptGetEptPtEntry(
     EptData *ept_data, ULONG64 physical_address) {
-  return EptpGetEptPtEntry(ept_data->ept_pml4, 4, physical_address);
+  const auto cache = EptpGetTranslationCache(ept_data);
+  if (!cache) {
+    return EptpGetEptPtEntry(ept_data->ept_pml4, 4, physical_address);
+  }
+
+  const auto pfn = UtilPfnFromPa(physical_address);
+  auto &cached = cache->entries[pfn & (kEptpTranslationCacheSize - 1)];
+  if (cached.entry && cached.pfn == pfn) {
+    return cached.entry;
+  }
+
+  const auto entry =
+      EptpGetEptPtEntry(ept_data->ept_pml4, 4, physical_address);
+  if (entry) {
+    cached.pfn = pfn;
+    cached.entry = entry;
+  }
+  return entry;
 }
 
-// Returns an EPT entry corresponds to the physical_address
+// Returns an EPT entry corresponds to the physical_address by walking tables
+// from the table_level down to the PT or a large page
 _Use_decl_annotations_ static EptCommonEntry *EptpGetEptPtEntry(
     EptCommonEntry *table, ULONG table_level, ULONG64 physical_address) {
-  if (!table) {
-    return nullptr;
-  }
-  switch (table_level) {
-    case 4: {
-      // table == PML4
-      const auto pxe_index = EptpAddressToPxeIndex(physical_address);
-      const auto ept_pml4_entry = &table[pxe_index];
-      if (!ept_pml4_entry->all) {
-        return nullptr;
-      }
-      return EptpGetEptPtEntry(reinterpret_cast<EptCommonEntry *>(UtilVaFromPfn(
-                                   ept_pml4_entry->fields.physial_address)),
-                               table_level - 1, physical_address);
+  for (; table && table_level; --table_level) {
+    // Each level is selected by 9 bits above the 12 bits of a byte offset
+    const auto shift = kEptpPtiShift + (table_level - 1) * 9;
+    const auto entry = &table[(physical_address >> shift) & kEptpPtxMask];
+    if (table_level == 1) {
+      return entry;
     }
-    case 3: {
-      // table == PDPT
-      const auto ppe_index = EptpAddressToPpeIndex(physical_address);
-      const auto ept_pdpt_entry = &table[ppe_index];
-      if (!ept_pdpt_entry->all) {
-        return nullptr;
-      }
-      return EptpGetEptPtEntry(reinterpret_cast<EptCommonEntry *>(UtilVaFromPfn(
-                                   ept_pdpt_entry->fields.physial_address)),
-                               table_level - 1, physical_address);
-    }
-    case 2: {
-      // table == PDT
-      const auto pde_index = EptpAddressToPdeIndex(physical_address);
-      const auto ept_pdt_entry = &table[pde_index];
-      if (!ept_pdt_entry->all) {
-        return nullptr;
-      }
-      return EptpGetEptPtEntry(reinterpret_cast<EptCommonEntry *>(UtilVaFromPfn(
-                                   ept_pdt_entry->fields.physial_address)),
-                               table_level - 1, physical_address);
+    if (!entry->all) {
+      return nullptr;
     }
-    case 1: {
-      // table == PT
-      const auto pte_index = EptpAddressToPteIndex(physical_address);
-      const auto ept_pt_entry = &table[pte_index];
-      return ept_pt_entry;
+    if (entry->fields.large_page) {
+      return entry;
     }
-    default:
-      HYPERPLATFORM_COMMON_DBG_BREAK();
-      return nullptr;
+    table = reinterpret_cast<EptCommonEntry *>(
+        UtilVaFromPfn(entry->fields.physial_address));
   }
+  return nullptr;
 }
 
-// Frees all EPT stuff
-_Use_decl_annotations_ void EptTermination(EptData *ept_data) {
-  HYPERPLATFORM_LOG_DEBUG("Used pre-allocated entries  = %2d / %2d",
-                          ept_data->preallocated_entries_count,
-                          kEptpNumberOfPreallocatedEntries);
+// Returns the translation cache of the current processor, or nullptr if it is
+// not available. Invalidates entries if tables have changed since they were
+// cached.
+_Use_decl_annotations_ static EptTranslationCache *EptpGetTranslationCache(
+    EptData *ept_data) {
+  const auto index = KeGetCurrentProcessorNumberEx(nullptr);
+  if (index >= ept_data->number_of_translation_caches) {
+    return nullptr;
+  }
 
-  EptpFreeUnusedPreAllocatedEntries(ept_data->preallocated_entries,
-                                    ept_data->preallocated_entries_count);
-  EptpDestructTables(ept_data->ept_pml4, 4);
-  ExFreePoolWithTag(ept_data->ept_pointer, kHyperPlatformCommonPoolTag);
-  ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
+  const auto cache = &ept_data->translation_caches[index];
+  const auto generation = ept_data->generation;
+  if (cache->generation != generation) {
+    RtlZeroMemory(cache->entries, sizeof(cache->entries));
+    cache->generation = generation;
+  }
+  return cache;
 }
 
-// Frees all unused pre-allocated EPT entries. Other used entries should be
-// freed with EptpDestructTables().
-_Use_decl_annotations_ static void EptpFreeUnusedPreAllocatedEntries(
-    EptCommonEntry **preallocated_entries, long used_count) {
-  for (auto i = used_count; i < kEptpNumberOfPreallocatedEntries; ++i) {
-    if (!preallocated_entries[i]) {
-      break;
-    }
-#pragma warning(push)
-#pragma warning(disable : 6001)
-    ExFreePoolWithTag(preallocated_entries[i], kHyperPlatformCommonPoolTag);
-#pragma warning(pop)
+// Makes translation caches of all processors discard cached entries
+_Use_decl_annotations_ static void EptpInvalidateTranslationCaches(
+    EptData *ept_data) {
+  if (ept_data) {
+    InterlockedIncrement(&ept_data->generation);
   }
-  ExFreePoolWithTag(preallocated_entries, kHyperPlatformCommonPoolTag);
 }
 
-// Frees all used EPT entries by walking through whole EPT
-_Use_decl_annotations_ static void EptpDestructTables(EptCommonEntry *table,
-                                                      ULONG table_level) {
-  for (auto i = 0ul; i < 512; ++i) {
-    const auto entry = table[i];
-    if (entry.fields.physial_address) {
-      const auto sub_table = reinterpret_cast<EptCommonEntry *>(
-          UtilVaFromPfn(entry.fields.physial_address));
-
-      switch (table_level) {
-        case 4:  // table == PML4, sub_table == PDPT
-        case 3:  // table == PDPT, sub_table == PDT
-          EptpDestructTables(sub_table, table_level - 1);
-          break;
-        case 2:  // table == PDT, sub_table == PT
-          ExFreePoolWithTag(sub_table, kHyperPlatformCommonPoolTag);
-          break;
-        default:
-          HYPERPLATFORM_COMMON_DBG_BREAK();
-          break;
-      }
+// Returns an EPT PDPTE corresponds to the physical_address
+_Use_decl_annotations_ static EptCommonEntry *EptpGetEptPdptEntry(
+    EptCommonEntry *ept_pml4, ULONG64 physical_address) {
+  const auto ept_pml4_entry =
+      &ept_pml4[EptpAddressToPxeIndex(physical_address)];
+  if (!ept_pml4_entry->all) {
+    return nullptr;
+  }
+  const auto ept_pdpt = reinterpret_cast<EptCommonEntry *>(
+      UtilVaFromPfn(ept_pml4_entry->fields.physial_address));
+  return &ept_pdpt[EptpAddressToPpeIndex(physical_address)];
+}
+
+// Returns an EPT PDE corresponds to the physical_address, or nullptr if it is
+// mapped with a 1 GB page
+_Use_decl_annotations_ static EptCommonEntry *EptpGetEptPdEntry(
+    EptCommonEntry *ept_pml4, ULONG64 physical_address) {
+  const auto ept_pdpt_entry = EptpGetEptPdptEntry(ept_pml4, physical_address);
+  if (!ept_pdpt_entry || !ept_pdpt_entry->all ||
+      ept_pdpt_entry->fields.large_page) {
+    return nullptr;
+  }
+  const auto ept_pdt = reinterpret_cast<EptCommonEntry *>(
+      UtilVaFromPfn(ept_pdpt_entry->fields.physial_address));
+  return &ept_pdt[EptpAddressToPdeIndex(physical_address)];
+}
+
+// Advances the generation so that every processor invalidates EPT before
+// returning to the guest, and returns the new generation
+_Use_decl_annotations_ LONG64 EptRequestInvalidation(EptData *ept_data) {
+  const auto generation =
+      InterlockedIncrement64(&ept_data->invalidation_generation);
+
+  // This processor has no batch and cannot defer invalidation
+  const auto index = KeGetCurrentProcessorNumberEx(nullptr);
+  if (index >= ept_data->number_of_translation_caches) {
+    UtilInveptGlobal();
+    InterlockedIncrement64(&ept_data->invalidations_issued);
+  }
+  return generation;
+}
+
+// Invalidates EPT once for all requests made on any processor since this
+// processor last did
+_Use_decl_annotations_ void EptFlushInvalidation(EptData *ept_data) {
+  const auto index = KeGetCurrentProcessorNumberEx(nullptr);
+  if (index >= ept_data->number_of_translation_caches) {
+    return;
+  }
+  const auto batch = &ept_data->invalidation_batches[index];
+  const auto generation = ept_data->invalidation_generation;
+  if (batch->flushed_generation == generation) {
+    return;
+  }
+
+  // Record the generation read before INVEPT. Changes made after that are
+  // covered by the next flush.
+  if (ept_data->single_context_invept) {
+    UtilInveptSingleContext(ept_data->ept_pointer->all);
+  } else {
+    UtilInveptGlobal();
+  }
+  InterlockedExchange64(&batch->flushed_generation, generation);
+  InterlockedIncrement64(&ept_data->invalidations_issued);
+}
+
+// Checks if all processors have invalidated EPT for the generation
+_Use_decl_annotations_ bool EptIsInvalidationCompleted(EptData *ept_data,
+                                                       LONG64 generation) {
+  for (auto i = 0ul; i < ept_data->number_of_translation_caches; ++i) {
+    if (ept_data->invalidation_batches[i].flushed_generation < generation) {
+      return false;
     }
   }
-  ExFreePoolWithTag(table, kHyperPlatformCommonPoolTag);
+  return true;
+}
+
+// Frees all EPT stuff
+_Use_decl_annotations_ void EptTermination(EptData *ept_data) {
+  const auto arena = &ept_data->table_arena;
+  EptpStopRefillThread(arena);
+  HYPERPLATFORM_LOG_DEBUG(
+      "EPT tables: used = %ld, free = %u, fewest free = %ld, refills = %ld",
+      arena->used_count, ExQueryDepthSList(&arena->free_tables),
+      arena->lowest_free_count, arena->refill_count);
+  HYPERPLATFORM_LOG_DEBUG(
+      "Pages mapped on first touch = %ld, device memory pages = %ld",
+      ept_data->first_touch_count, ept_data->device_memory_miss_count);
+  HYPERPLATFORM_LOG_DEBUG("EPT invalidations: requested = %lld, issued = %lld",
+                          ept_data->invalidation_generation,
+                          ept_data->invalidations_issued);
+  HYPERPLATFORM_LOG_DEBUG("Merges skipped as retired tables were full = %ld",
+                          ept_data->skipped_merge_count);
+
+  EptpFreeTableArena(arena);
+  ExFreePoolWithTag(ept_data->invalidation_batches,
+                    kHyperPlatformCommonPoolTag);
+  ExFreePoolWithTag(ept_data->translation_caches, kHyperPlatformCommonPoolTag);
+  ExFreePoolWithTag(ept_data->ept_pointer, kHyperPlatformCommonPoolTag);
+  ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
 }
 
 }  // extern "C"
@@ -9,6 +9,8 @@
 #define HYPERPLATFORM_EPT_H_
 
 #include <fltKernel.h>
+#include "ia32_type.h"
+#include "ept_entry.h"
 
 extern "C" {
 ////////////////////////////////////////////////////////////////////////////////
@@ -30,21 +32,6 @@ struct EptData;
 struct ProcessorFakePageData;
 struct SharedFakePageData;
 
-/// A structure made up of mutual fields across all EPT entry types
-union EptCommonEntry {
-  ULONG64 all;
-  struct {
-    ULONG64 read_access : 1;       //!< [0]
-    ULONG64 write_access : 1;      //!< [1]
-    ULONG64 execute_access : 1;    //!< [2]
-    ULONG64 memory_type : 3;       //!< [3:5]
-    ULONG64 reserved1 : 6;         //!< [6:11]
-    ULONG64 physial_address : 36;  //!< [12:48-1]
-    ULONG64 reserved2 : 16;        //!< [48:63]
-  } fields;
-};
-static_assert(sizeof(EptCommonEntry) == 8, "Size check");
-
 ////////////////////////////////////////////////////////////////////////////////
 //
 // prototypes
@@ -75,17 +62,71 @@ void EptTermination(_In_ EptData* ept_data);
 
 /// Handles VM-exit triggered by EPT violation
 /// @param ept_data   EptData to get an EPT pointer
+/// @param gp_regs   Guest general purpose registers
 _IRQL_requires_min_(DISPATCH_LEVEL) void EptHandleEptViolation(
     _In_ EptData* ept_data, _In_ ProcessorFakePageData* fp_data,
-    _In_ SharedFakePageData* shared_fp_data);
+    _In_ SharedFakePageData* shared_fp_data, _Inout_ GpRegisters* gp_regs);
 
 /// Returns an EPT entry corresponds to \a physical_address
 /// @param ept_data   EptData to get an EPT entry
 /// @param physical_address   Physical address to get an EPT entry
 /// @return An EPT entry, or nullptr if not allocated yet
+///
+/// The returned entry is a PDPTE mapping 1 GB or PDE mapping 2 MB when \a
+/// physical_address is mapped with a large page. Use EptSplitLargePage() to
+/// change a single page.
 EptCommonEntry* EptGetEptPtEntry(_In_ EptData* ept_data,
                                  _In_ ULONG64 physical_address);
 
+/// Returns a 4 KB EPT entry for \a physical_address splitting a large page
+/// @param ept_data   EptData to get an EPT entry
+/// @param physical_address   Physical address to get an EPT entry
+/// @return An EPT entry, or nullptr if not allocated yet
+///
+/// Invalidation is requested for a split large page. A caller must request
+/// it with EptRequestInvalidation() after changing the returned entry. Changes
+/// to the structure of tables are serialized with other processors.
+_IRQL_requires_min_(DISPATCH_LEVEL) EptCommonEntry* EptSplitLargePage(
+    _In_ EptData* ept_data, _In_ ULONG64 physical_address);
+
+/// Maps a region including \a physical_address with a large page again
+/// @param ept_data   EptData to update
+/// @param physical_address   Physical address in the region
+///
+/// Merges 4 KB entries into a 2 MB page, and then 2 MB pages into a 1 GB page
+/// if supported. Does nothing unless all EPT entries in the region map
+/// contiguous physical memory with full access and the same memory type.
+/// Invalidation is requested for a merged page, and a table replaced with it
+/// is freed only after all processors invalidate EPT.
+_IRQL_requires_min_(DISPATCH_LEVEL) void EptMergeLargePage(
+    _In_ EptData* ept_data, _In_ ULONG64 physical_address);
+
+/// Requests invalidation of cache derived from \a ept_data on all processors
+/// @param ept_data   EptData whose entries were changed
+/// @return A generation that is completed when all processors invalidated
+///
+/// Invalidation is deferred until each processor calls EptFlushInvalidation()
+/// before returning to the guest, so that it is done once however many times
+/// it is requested in the meantime. Call it after changing entries.
+_IRQL_requires_min_(DISPATCH_LEVEL) LONG64 EptRequestInvalidation(
+    _In_ EptData* ept_data);
+
+/// Invalidates cache derived from \a ept_data on this processor if requested
+/// @param ept_data   EptData to invalidate cache derived from
+///
+/// Does nothing unless invalidation was requested on any processor since this
+/// processor last invalidated. Uses single-context INVEPT when the processor
+/// supports it, or else global INVEPT.
+_IRQL_requires_min_(DISPATCH_LEVEL) void EptFlushInvalidation(
+    _In_ EptData* ept_data);
+
+/// Checks if all processors have invalidated cache derived from \a ept_data
+/// @param ept_data   EptData to check
+/// @param generation   A returned value of EptRequestInvalidation()
+/// @return true if no processor uses translations older than \a generation
+bool EptIsInvalidationCompleted(_In_ EptData* ept_data,
+                                _In_ LONG64 generation);
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // variables
@@ -0,0 +1,133 @@
+// Copyright (c) 2015-2017, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements EPT entry functions.
+
+#include "ept_entry.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static ULONG64 EptEntrypGetPfnStride(_In_ ULONG table_level);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns how many pages each entry of a table referenced by a PDPTE or PDE
+// maps; 512 pages (2 MB) or 1 page (4 KB)
+_Use_decl_annotations_ static ULONG64 EptEntrypGetPfnStride(
+    ULONG table_level) {
+  return (table_level == 3) ? kEptEntriesPerTable : 1ull;
+}
+
+// Fills a table with entries mapping the same memory as the large page. A 1
+// GB page is split into 2 MB pages.
+_Use_decl_annotations_ void EptEntryFillSubTable(
+    EptCommonEntry large_page_entry, ULONG table_level,
+    EptCommonEntry *sub_table) {
+  const auto pfn_stride = EptEntrypGetPfnStride(table_level);
+  const auto base_pfn = large_page_entry.fields.physial_address;
+  for (auto i = 0ul; i < kEptEntriesPerTable; ++i) {
+    sub_table[i].all = large_page_entry.all;
+    sub_table[i].fields.large_page = (table_level == 3);
+    sub_table[i].fields.physial_address = base_pfn + i * pfn_stride;
+  }
+}
+
+// Computes a large page entry if all entries of the table map contiguous
+// memory with full access and the same memory type
+_Use_decl_annotations_ bool EptEntryGetMergedEntry(
+    const EptCommonEntry *sub_table, ULONG table_level,
+    EptCommonEntry *large_page_entry) {
+  const auto pfn_stride = EptEntrypGetPfnStride(table_level);
+  const auto first_entry = sub_table[0];
+  if (!first_entry.fields.read_access || !first_entry.fields.write_access ||
+      !first_entry.fields.execute_access ||
+      first_entry.fields.large_page != (table_level == 3) ||
+      (first_entry.fields.physial_address %
+       (kEptEntriesPerTable * pfn_stride)) != 0) {
+    return false;
+  }
+  for (auto i = 1ul; i < kEptEntriesPerTable; ++i) {
+    auto expected_entry = first_entry;
+    expected_entry.fields.physial_address += i * pfn_stride;
+    if (sub_table[i].all != expected_entry.all) {
+      return false;
+    }
+  }
+
+  *large_page_entry = first_entry;
+  large_page_entry->fields.large_page = true;
+  return true;
+}
+
+// Returns the highest EPT level that can map a page according to the
+// capability
+_Use_decl_annotations_ ULONG EptEntryGetMaxLeafLevel(
+    Ia32VmxEptVpidCapMsr capability) {
+  if (!capability.fields.support_pde_2mb_pages) {
+    return 1;
+  }
+  if (!capability.fields.support_pdpte_1_gb_pages) {
+    return 2;
+  }
+  return 3;
+}
+
+// Returns the highest EPT level up to max_leaf_level whose page can map the
+// physical_address. A page is mappable when it is aligned, ends within the
+// run, and its first and last bytes are in the same memory type range.
+_Use_decl_annotations_ ULONG EptEntryGetLeafLevel(
+    ULONG64 physical_address, ULONG64 end_address, ULONG max_leaf_level,
+    const MemoryTypeRange *ranges, ULONG ranges_count) {
+  for (auto leaf_level = max_leaf_level; leaf_level > 1; --leaf_level) {
+    const auto page_size = EptEntryGetPageSize(leaf_level);
+    if ((physical_address % page_size) == 0 &&
+        end_address - physical_address >= page_size &&
+        MtrrFindMemoryTypeRange(ranges, ranges_count, physical_address) ==
+            MtrrFindMemoryTypeRange(ranges, ranges_count,
+                                    physical_address + page_size - 1)) {
+      return leaf_level;
+    }
+  }
+  return 1;
+}
+
+// Returns a size of a page mapped at the EPT level; each level maps 512 times
+// as much as the level below
+_Use_decl_annotations_ ULONG64 EptEntryGetPageSize(ULONG leaf_level) {
+  auto page_size = 0x1000ull;
+  for (auto level = 1ul; level < leaf_level; ++level) {
+    page_size *= kEptEntriesPerTable;
+  }
+  return page_size;
+}
+
+}  // extern "C"
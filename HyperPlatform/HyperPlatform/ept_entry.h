@@ -0,0 +1,133 @@
+// Copyright (c) 2015-2017, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to EPT entry functions.
+///
+/// These functions compute EPT entries to split and merge large pages, and
+/// choose page sizes to map physical memory with. They do not depend on the
+/// kernel so that they can be tested in user mode.
+
+#ifndef HYPERPLATFORM_EPT_ENTRY_H_
+#define HYPERPLATFORM_EPT_ENTRY_H_
+
+#include <fltKernel.h>
+#include "ia32_type.h"
+#include "mtrr.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// The number of values EptCommonEntry can hold in its software_slot field
+static const ULONG64 kEptSoftwareSlotCount = 1ull << 5;
+
+/// The number of entries in an EPT table
+static const ULONG kEptEntriesPerTable = 512;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// A structure made up of mutual fields across all EPT entry types
+///
+/// software_slot and software_write_granted are in bits the processor ignores
+/// regardless of VM-execution controls and are free for software to use. They
+/// are 0 unless set by a user of the entry. Bits 57, 58, 60 and 61 are left
+/// alone as they are verify guest paging, paging-write access, supervisor
+/// shadow stack and sub-page write permissions when those features are enabled.
+union EptCommonEntry {
+  ULONG64 all;
+  struct {
+    ULONG64 read_access : 1;             //!< [0]
+    ULONG64 write_access : 1;            //!< [1]
+    ULONG64 execute_access : 1;          //!< [2]
+    ULONG64 memory_type : 3;             //!< [3:5]
+    ULONG64 ignore_pat : 1;              //!< [6]
+    ULONG64 large_page : 1;              //!< [7]
+    ULONG64 reserved1 : 3;               //!< [8:10]
+    ULONG64 software_write_granted : 1;  //!< [11]
+    ULONG64 physial_address : 36;        //!< [12:48-1]
+    ULONG64 reserved2 : 4;               //!< [48:51]
+    ULONG64 software_slot : 5;           //!< [52:56]
+    ULONG64 reserved3 : 6;               //!< [57:62]
+    ULONG64 suppress_ve : 1;             //!< [63]
+  } fields;
+};
+static_assert(sizeof(EptCommonEntry) == 8, "Size check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Fills a table with entries mapping the same memory with the same
+/// attributes as a large page
+/// @param large_page_entry   A 1 GB EPT PDPTE or 2 MB EPT PDE to split
+/// @param table_level   3 for the EPT PDPTE, or 2 for the EPT PDE
+/// @param sub_table   A table to receive 2 MB or 4 KB entries respectively
+void EptEntryFillSubTable(
+    _In_ EptCommonEntry large_page_entry, _In_ ULONG table_level,
+    _Out_writes_(kEptEntriesPerTable) EptCommonEntry* sub_table);
+
+/// Computes a large page entry mapping all memory a table maps
+/// @param sub_table   A table referenced by an EPT PDPTE or PDE
+/// @param table_level   3 for the EPT PDPTE, or 2 for the EPT PDE
+/// @param large_page_entry   Receives a 1 GB or 2 MB page entry respectively
+/// @return true if the table can be replaced with \a large_page_entry
+///
+/// That is the case when all entries of \a sub_table map contiguous memory
+/// aligned to the large page with full access and the same attributes.
+bool EptEntryGetMergedEntry(
+    _In_reads_(kEptEntriesPerTable) const EptCommonEntry* sub_table,
+    _In_ ULONG table_level, _Out_ EptCommonEntry* large_page_entry);
+
+/// Returns the highest EPT level that can map a page
+/// @param capability   A value of IA32_VMX_EPT_VPID_CAP
+/// @return 3 when 1 GB pages are supported, 2 when only 2 MB pages are, or 1
+ULONG EptEntryGetMaxLeafLevel(_In_ Ia32VmxEptVpidCapMsr capability);
+
+/// Returns the EPT level of the largest page that can map the physical_address
+/// @param physical_address   A page aligned address to map
+/// @param end_address   An end of the run of physical memory that includes
+///                      \a physical_address, exclusive
+/// @param max_leaf_level   A returned value of EptEntryGetMaxLeafLevel()
+/// @param ranges   Memory type ranges built by MtrrBuildMemoryTypeRanges()
+/// @param ranges_count   A number of entries in \a ranges; must not be 0
+/// @return 3 for a 1 GB page, 2 for a 2 MB page, or 1 for a 4 KB page
+///
+/// A large page is chosen only when it is aligned, ends within the run, and
+/// all of it has the same memory type.
+ULONG EptEntryGetLeafLevel(_In_ ULONG64 physical_address,
+                           _In_ ULONG64 end_address, _In_ ULONG max_leaf_level,
+                           _In_reads_(ranges_count)
+                               const MemoryTypeRange* ranges,
+                           _In_ ULONG ranges_count);
+
+/// Returns a size of a page mapped at the EPT level
+/// @param leaf_level   3 for a 1 GB page, 2 for a 2 MB page, or 1 for 4 KB
+/// @return A size of the page in bytes
+ULONG64 EptEntryGetPageSize(_In_ ULONG leaf_level);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_EPT_ENTRY_H_
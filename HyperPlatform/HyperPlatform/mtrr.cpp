@@ -0,0 +1,171 @@
+// Copyright (c) 2015-2017, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements MTRR functions.
+
+#include "mtrr.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Compiles MTRRs into sorted, non-overlapping ranges of memory types so that
+// a memory type can be looked up with binary search
+_Use_decl_annotations_ ULONG MtrrBuildMemoryTypeRanges(
+    const MtrrData *mtrr_entries, ULONG entries_count, UCHAR default_type,
+    MemoryTypeRange *ranges) {
+  // Collect addresses where a memory type may change. Those are the first
+  // and the next to the last addresses of each MTRR.
+  ULONG64 boundaries[kMtrrMemoryTypeRangesSize] = {};
+  ULONG count = 1;  // boundaries[0] is always 0
+  for (auto i = 0ul; i < entries_count; ++i) {
+    const auto &mtrr_entry = mtrr_entries[i];
+    if (!mtrr_entry.enabled) {
+      break;
+    }
+    boundaries[count++] = mtrr_entry.range_base;
+    if (mtrr_entry.range_end != MAXULONG64) {
+      boundaries[count++] = mtrr_entry.range_end + 1;
+    }
+  }
+
+  // Sort them with insertion sort; there are few enough of them
+  for (auto i = 1ul; i < count; ++i) {
+    const auto boundary = boundaries[i];
+    auto j = i;
+    for (; j > 0 && boundaries[j - 1] > boundary; --j) {
+      boundaries[j] = boundaries[j - 1];
+    }
+    boundaries[j] = boundary;
+  }
+
+  // Every address between two boundaries has the same memory type. Resolve
+  // it once per range, and coalesce adjacent ranges with the same type.
+  ULONG ranges_count = 0;
+  for (auto i = 0ul; i < count; ++i) {
+    if (i > 0 && boundaries[i] == boundaries[i - 1]) {
+      continue;
+    }
+    const auto type = MtrrResolveMemoryType(mtrr_entries, entries_count,
+                                            default_type, boundaries[i]);
+    if (ranges_count && ranges[ranges_count - 1].type == type) {
+      continue;
+    }
+    ranges[ranges_count].range_base = boundaries[i];
+    ranges[ranges_count].type = type;
+    ranges_count++;
+  }
+  return ranges_count;
+}
+
+// Returns a memory type based on MTRRs by applying MTRR precedences to all of
+// them
+_Use_decl_annotations_ memory_type MtrrResolveMemoryType(
+    const MtrrData *mtrr_entries, ULONG entries_count, UCHAR default_type,
+    ULONG64 physical_address) {
+  // Indicate that MTRR is not defined (as a default)
+  UCHAR result_type = MAXUCHAR;
+
+  // Looks for MTRR that includes the specified physical_address
+  for (auto i = 0ul; i < entries_count; ++i) {
+    const auto &mtrr_entry = mtrr_entries[i];
+    if (!mtrr_entry.enabled) {
+      // Reached out the end of stored MTRRs
+      break;
+    }
+
+    if (physical_address < mtrr_entry.range_base ||
+        physical_address > mtrr_entry.range_end) {
+      // This MTRR does not describe a memory type of the physical_address
+      continue;
+    }
+
+    // See: MTRR Precedences
+    if (mtrr_entry.fixedMtrr) {
+      // If a fixed MTRR describes a memory type, it is priority
+      result_type = mtrr_entry.type;
+      break;
+    }
+
+    if (mtrr_entry.type == static_cast<UCHAR>(memory_type::kUncacheable)) {
+      // If a memory type is UC, it is priority. Do not continue to search as
+      // UC has the highest priority
+      result_type = mtrr_entry.type;
+      break;
+    }
+
+    if ((result_type == static_cast<UCHAR>(memory_type::kWriteThrough) &&
+         mtrr_entry.type == static_cast<UCHAR>(memory_type::kWriteBack)) ||
+        (result_type == static_cast<UCHAR>(memory_type::kWriteBack) &&
+         mtrr_entry.type == static_cast<UCHAR>(memory_type::kWriteThrough))) {
+      // If two or more MTRRs describes an over-wrapped memory region, and
+      // one is WT and the other one is WB, use WT regardless of their order.
+      // However, look for other MTRRs, as the other MTRR specifies the memory
+      // address as UC, which is priority.
+      result_type = static_cast<UCHAR>(memory_type::kWriteThrough);
+      continue;
+    }
+
+    // Otherwise, processor behavior is undefined. We just use the last MTRR
+    // describes the memory address.
+    result_type = mtrr_entry.type;
+  }
+
+  // Use the default MTRR if no MTRR entry is found
+  if (result_type == MAXUCHAR) {
+    result_type = default_type;
+  }
+
+  return static_cast<memory_type>(result_type);
+}
+
+// Returns an index of the memory type range that includes the
+// physical_address
+_Use_decl_annotations_ ULONG MtrrFindMemoryTypeRange(
+    const MemoryTypeRange *ranges, ULONG ranges_count,
+    ULONG64 physical_address) {
+  // Look for the last range starting at or below the physical_address. The
+  // first range always starts at 0.
+  ULONG low = 0;
+  ULONG high = ranges_count;
+  while (high - low > 1) {
+    const auto middle = low + (high - low) / 2;
+    if (ranges[middle].range_base <= physical_address) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+}  // extern "C"
@@ -0,0 +1,127 @@
+// Copyright (c) 2015-2017, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to MTRR functions.
+///
+/// These functions compile MTRRs into memory type ranges and look them up.
+/// They do not depend on the kernel so that they can be tested in user mode.
+
+#ifndef HYPERPLATFORM_MTRR_H_
+#define HYPERPLATFORM_MTRR_H_
+
+#include <fltKernel.h>
+#include "ia32_type.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// Architecture defined number of variable range MTRRs
+static const auto kMtrrNumOfMaxVariableRangeMtrrs = 255;
+
+/// Architecture defined number of fixed range MTRRs (1 for 64k, 2 for 16k, 8
+/// for 4k)
+static const auto kMtrrNumOfFixedRangeMtrrs = 1 + 2 + 8;
+
+/// A size of array to store all possible MTRRs
+static const auto kMtrrEntriesSize =
+    kMtrrNumOfMaxVariableRangeMtrrs + kMtrrNumOfFixedRangeMtrrs;
+
+/// A size of array to store memory type ranges compiled from MTRRs. Each MTRR
+/// adds at most two boundaries to the first range starting at 0.
+static const auto kMtrrMemoryTypeRangesSize = kMtrrEntriesSize * 2 + 1;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+#include <pshpack1.h>
+/// A range of memory described by an MTRR
+struct MtrrData {
+  bool enabled;        //<! Whether this entry is valid
+  bool fixedMtrr;      //<! Whether this entry manages a fixed range MTRR
+  UCHAR type;          //<! Memory Type (such as WB, UC)
+  bool reserverd1;     //<! Padding
+  ULONG reserverd2;    //<! Padding
+  ULONG64 range_base;  //<! A base address of a range managed by this entry
+  ULONG64 range_end;   //<! An end address of a range managed by this entry
+};
+#include <poppack.h>
+static_assert(sizeof(MtrrData) == 24, "Size check");
+
+/// A range of physical memory that has a single memory type. The range ends
+/// right before range_base of the next range.
+struct MemoryTypeRange {
+  ULONG64 range_base;  //<! A base address of the range
+  memory_type type;    //<! A memory type of the range with precedence resolved
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Compiles MTRRs into sorted, non-overlapping ranges of memory types
+/// @param mtrr_entries   MTRRs with fixed range ones first
+/// @param entries_count  A number of entries in \a mtrr_entries
+/// @param default_type   A memory type of addresses no MTRR describes
+/// @param ranges   An array of kMtrrMemoryTypeRangesSize to receive the ranges
+/// @return A number of ranges stored in \a ranges
+///
+/// \a mtrr_entries is terminated by its end or the first disabled entry, and
+/// may have at most kMtrrEntriesSize enabled ones. The first range always
+/// starts at 0.
+ULONG MtrrBuildMemoryTypeRanges(
+    _In_reads_(entries_count) const MtrrData *mtrr_entries,
+    _In_ ULONG entries_count, _In_ UCHAR default_type,
+    _Out_writes_(kMtrrMemoryTypeRangesSize) MemoryTypeRange *ranges);
+
+/// Returns a memory type of the physical_address by applying MTRR precedences
+/// to all MTRRs describing it
+/// @param mtrr_entries   MTRRs with fixed range ones first
+/// @param entries_count  A number of entries in \a mtrr_entries
+/// @param default_type   A memory type of addresses no MTRR describes
+/// @param physical_address   A physical address to resolve a memory type of
+/// @return A memory type of \a physical_address
+///
+/// This walks all MTRRs on each call. MtrrBuildMemoryTypeRanges() calls it
+/// once per range so that lookups do not have to.
+memory_type MtrrResolveMemoryType(
+    _In_reads_(entries_count) const MtrrData *mtrr_entries,
+    _In_ ULONG entries_count, _In_ UCHAR default_type,
+    _In_ ULONG64 physical_address);
+
+/// Returns an index of the memory type range that includes the
+/// physical_address
+/// @param ranges   Memory type ranges built by MtrrBuildMemoryTypeRanges()
+/// @param ranges_count   A number of entries in \a ranges; must not be 0
+/// @param physical_address   A physical address to look up
+/// @return An index of the range in \a ranges
+ULONG MtrrFindMemoryTypeRange(_In_reads_(ranges_count)
+                                  const MemoryTypeRange *ranges,
+                              _In_ ULONG ranges_count,
+                              _In_ ULONG64 physical_address);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_MTRR_H_
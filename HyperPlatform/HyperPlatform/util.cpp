@@ -49,6 +49,21 @@ _Must_inspect_result_ _IRQL_requires_max_(DISPATCH_LEVEL) NTKERNELAPI
 using MmAllocateContiguousNodeMemoryType =
     decltype(MmAllocateContiguousNodeMemory);
 
+// A DPC queued by UtilForEachProcessorInParallel() and its result
+struct UtilpParallelCall {
+  KDPC dpc;
+  NTSTATUS status;
+};
+
+// Shared by DPCs queued by UtilForEachProcessorInParallel()
+struct UtilpParallelCallContext {
+  NTSTATUS (*callback_routine)(void *);
+  void *context;
+  volatile LONG remaining_count;  // # of DPCs yet to complete
+  KEVENT all_completed;           // Signaled when remaining_count reaches 0
+  UtilpParallelCall calls[1];     // Indexed by a processor index
+};
+
 // dt nt!_LDR_DATA_TABLE_ENTRY
 struct LdrDataTableEntry {
   LIST_ENTRY in_load_order_links;
@@ -81,6 +96,8 @@ _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
 _IRQL_requires_max_(PASSIVE_LEVEL) static PhysicalMemoryDescriptor
     *UtilpBuildPhysicalMemoryRanges();
 
+static KDEFERRED_ROUTINE UtilpParallelCallDpcRoutine;
+
 static bool UtilpIsCanonicalFormAddress(_In_ void *address);
 
 static HardwarePte *UtilpAddressToPxe(_In_ const void *address);
@@ -89,8 +106,6 @@ static HardwarePte *UtilpAddressToPpe(_In_ const void *address);
 
 static HardwarePte *UtilpAddressToPde(_In_ const void *address);
 
-static HardwarePte *UtilpAddressToPte(_In_ const void *address);
-
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(INIT, UtilInitialization)
 #pragma alloc_text(PAGE, UtilTermination)
@@ -99,6 +114,7 @@ static HardwarePte *UtilpAddressToPte(_In_ const void *address);
 #pragma alloc_text(INIT, UtilpInitializePhysicalMemoryRanges)
 #pragma alloc_text(INIT, UtilpBuildPhysicalMemoryRanges)
 #pragma alloc_text(PAGE, UtilForEachProcessor)
+#pragma alloc_text(PAGE, UtilForEachProcessorInParallel)
 #pragma alloc_text(PAGE, UtilSleep)
 #pragma alloc_text(PAGE, UtilGetSystemProcAddress)
 #endif
@@ -382,19 +398,52 @@ UtilpBuildPhysicalMemoryRanges() {
   }
   RtlZeroMemory(pm_block, memory_block_size);
 
-  pm_block->number_of_runs = number_of_runs;
-  pm_block->number_of_pages = number_of_pages;
-
+  // Insert runs in the order of their base addresses
   for (auto run_index = 0ul; run_index < number_of_runs; run_index++) {
-    auto current_run = &pm_block->run[run_index];
     auto current_block = &pm_ranges[run_index];
-    current_run->base_page = static_cast<ULONG_PTR>(
-        UtilPfnFromPa(current_block->BaseAddress.QuadPart));
-    current_run->page_count = static_cast<ULONG_PTR>(
-        BYTES_TO_PAGES(current_block->NumberOfBytes.QuadPart));
+    const PhysicalMemoryRun current_run = {
+        static_cast<ULONG_PTR>(
+            UtilPfnFromPa(current_block->BaseAddress.QuadPart)),
+        static_cast<ULONG_PTR>(
+            BYTES_TO_PAGES(current_block->NumberOfBytes.QuadPart)),
+    };
+    auto insert_index = run_index;
+    for (; insert_index > 0 && pm_block->run[insert_index - 1].base_page >
+                                   current_run.base_page;
+         --insert_index) {
+      pm_block->run[insert_index] = pm_block->run[insert_index - 1];
+    }
+    pm_block->run[insert_index] = current_run;
   }
-
   ExFreePoolWithTag(pm_ranges, 'hPmM');
+
+  // Coalesce runs that are adjacent or overlap. The first run is always kept,
+  // so that no run is read before it is stored even if there are no runs.
+  PFN_COUNT number_of_coalesced_runs = 0;
+  for (auto run_index = 0ul; run_index < number_of_runs; run_index++) {
+    const auto current_run = &pm_block->run[run_index];
+    if (number_of_coalesced_runs) {
+      const auto last_run = &pm_block->run[number_of_coalesced_runs - 1];
+      const auto last_end = last_run->base_page + last_run->page_count;
+      if (current_run->base_page <= last_end) {
+        const auto current_end =
+            current_run->base_page + current_run->page_count;
+        if (current_end > last_end) {
+          last_run->page_count = current_end - last_run->base_page;
+        }
+        continue;
+      }
+    }
+    pm_block->run[number_of_coalesced_runs++] = *current_run;
+  }
+
+  number_of_pages = 0;
+  for (auto run_index = 0ul; run_index < number_of_coalesced_runs;
+       run_index++) {
+    number_of_pages += pm_block->run[run_index].page_count;
+  }
+  pm_block->number_of_runs = number_of_coalesced_runs;
+  pm_block->number_of_pages = number_of_pages;
   return pm_block;
 }
 
@@ -404,6 +453,34 @@ UtilGetPhysicalMemoryRanges() {
   return g_utilp_physical_memory_ranges;
 }
 
+// Returns an index of the first physical memory run that ends above the
+// physical_address using binary search
+_Use_decl_annotations_ ULONG UtilFindPhysicalMemoryRun(
+    ULONG64 physical_address) {
+  const auto pm_ranges = g_utilp_physical_memory_ranges;
+  const auto pfn = UtilPfnFromPa(physical_address);
+  ULONG low = 0;
+  ULONG high = pm_ranges->number_of_runs;
+  while (low < high) {
+    const auto middle = low + (high - low) / 2;
+    const auto run = &pm_ranges->run[middle];
+    if (run->base_page + run->page_count <= pfn) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+// Checks if the physical_address is in any of physical memory runs
+_Use_decl_annotations_ bool UtilIsPhysicalMemory(ULONG64 physical_address) {
+  const auto pm_ranges = g_utilp_physical_memory_ranges;
+  const auto index = UtilFindPhysicalMemoryRun(physical_address);
+  return index < pm_ranges->number_of_runs &&
+         pm_ranges->run[index].base_page <= UtilPfnFromPa(physical_address);
+}
+
 // Execute a given callback routine on all processors in PASSIVE_LEVEL. Returns
 // STATUS_SUCCESS when all callback returned STATUS_SUCCESS as well. When
 // one of callbacks returns anything but STATUS_SUCCESS, this function stops
@@ -441,6 +518,96 @@ UtilForEachProcessor(NTSTATUS (*callback_routine)(void *), void *context) {
   return STATUS_SUCCESS;
 }
 
+// Execute a given callback routine on all processors concurrently in
+// DISPATCH_LEVEL, and wait for all of them. Returns STATUS_SUCCESS when all
+// callbacks returned STATUS_SUCCESS as well. Otherwise, returns the first
+// failure in order of processor indexes.
+_Use_decl_annotations_ NTSTATUS UtilForEachProcessorInParallel(
+    NTSTATUS (*callback_routine)(void *), void *context, NTSTATUS *statuses) {
+  PAGED_CODE();
+
+  const auto number_of_processors =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+  const auto allocation_size =
+      sizeof(UtilpParallelCallContext) +
+      sizeof(UtilpParallelCall) * (number_of_processors - 1);
+  const auto call_context = reinterpret_cast<UtilpParallelCallContext *>(
+      ExAllocatePoolWithTag(NonPagedPool, allocation_size,
+                            kHyperPlatformCommonPoolTag));
+  if (!call_context) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(call_context, allocation_size);
+  call_context->callback_routine = callback_routine;
+  call_context->context = context;
+  call_context->remaining_count = static_cast<LONG>(number_of_processors);
+  KeInitializeEvent(&call_context->all_completed, NotificationEvent, FALSE);
+
+  // Target all DPCs before queuing any of them so that a failure does not
+  // leave queued DPCs behind
+  for (ULONG processor_index = 0; processor_index < number_of_processors;
+       processor_index++) {
+    PROCESSOR_NUMBER processor_number = {};
+    auto status =
+        KeGetProcessorNumberFromIndex(processor_index, &processor_number);
+    if (!NT_SUCCESS(status)) {
+      ExFreePoolWithTag(call_context, kHyperPlatformCommonPoolTag);
+      return status;
+    }
+
+    const auto dpc = &call_context->calls[processor_index].dpc;
+    KeInitializeDpc(dpc, UtilpParallelCallDpcRoutine, call_context);
+    KeSetImportanceDpc(dpc, HighImportance);
+    status = KeSetTargetProcessorDpcEx(dpc, &processor_number);
+    if (!NT_SUCCESS(status)) {
+      ExFreePoolWithTag(call_context, kHyperPlatformCommonPoolTag);
+      return status;
+    }
+  }
+  for (ULONG processor_index = 0; processor_index < number_of_processors;
+       processor_index++) {
+    KeInsertQueueDpc(&call_context->calls[processor_index].dpc,
+                     reinterpret_cast<void *>(
+                         static_cast<ULONG_PTR>(processor_index)),
+                     nullptr);
+  }
+  KeWaitForSingleObject(&call_context->all_completed, Executive, KernelMode,
+                        FALSE, nullptr);
+
+  auto status = STATUS_SUCCESS;
+  for (ULONG processor_index = 0; processor_index < number_of_processors;
+       processor_index++) {
+    const auto processor_status = call_context->calls[processor_index].status;
+    if (statuses) {
+      statuses[processor_index] = processor_status;
+    }
+    if (NT_SUCCESS(status) && !NT_SUCCESS(processor_status)) {
+      status = processor_status;
+    }
+  }
+  ExFreePoolWithTag(call_context, kHyperPlatformCommonPoolTag);
+  return status;
+}
+
+// Executes a callback routine on behalf of UtilForEachProcessorInParallel()
+_Use_decl_annotations_ static void UtilpParallelCallDpcRoutine(
+    _KDPC *dpc, PVOID deferred_context, PVOID system_argument1,
+    PVOID system_argument2) {
+  UNREFERENCED_PARAMETER(dpc);
+  UNREFERENCED_PARAMETER(system_argument2);
+
+  const auto call_context =
+      reinterpret_cast<UtilpParallelCallContext *>(deferred_context);
+  const auto processor_index =
+      static_cast<ULONG>(reinterpret_cast<ULONG_PTR>(system_argument1));
+  call_context->calls[processor_index].status =
+      call_context->callback_routine(call_context->context);
+  if (InterlockedDecrement(&call_context->remaining_count) == 0) {
+    KeSetEvent(&call_context->all_completed, IO_NO_INCREMENT, FALSE);
+  }
+}
+
 // Queues a given DPC routine on all processors. Returns STATUS_SUCCESS when DPC
 // is queued for all processors.
 _Use_decl_annotations_ NTSTATUS
@@ -528,7 +695,7 @@ _Use_decl_annotations_ bool UtilIsAccessibleAddress(void *address) {
   }
 
   const auto pde = UtilpAddressToPde(address);
-  const auto pte = UtilpAddressToPte(address);
+  const auto pte = UtilAddressToPte(address);
   if (!pde->valid) {
     return false;
   }
@@ -578,8 +745,7 @@ _Use_decl_annotations_ static HardwarePte *UtilpAddressToPde(
 }
 
 // Return an address of PTE
-_Use_decl_annotations_ static HardwarePte *UtilpAddressToPte(
-    const void *address) {
+_Use_decl_annotations_ HardwarePte *UtilAddressToPte(const void *address) {
   const auto addr = reinterpret_cast<ULONG_PTR>(address);
   const auto pte_index = (addr >> g_utilp_pti_shift) & g_utilp_pti_mask;
   const auto offset = pte_index * sizeof(HardwarePte);
@@ -788,6 +954,15 @@ _Use_decl_annotations_ void UtilWriteMsr64(Msr msr, ULONG64 value) {
       AsmInvept(InvEptType::kGlobalInvalidation, &desc));
 }
 
+// Executes the INVEPT instruction and invalidates EPT entry cache derived from
+// the EPT pointer
+_Use_decl_annotations_ VmxStatus UtilInveptSingleContext(ULONG64 ept_pointer) {
+  InvEptDescriptor desc = {};
+  desc.ept_pointer.all = ept_pointer;
+  return static_cast<VmxStatus>(
+      AsmInvept(InvEptType::kSingleContextInvalidation, &desc));
+}
+
 // Executes the INVVPID instruction (type 0)
 _Use_decl_annotations_ VmxStatus UtilInvvpidIndividualAddress(USHORT vpid,
                                                               void *address) {
@@ -38,6 +38,9 @@ static_assert(sizeof(PhysicalMemoryRun) == 0x8, "Size check");
 #endif
 
 /// Represents a physical memory ranges of the system
+///
+/// Runs are sorted by their base addresses, and adjacent or overlapping runs
+/// are coalesced into one.
 struct PhysicalMemoryDescriptor {
   PFN_COUNT number_of_runs;    //!< A number of PhysicalMemoryDescriptor::run
   PFN_NUMBER number_of_pages;  //!< A physical memory size in pages
@@ -69,10 +72,12 @@ enum class HypercallNumber : unsigned __int32 {
   kTerminateVmm,            //!< Terminates VMM
   kPingVmm,                 //!< Sends ping to the VMM
   kGetSharedProcessorData,  //!< Terminates VMM
+  kInvalidateEpt,           //!< Applies EPT changes to the current processor
   kApiMonCreateConcealment = 0x11223300,
   kApiMonEnableConcealment,
   kApiMonDisableConcealment,
   kApiMonDeleteConcealment,
+  kApiMonCreateAndEnableConcealments,
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -98,6 +103,19 @@ void *UtilPcToFileHeader(_In_ void *address);
 /// @return Physical memory ranges; never fails
 const PhysicalMemoryDescriptor *UtilGetPhysicalMemoryRanges();
 
+/// Returns an index of the first physical memory run that ends above \a
+/// physical_address
+/// @param physical_address   A physical address to look for
+/// @return An index of PhysicalMemoryDescriptor::run, or
+///         PhysicalMemoryDescriptor::number_of_runs if no run ends above \a
+///         physical_address
+ULONG UtilFindPhysicalMemoryRun(_In_ ULONG64 physical_address);
+
+/// Checks if \a physical_address is in any of physical memory runs
+/// @param physical_address   A physical address to check
+/// @return true if \a physical_address is RAM rather than device memory
+bool UtilIsPhysicalMemory(_In_ ULONG64 physical_address);
+
 /// Executes \a callback_routine on each processor
 /// @param callback_routine   A function to execute
 /// @param context  An arbitrary parameter for \a callback_routine
@@ -106,6 +124,21 @@ _IRQL_requires_max_(APC_LEVEL) NTSTATUS
     UtilForEachProcessor(_In_ NTSTATUS (*callback_routine)(void *),
                          _In_opt_ void *context);
 
+/// Executes \a callback_routine on all processors at the same time
+/// @param callback_routine   A function to execute at DISPATCH_LEVEL
+/// @param context  An arbitrary parameter for \a callback_routine
+/// @param statuses   An optional array to receive a value \a callback_routine
+///                   returned on each processor, indexed by a processor index
+/// @return STATUS_SUCCESS when \a returned STATUS_SUCCESS on all processors
+///
+/// Runs \a callback_routine in a DPC queued to each processor and waits for
+/// all of them. Unlike UtilForEachProcessor(), \a callback_routine is executed
+/// on all processors even if it fails on some of them.
+_IRQL_requires_max_(APC_LEVEL) NTSTATUS UtilForEachProcessorInParallel(
+    _In_ NTSTATUS (*callback_routine)(void *), _In_opt_ void *context,
+    _Out_writes_opt_(KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS))
+        NTSTATUS *statuses);
+
 /// Queues \a deferred_routine on all processors
 /// @param deferred_routine   A DPC routine to be queued
 /// @param context  An arbitrary parameter for \a deferred_routine
@@ -146,6 +179,11 @@ bool UtilIsX86Pae();
 /// @return true if the \a address is present on physical memory
 bool UtilIsAccessibleAddress(_In_ void *address);
 
+/// Returns an address of PTE that maps a given virtual address
+/// @param address   A virtual address
+/// @return An address of PTE. The PTE itself may not be present.
+HardwarePte *UtilAddressToPte(_In_ const void *address);
+
 /// VA -> PA
 /// @param va   A virtual address to get its physical address
 /// @return A physical address of \a va, or nullptr
@@ -254,6 +292,11 @@ void UtilWriteMsr64(_In_ Msr msr, _In_ ULONG64 value);
 /// @return A result of the INVEPT instruction
 VmxStatus UtilInveptGlobal();
 
+/// Executes the INVEPT instruction and invalidates EPT entry cache of an EPT
+/// @param ept_pointer   An EPT pointer to invalidate cache derived from
+/// @return A result of the INVEPT instruction
+VmxStatus UtilInveptSingleContext(_In_ ULONG64 ept_pointer);
+
 /// Executes the INVVPID instruction (type 0)
 /// @return A result of the INVVPID instruction
 VmxStatus UtilInvvpidIndividualAddress(_In_ USHORT vpid, _In_ void *address);
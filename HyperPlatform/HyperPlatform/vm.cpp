@@ -89,6 +89,9 @@ _IRQL_requires_max_(PASSIVE_LEVEL) static ULONG
 _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
     VmpStopVm(_In_opt_ void *context);
 
+_IRQL_requires_(DISPATCH_LEVEL) static NTSTATUS
+    VmpStopVmOnProcessor(_In_ void *context);
+
 _IRQL_requires_max_(PASSIVE_LEVEL) static void VmpFreeProcessorData(
     _In_opt_ ProcessorData *processor_data);
 
@@ -279,6 +282,20 @@ _Use_decl_annotations_ static SharedProcessorData *VmpInitializeSharedData() {
   }
   SaveCpuinfo(shared_fp_data);
   shared_data->shared_fp_data = shared_fp_data;
+
+#if (HYPERPLATFORM_COMMON_SHARE_EPT != 0)
+  // Set up EPT used by all processors
+  const auto ept_data = EptInitialization();
+  if (!ept_data) {
+    FpFreeSharedProcessorData(shared_fp_data);
+    ExFreePoolWithTag(shared_data->io_bitmap_a, kHyperPlatformCommonPoolTag);
+    ExFreePoolWithTag(shared_data->msr_bitmap, kHyperPlatformCommonPoolTag);
+    ExFreePoolWithTag(shared_data, kHyperPlatformCommonPoolTag);
+    return nullptr;
+  }
+  shared_data->ept_data = ept_data;
+  KeInitializeSpinLock(&shared_data->ept_lock);
+#endif
   
   return shared_data;
 }
@@ -393,7 +410,11 @@ _Use_decl_annotations_ static void VmpInitializeVm(
   InterlockedIncrement(&processor_data->shared_data->reference_count);
 
   // Set up EPT
+#if (HYPERPLATFORM_COMMON_SHARE_EPT != 0)
+  processor_data->ept_data = shared_data->ept_data;
+#else
   processor_data->ept_data = EptInitialization();
+#endif
   if (!processor_data->ept_data) {
     goto ReturnFalse;
   }
@@ -918,7 +939,30 @@ _Use_decl_annotations_ void VmTermination() {
   PAGED_CODE();
 
   HYPERPLATFORM_LOG_INFO("Uninstalling VMM.");
-  auto status = UtilForEachProcessor(VmpStopVm, nullptr);
+
+  // Stop virtualization on all processors at once, and then free memory for
+  // them in PASSIVE_LEVEL. Fall back to stopping processors one by one when
+  // there is no memory to remember management structures to free.
+  const auto number_of_processors =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto all_processor_data =
+      reinterpret_cast<ProcessorData **>(ExAllocatePoolWithTag(
+          NonPagedPool, sizeof(ProcessorData *) * number_of_processors,
+          kHyperPlatformCommonPoolTag));
+  NTSTATUS status = STATUS_SUCCESS;
+  if (all_processor_data) {
+    RtlZeroMemory(all_processor_data,
+                  sizeof(ProcessorData *) * number_of_processors);
+    status = UtilForEachProcessorInParallel(VmpStopVmOnProcessor,
+                                            all_processor_data, nullptr);
+    for (ULONG processor_index = 0; processor_index < number_of_processors;
+         processor_index++) {
+      VmpFreeProcessorData(all_processor_data[processor_index]);
+    }
+    ExFreePoolWithTag(all_processor_data, kHyperPlatformCommonPoolTag);
+  } else {
+    status = UtilForEachProcessor(VmpStopVm, nullptr);
+  }
   if (NT_SUCCESS(status)) {
     HYPERPLATFORM_LOG_INFO("The VMM has been uninstalled.");
   } else {
@@ -951,6 +995,27 @@ _Use_decl_annotations_ static NTSTATUS VmpStopVm(void *context) {
   return STATUS_SUCCESS;
 }
 
+// Stops virtualization through a hypercall and saves an address of the
+// management structure into an array indexed by a processor index so that a
+// caller can free it in PASSIVE_LEVEL
+_Use_decl_annotations_ static NTSTATUS VmpStopVmOnProcessor(void *context) {
+  const auto all_processor_data = reinterpret_cast<ProcessorData **>(context);
+
+  ProcessorData *processor_data = nullptr;
+  auto status = UtilVmCall(HypercallNumber::kTerminateVmm, &processor_data);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  // Clear CR4.VMXE, as there is no reason to leave the bit after vmxoff
+  Cr4 cr4 = {__readcr4()};
+  cr4.fields.vmxe = false;
+  __writecr4(cr4.all);
+
+  all_processor_data[KeGetCurrentProcessorNumberEx(nullptr)] = processor_data;
+  return STATUS_SUCCESS;
+}
+
 // Frees all related memory
 _Use_decl_annotations_ static void VmpFreeProcessorData(
     ProcessorData *processor_data) {
@@ -969,9 +1034,11 @@ _Use_decl_annotations_ static void VmpFreeProcessorData(
     ExFreePoolWithTag(processor_data->vmxon_region,
                       kHyperPlatformCommonPoolTag);
   }
+#if (HYPERPLATFORM_COMMON_SHARE_EPT == 0)
   if (processor_data->ept_data) {
     EptTermination(processor_data->ept_data);
   }
+#endif
   if (processor_data->fp_data) {
     FpFreeProcessorData(processor_data->fp_data);
   }
@@ -996,6 +1063,9 @@ _Use_decl_annotations_ static void VmpFreeSharedData(
   }
 
   HYPERPLATFORM_LOG_DEBUG("Freeing shared data...");
+  if (processor_data->shared_data->ept_data) {
+    EptTermination(processor_data->shared_data->ept_data);
+  }
   if (processor_data->shared_data->shared_fp_data) {
     FpFreeSharedProcessorData(processor_data->shared_data->shared_fp_data);
   }
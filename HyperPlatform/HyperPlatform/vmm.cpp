@@ -160,6 +160,11 @@ static void VmmpInjectInterruption(_In_ InterruptionType interruption_type,
                                    _In_ bool deliver_error_code,
                                    _In_ ULONG32 error_code);
 
+static void VmmpAcquireEptLock(_In_ ProcessorData *processor_data,
+                               _Out_ PKLOCK_QUEUE_HANDLE lock_handle);
+
+static void VmmpReleaseEptLock(_In_ PKLOCK_QUEUE_HANDLE lock_handle);
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // variables
@@ -201,10 +206,13 @@ _Use_decl_annotations_ bool __stdcall VmmVmExitHandler(VmmInitialStack *stack) {
   VmmpHandleVmExit(&guest_context);
 
   // See: Guidelines for Use of the INVVPID Instruction, and Guidelines for Use
-  // of the INVEPT Instruction
+  // of the INVEPT Instruction. Otherwise, invalidate EPT once for all changes
+  // made while handling this VM-exit.
   if (!guest_context.vm_continue) {
     UtilInveptGlobal();
     UtilInvvpidAllContext();
+  } else {
+    EptFlushInvalidation(stack->processor_data->ept_data);
   }
 
   // Restore guest's context
@@ -1055,6 +1063,8 @@ _Use_decl_annotations_ static void VmmpHandleVmCall(
   const auto hypercall_number =
       static_cast<HypercallNumber>(guest_context->gp_regs->cx);
   const auto context = reinterpret_cast<void *>(guest_context->gp_regs->dx);
+  const auto processor_data = guest_context->stack->processor_data;
+  KLOCK_QUEUE_HANDLE lock_handle = {};
 
   switch (hypercall_number) {
     case HypercallNumber::kTerminateVmm:
@@ -1075,6 +1085,11 @@ _Use_decl_annotations_ static void VmmpHandleVmCall(
           guest_context->stack->processor_data->shared_data;
       VmmpIndicateSuccessfulVmcall(guest_context);
       break;
+    case HypercallNumber::kInvalidateEpt:
+      // Nothing to do here. EPT is invalidated before returning to the guest
+      // if it was changed on any processor since this processor last did.
+      VmmpIndicateSuccessfulVmcall(guest_context);
+      break;
     case HypercallNumber::kApiMonCreateConcealment:
       FpVmCallCreateFakePage(
           guest_context->stack->processor_data->shared_data->shared_fp_data,
@@ -1082,15 +1097,17 @@ _Use_decl_annotations_ static void VmmpHandleVmCall(
       VmmpIndicateSuccessfulVmcall(guest_context);
       break;
     case HypercallNumber::kApiMonEnableConcealment:
-      FpVmCallEnableFakePages(
-          guest_context->stack->processor_data->ept_data,
-          guest_context->stack->processor_data->shared_data->shared_fp_data);
+      VmmpAcquireEptLock(processor_data, &lock_handle);
+      FpVmCallEnableFakePages(processor_data->ept_data,
+                              processor_data->shared_data->shared_fp_data);
+      VmmpReleaseEptLock(&lock_handle);
       VmmpIndicateSuccessfulVmcall(guest_context);
       break;
     case HypercallNumber::kApiMonDisableConcealment:
-      FpVmCallDisableFakePages(
-          guest_context->stack->processor_data->ept_data,
-          guest_context->stack->processor_data->shared_data->shared_fp_data);
+      VmmpAcquireEptLock(processor_data, &lock_handle);
+      FpVmCallDisableFakePages(processor_data->ept_data,
+                               processor_data->shared_data->shared_fp_data);
+      VmmpReleaseEptLock(&lock_handle);
       VmmpIndicateSuccessfulVmcall(guest_context);
       break;
     case HypercallNumber::kApiMonDeleteConcealment:
@@ -1098,6 +1115,19 @@ _Use_decl_annotations_ static void VmmpHandleVmCall(
           guest_context->stack->processor_data->shared_data->shared_fp_data);
       VmmpIndicateSuccessfulVmcall(guest_context);
       break;
+    case HypercallNumber::kApiMonCreateAndEnableConcealments: {
+      VmmpAcquireEptLock(processor_data, &lock_handle);
+      const auto succeeded = FpVmCallCreateAndEnableFakePages(
+          processor_data->ept_data,
+          processor_data->shared_data->shared_fp_data, context);
+      VmmpReleaseEptLock(&lock_handle);
+      if (succeeded) {
+        VmmpIndicateSuccessfulVmcall(guest_context);
+      } else {
+        VmmpIndicateUnsuccessfulVmcall(guest_context);
+      }
+      break;
+    }
     default:
       // Unsupported hypercall
       VmmpIndicateUnsuccessfulVmcall(guest_context);
@@ -1131,7 +1161,8 @@ _Use_decl_annotations_ static void VmmpHandleEptViolation(
   HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE();
   auto processor_data = guest_context->stack->processor_data;
   EptHandleEptViolation(processor_data->ept_data, processor_data->fp_data,
-                        processor_data->shared_data->shared_fp_data);
+                        processor_data->shared_data->shared_fp_data,
+                        guest_context->gp_regs);
 }
 
 // EXIT_REASON_EPT_MISCONFIG
@@ -1359,4 +1390,28 @@ _Use_decl_annotations_ static void VmmpInjectInterruption(
   }
 }
 
+// Acquires a lock to enable or disable fake pages when EPT is shared by all
+// processors, so that a large page split for a fake page is not merged by
+// another processor before the fake page is enabled
+_Use_decl_annotations_ static void VmmpAcquireEptLock(
+    ProcessorData *processor_data, PKLOCK_QUEUE_HANDLE lock_handle) {
+#if (HYPERPLATFORM_COMMON_SHARE_EPT != 0)
+  KeAcquireInStackQueuedSpinLockAtDpcLevel(
+      &processor_data->shared_data->ept_lock, lock_handle);
+#else
+  UNREFERENCED_PARAMETER(processor_data);
+  UNREFERENCED_PARAMETER(lock_handle);
+#endif
+}
+
+// Releases a lock acquired with VmmpAcquireEptLock()
+_Use_decl_annotations_ static void VmmpReleaseEptLock(
+    PKLOCK_QUEUE_HANDLE lock_handle) {
+#if (HYPERPLATFORM_COMMON_SHARE_EPT != 0)
+  KeReleaseInStackQueuedSpinLockFromDpcLevel(lock_handle);
+#else
+  UNREFERENCED_PARAMETER(lock_handle);
+#endif
+}
+
 }  // extern "C"
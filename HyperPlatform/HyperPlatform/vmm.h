@@ -33,6 +33,8 @@ struct SharedProcessorData {
   void* io_bitmap_b;              //!< Bitmap to activate IO VM-exit (~ 0xffff)
   
   struct SharedFakePageData* shared_fp_data;  ///< Shared fake page data
+  struct EptData* ept_data;  ///< EPT used by all processors if shared
+  KSPIN_LOCK ept_lock;       ///< Serializes hypercalls changing the shared EPT
 };
 
 /// Represents VMM related data associated with each processor
@@ -0,0 +1,370 @@
+// Copyright (c) 2015-2017, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Tests computing EPT entries to split and merge large pages.
+
+#include "../HyperPlatform/ept_entry.h"
+#include "test.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns a large page entry with full access
+static EptCommonEntry EptEntryTestpLargePage(ULONG64 pfn, memory_type type) {
+  EptCommonEntry entry = {};
+  entry.fields.read_access = true;
+  entry.fields.write_access = true;
+  entry.fields.execute_access = true;
+  entry.fields.memory_type = static_cast<ULONG64>(type);
+  entry.fields.large_page = true;
+  entry.fields.physial_address = pfn;
+  return entry;
+}
+
+// Returns a capability supporting the given large pages
+static Ia32VmxEptVpidCapMsr EptEntryTestpCapability(bool support_2mb_pages,
+                                                    bool support_1gb_pages) {
+  Ia32VmxEptVpidCapMsr capability = {};
+  capability.fields.support_page_walk_length4 = true;
+  capability.fields.support_write_back_memory_type = true;
+  capability.fields.support_pde_2mb_pages = support_2mb_pages;
+  capability.fields.support_pdpte_1_gb_pages = support_1gb_pages;
+  return capability;
+}
+
+// Returns a leaf level of the physical_address in a run ending at end_address
+// for the capability
+static ULONG EptEntryTestpGetLeafLevel(
+    Ia32VmxEptVpidCapMsr capability, const MemoryTypeRange *ranges,
+    ULONG ranges_count, ULONG64 physical_address, ULONG64 end_address) {
+  return EptEntryGetLeafLevel(physical_address, end_address,
+                              EptEntryGetMaxLeafLevel(capability), ranges,
+                              ranges_count);
+}
+
+// Checks if the table can be merged
+static bool EptEntryTestpCanMerge(const EptCommonEntry *sub_table,
+                                  ULONG table_level) {
+  EptCommonEntry merged_entry = {};
+  return EptEntryGetMergedEntry(sub_table, table_level, &merged_entry);
+}
+
+// Splitting a 2 MB page makes 4 KB pages of contiguous memory with the same
+// attributes
+static void EptEntryTestSplit2MbPage() {
+  auto large_page = EptEntryTestpLargePage(0x200, memory_type::kWriteBack);
+  large_page.fields.software_slot = 5;
+  EptCommonEntry sub_table[kEptEntriesPerTable] = {};
+  EptEntryFillSubTable(large_page, 2, sub_table);
+
+  auto as_expected = true;
+  for (auto i = 0ul; i < kEptEntriesPerTable; ++i) {
+    auto expected_entry = large_page;
+    expected_entry.fields.large_page = false;
+    expected_entry.fields.physial_address = 0x200 + i;
+    as_expected &= (sub_table[i].all == expected_entry.all);
+  }
+  HYPERPLATFORM_TEST_EXPECT(as_expected);
+}
+
+// Splitting a 1 GB page makes 2 MB pages of contiguous memory with the same
+// attributes
+static void EptEntryTestSplit1GbPage() {
+  const auto large_page =
+      EptEntryTestpLargePage(0x40000, memory_type::kUncacheable);
+  EptCommonEntry sub_table[kEptEntriesPerTable] = {};
+  EptEntryFillSubTable(large_page, 3, sub_table);
+
+  auto as_expected = true;
+  for (auto i = 0ul; i < kEptEntriesPerTable; ++i) {
+    auto expected_entry = large_page;
+    expected_entry.fields.physial_address = 0x40000 + i * 512;
+    as_expected &= (sub_table[i].all == expected_entry.all);
+  }
+  HYPERPLATFORM_TEST_EXPECT(as_expected);
+}
+
+// Merging a split table restores the large page
+static void EptEntryTestMergeSplitTable() {
+  for (auto table_level = 2ul; table_level <= 3; ++table_level) {
+    auto large_page = EptEntryTestpLargePage(0x40000, memory_type::kWriteBack);
+    large_page.fields.software_slot = 7;
+    EptCommonEntry sub_table[kEptEntriesPerTable] = {};
+    EptEntryFillSubTable(large_page, table_level, sub_table);
+
+    EptCommonEntry merged_entry = {};
+    HYPERPLATFORM_TEST_EXPECT(
+        EptEntryGetMergedEntry(sub_table, table_level, &merged_entry));
+    HYPERPLATFORM_TEST_EXPECT(merged_entry.all == large_page.all);
+  }
+}
+
+// A table is not merged when any entry has a different memory type
+static void EptEntryTestMergeRefusesMemoryTypeMismatch() {
+  for (auto table_level = 2ul; table_level <= 3; ++table_level) {
+    const auto large_page =
+        EptEntryTestpLargePage(0x40000, memory_type::kWriteBack);
+    EptCommonEntry sub_table[kEptEntriesPerTable] = {};
+    EptEntryFillSubTable(large_page, table_level, sub_table);
+    sub_table[kEptEntriesPerTable - 1].fields.memory_type =
+        static_cast<ULONG64>(memory_type::kUncacheable);
+
+    HYPERPLATFORM_TEST_EXPECT(!EptEntryTestpCanMerge(sub_table, table_level));
+  }
+}
+
+// A table is not merged when any entry lacks any access, even if all entries
+// have the same permissions
+static void EptEntryTestMergeRefusesPermissionMismatch() {
+  const auto large_page =
+      EptEntryTestpLargePage(0x200, memory_type::kWriteBack);
+  EptCommonEntry sub_table[kEptEntriesPerTable] = {};
+
+  EptEntryFillSubTable(large_page, 2, sub_table);
+  sub_table[100].fields.write_access = false;
+  HYPERPLATFORM_TEST_EXPECT(!EptEntryTestpCanMerge(sub_table, 2));
+
+  EptEntryFillSubTable(large_page, 2, sub_table);
+  sub_table[0].fields.execute_access = false;
+  HYPERPLATFORM_TEST_EXPECT(!EptEntryTestpCanMerge(sub_table, 2));
+
+  EptEntryFillSubTable(large_page, 2, sub_table);
+  for (auto &entry : sub_table) {
+    entry.fields.read_access = false;
+  }
+  HYPERPLATFORM_TEST_EXPECT(!EptEntryTestpCanMerge(sub_table, 2));
+}
+
+// A table is not merged when entries differ in bits used by software
+static void EptEntryTestMergeRefusesSoftwareBitsMismatch() {
+  const auto large_page =
+      EptEntryTestpLargePage(0x200, memory_type::kWriteBack);
+  EptCommonEntry sub_table[kEptEntriesPerTable] = {};
+  EptEntryFillSubTable(large_page, 2, sub_table);
+  sub_table[1].fields.software_slot = 1;
+
+  HYPERPLATFORM_TEST_EXPECT(!EptEntryTestpCanMerge(sub_table, 2));
+}
+
+// Bits used by software are only in bits the processor always ignores
+static void EptEntryTestSoftwareBitsAreIgnoredBits() {
+  EptCommonEntry entry = {};
+  entry.fields.software_write_granted = true;
+  entry.fields.software_slot = kEptSoftwareSlotCount - 1;
+
+  // Bits 11 and 52:56
+  HYPERPLATFORM_TEST_EXPECT(entry.all == 0x01f0000000000800);
+}
+
+// A table is not merged when entries do not map contiguous memory aligned to
+// the large page
+static void EptEntryTestMergeRefusesNonContiguousMemory() {
+  const auto large_page =
+      EptEntryTestpLargePage(0x200, memory_type::kWriteBack);
+  EptCommonEntry sub_table[kEptEntriesPerTable] = {};
+
+  // Two pages swapped
+  EptEntryFillSubTable(large_page, 2, sub_table);
+  sub_table[7].fields.physial_address++;
+  sub_table[8].fields.physial_address--;
+  HYPERPLATFORM_TEST_EXPECT(!EptEntryTestpCanMerge(sub_table, 2));
+
+  // A page of another region
+  EptEntryFillSubTable(large_page, 2, sub_table);
+  sub_table[kEptEntriesPerTable - 1].fields.physial_address = 0x1000;
+  HYPERPLATFORM_TEST_EXPECT(!EptEntryTestpCanMerge(sub_table, 2));
+
+  // Contiguous but not aligned to 2 MB
+  EptEntryFillSubTable(large_page, 2, sub_table);
+  for (auto &entry : sub_table) {
+    entry.fields.physial_address++;
+  }
+  HYPERPLATFORM_TEST_EXPECT(!EptEntryTestpCanMerge(sub_table, 2));
+
+  // 2 MB pages 4 KB apart
+  const auto huge_page =
+      EptEntryTestpLargePage(0x40000, memory_type::kWriteBack);
+  EptEntryFillSubTable(huge_page, 3, sub_table);
+  for (auto i = 0ul; i < kEptEntriesPerTable; ++i) {
+    sub_table[i].fields.physial_address = 0x40000 + i;
+  }
+  HYPERPLATFORM_TEST_EXPECT(!EptEntryTestpCanMerge(sub_table, 3));
+}
+
+// A table referenced by a PDPTE is not merged unless all its entries are 2 MB
+// pages
+static void EptEntryTestMergeRefusesNonLargePages() {
+  const auto huge_page =
+      EptEntryTestpLargePage(0x40000, memory_type::kWriteBack);
+  EptCommonEntry sub_table[kEptEntriesPerTable] = {};
+
+  EptEntryFillSubTable(huge_page, 3, sub_table);
+  sub_table[3].fields.large_page = false;
+  HYPERPLATFORM_TEST_EXPECT(!EptEntryTestpCanMerge(sub_table, 3));
+
+  EptEntryFillSubTable(huge_page, 3, sub_table);
+  for (auto &entry : sub_table) {
+    entry.fields.large_page = false;
+  }
+  HYPERPLATFORM_TEST_EXPECT(!EptEntryTestpCanMerge(sub_table, 3));
+}
+
+// The highest leaf level follows the large pages the capability supports. 1 GB
+// pages are not used without 2 MB pages.
+static void EptEntryTestMaxLeafLevel() {
+  HYPERPLATFORM_TEST_EXPECT(
+      EptEntryGetMaxLeafLevel(EptEntryTestpCapability(false, false)) == 1);
+  HYPERPLATFORM_TEST_EXPECT(
+      EptEntryGetMaxLeafLevel(EptEntryTestpCapability(false, true)) == 1);
+  HYPERPLATFORM_TEST_EXPECT(
+      EptEntryGetMaxLeafLevel(EptEntryTestpCapability(true, false)) == 2);
+  HYPERPLATFORM_TEST_EXPECT(
+      EptEntryGetMaxLeafLevel(EptEntryTestpCapability(true, true)) == 3);
+
+  HYPERPLATFORM_TEST_EXPECT(EptEntryGetPageSize(1) == 0x1000);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryGetPageSize(2) == 0x200000);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryGetPageSize(3) == 0x40000000);
+}
+
+// A memory type boundary inside a 1 GB region and a 2 MB region in it limits
+// pages there to smaller ones with each capability
+static void EptEntryTestLeafLevelAtMemoryTypeBoundaries() {
+  // [1 GB, 1 GB + 1 MB) is WB, [1 GB + 1 MB, 1 GB + 2 MB) is UC, and the rest
+  // is WB
+  const MemoryTypeRange ranges[] = {
+      {0x0, memory_type::kWriteBack},
+      {0x40100000, memory_type::kUncacheable},
+      {0x40200000, memory_type::kWriteBack},
+  };
+  const auto count = static_cast<ULONG>(RTL_NUMBER_OF(ranges));
+  const auto end = 0x100000000ull;
+  const auto no_large_pages = EptEntryTestpCapability(false, false);
+  const auto only_2mb_pages = EptEntryTestpCapability(true, false);
+  const auto with_1gb_pages = EptEntryTestpCapability(true, true);
+
+  const ULONG64 addresses[] = {0x0,        0x200000,   0x3fe00000, 0x40000000,
+                               0x40100000, 0x40200000, 0x7fe00000, 0x80000000};
+  for (const auto address : addresses) {
+    HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(
+                                  no_large_pages, ranges, count, address,
+                                  end) == 1);
+  }
+
+  HYPERPLATFORM_TEST_EXPECT(
+      EptEntryTestpGetLeafLevel(only_2mb_pages, ranges, count, 0x0, end) == 2);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(
+                                only_2mb_pages, ranges, count, 0x3fe00000,
+                                end) == 2);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(
+                                only_2mb_pages, ranges, count, 0x40000000,
+                                end) == 1);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(
+                                only_2mb_pages, ranges, count, 0x40100000,
+                                end) == 1);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(
+                                only_2mb_pages, ranges, count, 0x40200000,
+                                end) == 2);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(
+                                only_2mb_pages, ranges, count, 0x80000000,
+                                end) == 2);
+
+  // The 1 GB regions before and after the one with the boundaries are mapped
+  // with 1 GB pages, and the 2 MB regions without a boundary in it with 2 MB
+  HYPERPLATFORM_TEST_EXPECT(
+      EptEntryTestpGetLeafLevel(with_1gb_pages, ranges, count, 0x0, end) == 3);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(
+                                with_1gb_pages, ranges, count, 0x40000000,
+                                end) == 1);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(
+                                with_1gb_pages, ranges, count, 0x40100000,
+                                end) == 1);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(
+                                with_1gb_pages, ranges, count, 0x40200000,
+                                end) == 2);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(
+                                with_1gb_pages, ranges, count, 0x7fe00000,
+                                end) == 2);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(
+                                with_1gb_pages, ranges, count, 0x80000000,
+                                end) == 3);
+}
+
+// Large pages are used only when they are aligned and end within the run of
+// physical memory
+static void EptEntryTestLeafLevelWithinRun() {
+  const MemoryTypeRange ranges[] = {{0x0, memory_type::kWriteBack}};
+  const auto capability = EptEntryTestpCapability(true, true);
+
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(capability, ranges, 1,
+                                                      0x0, 0x40000000) == 3);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(capability, ranges, 1,
+                                                      0x0, 0x3ffff000) == 2);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(
+                                capability, ranges, 1, 0x3fe00000,
+                                0x3ffff000) == 1);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(capability, ranges, 1,
+                                                      0x1000, 0x80000000) == 1);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(
+                                capability, ranges, 1, 0x40200000,
+                                0x80000000) == 2);
+}
+
+// Memory type ranges compiled from MTRRs limit pages in the same way. An UC
+// MTRR for the local APIC splits the last 1 GB below 4 GB, and a 2 MB region
+// in it.
+static void EptEntryTestLeafLevelWithMtrrs() {
+  MtrrData entries[2] = {};
+  entries[0].enabled = true;
+  entries[0].type = static_cast<UCHAR>(memory_type::kUncacheable);
+  entries[0].range_base = 0xfee00000;
+  entries[0].range_end = 0xfeefffff;
+  MemoryTypeRange ranges[kMtrrMemoryTypeRangesSize] = {};
+  const auto count = MtrrBuildMemoryTypeRanges(
+      entries, RTL_NUMBER_OF(entries),
+      static_cast<UCHAR>(memory_type::kWriteBack), ranges);
+  const auto capability = EptEntryTestpCapability(true, true);
+  const auto end = 0x200000000ull;
+
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(capability, ranges,
+                                                      count, 0x80000000,
+                                                      end) == 3);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(capability, ranges,
+                                                      count, 0xc0000000,
+                                                      end) == 2);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(capability, ranges,
+                                                      count, 0xfec00000,
+                                                      end) == 2);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(capability, ranges,
+                                                      count, 0xfee00000,
+                                                      end) == 1);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(capability, ranges,
+                                                      count, 0xfef00000,
+                                                      end) == 1);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(capability, ranges,
+                                                      count, 0xff000000,
+                                                      end) == 2);
+  HYPERPLATFORM_TEST_EXPECT(EptEntryTestpGetLeafLevel(capability, ranges,
+                                                      count, 0x100000000,
+                                                      end) == 3);
+}
+
+int main() {
+  EptEntryTestSplit2MbPage();
+  EptEntryTestSplit1GbPage();
+  EptEntryTestMergeSplitTable();
+  EptEntryTestMergeRefusesMemoryTypeMismatch();
+  EptEntryTestMergeRefusesPermissionMismatch();
+  EptEntryTestMergeRefusesSoftwareBitsMismatch();
+  EptEntryTestSoftwareBitsAreIgnoredBits();
+  EptEntryTestMergeRefusesNonContiguousMemory();
+  EptEntryTestMergeRefusesNonLargePages();
+  EptEntryTestMaxLeafLevel();
+  EptEntryTestLeafLevelAtMemoryTypeBoundaries();
+  EptEntryTestLeafLevelWithinRun();
+  EptEntryTestLeafLevelWithMtrrs();
+  return TestGetExitCode();
+}
@@ -0,0 +1,169 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Measures looking up fake pages with FakePageIndex against a linear scan of
+/// them, which is what the fake page table did before the index.
+
+#include "../../FU_Hypervisor/fake_page_index.h"
+#include <stdio.h>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A seed of random fake pages. It is fixed so that runs are comparable.
+static const ULONG64 kFakePageBenchSeed = 0x2018;
+
+// Numbers of fake pages to measure with
+static const SIZE_T kFakePageBenchHookCounts[] = {10, 1000, 100000};
+
+// A number of lookups measured with the index
+static const SIZE_T kFakePageBenchIndexLookups = 4000000;
+
+// A number of entries a linear scan visits in total. Lookups with a linear
+// scan are reduced as fake pages increase so that it finishes in time.
+static const SIZE_T kFakePageBenchScanBudget = 400000000;
+
+// A number of target processes fake pages are spread across
+static const ULONG kFakePageBenchProcesses = 16;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Has only members FakePageIndex looks at, in place of FakePageData
+struct FakePageBenchPage {
+  void *page_base;
+  ULONG_PTR target_cr3;
+  ULONG64 pa_base_for_rw;
+};
+
+// Keys of a lookup, for both the faulting PA and the patched VA
+struct FakePageBenchLookup {
+  PFN_NUMBER pfn;
+  FakePageVaKey va_key;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns a next pseudo-random number with xorshift64*
+static ULONG64 FakePageBenchpRandom(ULONG64 *state) {
+  auto x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545f4914f6cdd1dull;
+}
+
+// Returns elapsed nanoseconds per lookup
+template <typename Lookup>
+static double FakePageBenchpMeasure(
+    const std::vector<FakePageBenchLookup> &lookups, SIZE_T count,
+    Lookup lookup, SIZE_T *found) {
+  *found = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (SIZE_T i = 0; i < count; ++i) {
+    if (lookup(lookups[i % lookups.size()])) {
+      (*found)++;
+    }
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / count;
+}
+
+// Measures lookups among hook_count fake pages. Half of the lookups are for
+// pages that are not fake pages, as most EPT violations would be when
+// monitoring is enabled for the range.
+static void FakePageBenchRun(SIZE_T hook_count) {
+  ULONG64 state = kFakePageBenchSeed;
+
+  // Owned as FakePageTable owns FakePageData
+  std::vector<std::shared_ptr<FakePageBenchPage>> pages;
+  FakePageIndex<FakePagePfnKeyTraits<FakePageBenchPage>> pfn_index(
+      hook_count);
+  FakePageIndex<FakePageVaKeyTraits<FakePageBenchPage>> va_index(hook_count);
+  ULONG64 pfn = 0x10000;
+  for (SIZE_T i = 0; i < hook_count; ++i) {
+    pfn += 1 + FakePageBenchpRandom(&state) % 4;
+    const auto page = std::make_shared<FakePageBenchPage>();
+    page->target_cr3 =
+        (1 + FakePageBenchpRandom(&state) % kFakePageBenchProcesses)
+        << PAGE_SHIFT;
+    page->page_base = reinterpret_cast<void *>(
+        0x7ff000000000ull + (FakePageBenchpRandom(&state) % 0x100000000ull
+                             << PAGE_SHIFT));
+    page->pa_base_for_rw = pfn << PAGE_SHIFT;
+    pages.push_back(page);
+    pfn_index.Insert(page.get());
+    va_index.Insert(page.get());
+  }
+
+  std::vector<FakePageBenchLookup> lookups(4096);
+  for (auto &lookup : lookups) {
+    const auto &page = *pages[FakePageBenchpRandom(&state) % pages.size()];
+    lookup.pfn = page.pa_base_for_rw >> PAGE_SHIFT;
+    lookup.va_key = {page.target_cr3, page.page_base};
+    if (FakePageBenchpRandom(&state) % 2) {
+      lookup.pfn = pfn + 1 + FakePageBenchpRandom(&state) % 0x100000;
+      lookup.va_key.cr3 += kFakePageBenchProcesses << PAGE_SHIFT;
+    }
+  }
+
+  SIZE_T found = 0;
+  const auto pfn_ns = FakePageBenchpMeasure(
+      lookups, kFakePageBenchIndexLookups,
+      [&](const FakePageBenchLookup &lookup) {
+        return pfn_index.Find(lookup.pfn) != nullptr;
+      },
+      &found);
+  const auto pfn_found = found;
+  const auto va_ns = FakePageBenchpMeasure(
+      lookups, kFakePageBenchIndexLookups,
+      [&](const FakePageBenchLookup &lookup) {
+        return va_index.Find(lookup.va_key) != nullptr;
+      },
+      &found);
+  const auto va_found = found;
+
+  auto scan_lookups = kFakePageBenchScanBudget / hook_count;
+  if (scan_lookups > kFakePageBenchIndexLookups) {
+    scan_lookups = kFakePageBenchIndexLookups;
+  }
+  const auto scan_ns = FakePageBenchpMeasure(
+      lookups, scan_lookups,
+      [&](const FakePageBenchLookup &lookup) {
+        for (const auto &page : pages) {
+          if (page->pa_base_for_rw >> PAGE_SHIFT == lookup.pfn) {
+            return true;
+          }
+        }
+        return false;
+      },
+      &found);
+
+  printf("%6zu hooks: PFN index %6.1f, VA index %6.1f, scan %10.1f"
+         " (hit %.0f%%, %.0f%%, %.0f%%)\n",
+         hook_count, pfn_ns, va_ns, scan_ns,
+         100.0 * pfn_found / kFakePageBenchIndexLookups,
+         100.0 * va_found / kFakePageBenchIndexLookups,
+         100.0 * found / scan_lookups);
+}
+
+int main() {
+  printf("Nanoseconds per lookup of a fake page\n");
+  for (const auto hook_count : kFakePageBenchHookCounts) {
+    FakePageBenchRun(hook_count);
+  }
+  return 0;
+}
@@ -0,0 +1,359 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Measures installing fake pages with one batched hypercall against one
+/// hypercall per descriptor in a simulation of FppInstallFakePages().
+///
+/// Both validate descriptors, copy original pages into shadow pages, apply
+/// patches and publish them into a fake page table indexed with
+/// FakePageIndex, as the VMM does. VM-exits and INVEPT cannot be simulated in
+/// user mode and are counted instead of measured.
+
+#include "../../FU_Hypervisor/fake_page_index.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A seed of random descriptors. It is fixed so that runs are comparable.
+static const ULONG64 kFakePageInstallBenchSeed = 0x2018;
+
+// A number of descriptors installed in each run
+static const SIZE_T kFakePageInstallBenchDescriptors = 5000;
+
+// A number of guest pages descriptors patch. Fewer than descriptors so that
+// some pages have more than one patch.
+static const SIZE_T kFakePageInstallBenchGuestPages = 4096;
+
+// A number of runs of each mode. The fastest one is reported.
+static const int kFakePageInstallBenchRuns = 5;
+
+// The same as kFppInitialTableCapacity
+static const SIZE_T kFakePageInstallBenchInitialCapacity = 64;
+
+static const SIZE_T kFakePageInstallBenchPageSize = 1 << PAGE_SHIFT;
+
+// A base of guest VAs that descriptors patch, and CR3 of the guest
+static const ULONG64 kFakePageInstallBenchVaBase = 0x7ff700000000ull;
+static const ULONG_PTR kFakePageInstallBenchCr3 = 0x1aa000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// The same as APIMON_CREATE_SHADOW_PARAMETERS
+struct FakePageInstallBenchDescriptor {
+  ULONG64 start_address;
+  ULONG64 original_byte_size;
+  UCHAR original_bytes[32];
+};
+
+// A patched range in a page, as PatchRange
+struct FakePageInstallBenchRange {
+  USHORT offset;
+  USHORT size;
+};
+
+// Has the members of FakePageData the install path builds
+struct FakePageInstallBenchPage {
+  void *page_base;
+  ULONG_PTR target_cr3;
+  std::shared_ptr<std::vector<UCHAR>> shadow_page;
+  ULONG64 pa_base_for_rw;
+  std::vector<FakePageInstallBenchRange> ranges;
+  std::vector<UCHAR> original_bytes;
+};
+
+// A version of the fake page table, as FakePageTable without groups
+struct FakePageInstallBenchTable {
+  explicit FakePageInstallBenchTable(SIZE_T capacity)
+      : capacity(capacity), pfn_index(capacity), va_index(capacity) {
+    entries.reserve(capacity);
+  }
+
+  void Append(std::shared_ptr<FakePageInstallBenchPage> fp_data) {
+    entries.push_back(std::move(fp_data));
+    pfn_index.Insert(entries.back().get());
+    va_index.Insert(entries.back().get());
+  }
+
+  const SIZE_T capacity;
+  std::vector<std::shared_ptr<FakePageInstallBenchPage>> entries;
+  FakePageIndex<FakePagePfnKeyTraits<FakePageInstallBenchPage>> pfn_index;
+  FakePageIndex<FakePageVaKeyTraits<FakePageInstallBenchPage>> va_index;
+};
+
+// Memory of the simulated guest and the state of the simulated VMM
+struct FakePageInstallBenchState {
+  std::vector<UCHAR> guest_memory;  // kFakePageInstallBenchGuestPages pages
+  std::vector<ULONG64> pfns;        // PFNs of guest pages in VA order
+  std::unique_ptr<FakePageInstallBenchTable> table;
+  std::vector<std::unique_ptr<FakePageInstallBenchTable>> retired_tables;
+  SIZE_T hypercalls;
+  SIZE_T invalidations;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns a next pseudo-random number with xorshift64*
+static ULONG64 FakePageInstallBenchpRandom(ULONG64 *state) {
+  auto x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545f4914f6cdd1dull;
+}
+
+// Returns an index of the guest page of the VA, or -1 if it is not mapped
+static SIZE_T FakePageInstallBenchpPageIndex(ULONG64 va) {
+  const auto index = (va - kFakePageInstallBenchVaBase) >> PAGE_SHIFT;
+  return (va >= kFakePageInstallBenchVaBase &&
+          index < kFakePageInstallBenchGuestPages)
+             ? static_cast<SIZE_T>(index)
+             : static_cast<SIZE_T>(-1);
+}
+
+// Checks the descriptor as FppIsValidCreateShadowParameters() does
+static bool FakePageInstallBenchpIsValid(
+    const FakePageInstallBenchDescriptor &descriptor) {
+  if (descriptor.original_byte_size > sizeof(descriptor.original_bytes)) {
+    return false;
+  }
+  const auto last_byte =
+      descriptor.start_address +
+      (descriptor.original_byte_size ? descriptor.original_byte_size - 1 : 0);
+  return FakePageInstallBenchpPageIndex(descriptor.start_address) !=
+             static_cast<SIZE_T>(-1) &&
+         FakePageInstallBenchpPageIndex(last_byte) != static_cast<SIZE_T>(-1);
+}
+
+// Publishes table and retires the current one
+static void FakePageInstallBenchpReplaceTable(
+    FakePageInstallBenchState *state,
+    std::unique_ptr<FakePageInstallBenchTable> table) {
+  state->retired_tables.push_back(std::move(state->table));
+  state->table = std::move(table);
+}
+
+// Installs descriptors with one hypercall in the way FppInstallFakePages()
+// and FpVmCallCreateAndEnableFakePages() do
+static bool FakePageInstallBenchpInstall(
+    FakePageInstallBenchState *state,
+    const FakePageInstallBenchDescriptor *descriptors, SIZE_T count) {
+  state->hypercalls++;
+  for (SIZE_T i = 0; i < count; ++i) {
+    if (!FakePageInstallBenchpIsValid(descriptors[i])) {
+      return false;
+    }
+  }
+
+  // Split patches crossing a page boundary, and visit them page by page
+  std::vector<FakePageInstallBenchDescriptor> patches;
+  patches.reserve(count);
+  for (SIZE_T i = 0; i < count; ++i) {
+    auto patch = descriptors[i];
+    const auto room =
+        kFakePageInstallBenchPageSize -
+        (patch.start_address & (kFakePageInstallBenchPageSize - 1));
+    if (patch.original_byte_size > room) {
+      auto next = patch;
+      next.start_address += room;
+      next.original_byte_size -= room;
+      memmove(next.original_bytes, patch.original_bytes + room,
+              static_cast<SIZE_T>(next.original_byte_size));
+      patch.original_byte_size = room;
+      patches.push_back(patch);
+      patches.push_back(next);
+    } else {
+      patches.push_back(patch);
+    }
+  }
+  std::vector<ULONG> order(patches.size());
+  for (ULONG i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&patches](ULONG lhs, ULONG rhs) {
+    const auto lhs_page = patches[lhs].start_address >> PAGE_SHIFT;
+    const auto rhs_page = patches[rhs].start_address >> PAGE_SHIFT;
+    return lhs_page < rhs_page || (lhs_page == rhs_page && lhs < rhs);
+  });
+
+  // Create or copy a page for each patched page, and apply patches
+  std::vector<std::pair<std::shared_ptr<FakePageInstallBenchPage>,
+                        const FakePageInstallBenchPage *>>
+      pending;
+  for (const auto index : order) {
+    const auto &patch = patches[index];
+    const auto page_index =
+        FakePageInstallBenchpPageIndex(patch.start_address);
+    const auto page_base = reinterpret_cast<void *>(
+        patch.start_address & ~(kFakePageInstallBenchPageSize - 1));
+    if (pending.empty() || pending.back().first->page_base != page_base) {
+      const auto published = state->table->va_index.Find(
+          {kFakePageInstallBenchCr3 & kFakePageCr3PageMask, page_base});
+      std::shared_ptr<FakePageInstallBenchPage> fp_data;
+      if (published) {
+        fp_data = std::make_shared<FakePageInstallBenchPage>(*published);
+      } else {
+        fp_data = std::make_shared<FakePageInstallBenchPage>();
+        fp_data->page_base = page_base;
+        fp_data->target_cr3 = kFakePageInstallBenchCr3;
+        fp_data->pa_base_for_rw = state->pfns[page_index] << PAGE_SHIFT;
+        fp_data->shadow_page = std::make_shared<std::vector<UCHAR>>(
+            state->guest_memory.begin() +
+                page_index * kFakePageInstallBenchPageSize,
+            state->guest_memory.begin() +
+                (page_index + 1) * kFakePageInstallBenchPageSize);
+      }
+      pending.emplace_back(std::move(fp_data), published);
+    }
+    const auto &fp_data = pending.back().first;
+    const auto offset = static_cast<USHORT>(
+        patch.start_address & (kFakePageInstallBenchPageSize - 1));
+    const auto size = static_cast<USHORT>(patch.original_byte_size);
+    fp_data->ranges.push_back({offset, size});
+    fp_data->original_bytes.insert(fp_data->original_bytes.end(),
+                                   patch.original_bytes,
+                                   patch.original_bytes + size);
+    memcpy(fp_data->shadow_page->data() + offset,
+           state->guest_memory.data() +
+               page_index * kFakePageInstallBenchPageSize + offset,
+           size);
+  }
+
+  // Publish copies in place of published pages with a single new version
+  if (std::any_of(pending.cbegin(), pending.cend(),
+                  [](const decltype(pending)::value_type &p) {
+                    return !!p.second;
+                  })) {
+    const auto &table = *state->table;
+    std::unique_ptr<FakePageInstallBenchTable> new_table(
+        new FakePageInstallBenchTable(table.capacity));
+    for (const auto &fp_data : table.entries) {
+      const auto it = std::lower_bound(
+          pending.cbegin(), pending.cend(), fp_data->page_base,
+          [](const decltype(pending)::value_type &p, void *page_base) {
+            return p.first->page_base < page_base;
+          });
+      new_table->Append((it != pending.cend() && it->second == fp_data.get())
+                            ? it->first
+                            : fp_data);
+    }
+    FakePageInstallBenchpReplaceTable(state, std::move(new_table));
+  }
+
+  // Then, append new ones, publishing a larger version when full
+  for (const auto &p : pending) {
+    if (p.second) {
+      continue;
+    }
+    if (state->table->entries.size() == state->table->capacity) {
+      const auto &table = *state->table;
+      std::unique_ptr<FakePageInstallBenchTable> new_table(
+          new FakePageInstallBenchTable(table.capacity * 2));
+      for (const auto &fp_data : table.entries) {
+        new_table->Append(fp_data);
+      }
+      FakePageInstallBenchpReplaceTable(state, std::move(new_table));
+    }
+    state->table->Append(p.first);
+  }
+
+  // Enabling pages is followed by a single INVEPT
+  state->invalidations++;
+  return true;
+}
+
+// Returns a fresh state of the simulated guest and VMM
+static std::unique_ptr<FakePageInstallBenchState> FakePageInstallBenchpInit() {
+  std::unique_ptr<FakePageInstallBenchState> state(
+      new FakePageInstallBenchState());
+  state->guest_memory.resize(kFakePageInstallBenchGuestPages *
+                             kFakePageInstallBenchPageSize);
+  for (SIZE_T i = 0; i < state->guest_memory.size(); ++i) {
+    state->guest_memory[i] = static_cast<UCHAR>(i * 0x9d);
+  }
+  for (SIZE_T i = 0; i < kFakePageInstallBenchGuestPages; ++i) {
+    state->pfns.push_back(0x100000 + i * 7);
+  }
+  state->table.reset(
+      new FakePageInstallBenchTable(kFakePageInstallBenchInitialCapacity));
+  state->hypercalls = 0;
+  state->invalidations = 0;
+  return state;
+}
+
+// Measures installing all descriptors batch_size at a time, and reports the
+// fastest run
+static void FakePageInstallBenchRun(
+    const char *name,
+    const std::vector<FakePageInstallBenchDescriptor> &descriptors,
+    SIZE_T batch_size) {
+  double best_ms = 0;
+  std::unique_ptr<FakePageInstallBenchState> state;
+  for (auto run = 0; run < kFakePageInstallBenchRuns; ++run) {
+    state = FakePageInstallBenchpInit();
+    const auto start = std::chrono::steady_clock::now();
+    for (SIZE_T i = 0; i < descriptors.size(); i += batch_size) {
+      const auto count = std::min(batch_size, descriptors.size() - i);
+      if (!FakePageInstallBenchpInstall(state.get(), &descriptors[i],
+                                        count)) {
+        printf("%s: failed to install descriptors\n", name);
+        return;
+      }
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const auto ms =
+        std::chrono::duration<double, std::milli>(elapsed).count();
+    if (!run || ms < best_ms) {
+      best_ms = ms;
+    }
+  }
+
+  printf("%-14s %8.2f ms, %6.0f descriptors/ms, %5zu hypercalls, %5zu INVEPT,"
+         " %5zu table versions, %5zu pages\n",
+         name, best_ms, descriptors.size() / best_ms, state->hypercalls,
+         state->invalidations, state->retired_tables.size() + 1,
+         state->table->entries.size());
+}
+
+int main() {
+  // Patches of up to 32 bytes. Some cross a page boundary, and some share a
+  // page with others.
+  ULONG64 random_state = kFakePageInstallBenchSeed;
+  std::vector<FakePageInstallBenchDescriptor> descriptors(
+      kFakePageInstallBenchDescriptors);
+  for (auto &descriptor : descriptors) {
+    const auto page =
+        FakePageInstallBenchpRandom(&random_state) %
+        (kFakePageInstallBenchGuestPages - 1);
+    const auto offset = FakePageInstallBenchpRandom(&random_state) %
+                        kFakePageInstallBenchPageSize;
+    descriptor.start_address = kFakePageInstallBenchVaBase +
+                               (page << PAGE_SHIFT) + offset;
+    descriptor.original_byte_size =
+        1 + FakePageInstallBenchpRandom(&random_state) %
+                sizeof(descriptor.original_bytes);
+    memset(descriptor.original_bytes, 0xcc, sizeof(descriptor.original_bytes));
+  }
+
+  printf("Installing %zu descriptors into %zu guest pages\n",
+         descriptors.size(), kFakePageInstallBenchGuestPages);
+  FakePageInstallBenchRun("one by one", descriptors, 1);
+  FakePageInstallBenchRun("batched", descriptors, descriptors.size());
+  return 0;
+}
@@ -0,0 +1,84 @@
+// Copyright (c) 2015-2017, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Stands in for the WDK header so that sources without kernel dependencies
+/// can be built into user-mode tests.
+
+#ifndef HYPERPLATFORM_TESTS_FLTKERNEL_H_
+#define HYPERPLATFORM_TESTS_FLTKERNEL_H_
+
+#if defined(_MSC_VER)
+#include <windows.h>
+typedef ULONG_PTR PFN_NUMBER;
+typedef ULONG PFN_COUNT;
+typedef LONG NTSTATUS;
+#else
+#include <stddef.h>
+#include <stdint.h>
+
+#if !defined(__x86_64__)
+#error "Tests are only supported on x64."
+#endif
+#define _AMD64_
+
+#define __int8 char
+#define __int16 short
+#define __int32 int
+#define __int64 long long
+
+typedef int32_t LONG;
+typedef uint8_t UCHAR;
+typedef uint16_t USHORT;
+typedef uint32_t ULONG;
+typedef uint32_t ULONG32;
+typedef uint64_t ULONG64;
+typedef uintptr_t ULONG_PTR;
+typedef size_t SIZE_T;
+typedef ULONG_PTR PFN_NUMBER;
+typedef ULONG PFN_COUNT;
+typedef long NTSTATUS;
+
+#define RTL_NUMBER_OF(array) (sizeof(array) / sizeof((array)[0]))
+
+#define _In_
+#define _In_opt_
+#define _Inout_
+#define _Out_
+#define _In_reads_(size)
+#define _Out_writes_(size)
+#define _In_reads_bytes_(size)
+#define _Out_writes_bytes_(size)
+#define _Out_writes_opt_(size)
+#define _Must_inspect_result_
+#define _Use_decl_annotations_
+
+inline void *InterlockedExchangePointer(void *volatile *target, void *value) {
+  return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+#endif
+
+typedef struct _DRIVER_OBJECT *PDRIVER_OBJECT;
+typedef struct _KDPC *PKDPC;
+typedef void KDEFERRED_ROUTINE(PKDPC dpc, void *context, void *argument1,
+                               void *argument2);
+typedef KDEFERRED_ROUTINE *PKDEFERRED_ROUTINE;
+
+#if !defined(MAXUCHAR)
+#define MAXUCHAR 0xff
+#endif
+#if !defined(MAXULONG64)
+#define MAXULONG64 (~static_cast<ULONG64>(0))
+#endif
+#if !defined(PAGE_SHIFT)
+#define PAGE_SHIFT 12L
+#endif
+#if !defined(_IRQL_requires_max_)
+#define _IRQL_requires_max_(irql)
+#endif
+#if !defined(_IRQL_requires_min_)
+#define _IRQL_requires_min_(irql)
+#endif
+
+#endif  // HYPERPLATFORM_TESTS_FLTKERNEL_H_
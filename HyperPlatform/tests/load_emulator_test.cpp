@@ -0,0 +1,596 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Tests decoding and emulation of loads against a fake VMCS and guest memory.
+
+#include "../../FU_Hypervisor/load_emulator.h"
+#include "../../FU_Hypervisor/guest_memory.h"
+#include "../HyperPlatform/util.h"
+#include "test.h"
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A guest linear address where the fake guest memory is mapped
+static const ULONG_PTR kLeTestpMemoryBase = 0x7ffe0000;
+
+// A size of the fake guest memory
+static const SIZE_T kLeTestpMemorySize = 0x1000;
+
+// Guest state that LeTestpReset() sets
+static const ULONG_PTR kLeTestpCr3 = 0x1aa000;
+static const ULONG_PTR kLeTestpRip = kLeTestpMemoryBase - 0x2000;
+static const ULONG_PTR kLeTestpRflags = 0x602;  // IF, DF and the fixed bit
+
+// CF, PF, AF, ZF, SF and OF
+static const ULONG_PTR kLeTestpStatusFlags = 0x8d5;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Fields of the VMCS that the load emulator accesses
+struct LeTestVmcs {
+  ULONG_PTR cs_ar_bytes;
+  ULONG_PTR rflags;
+  ULONG_PTR interruptibility_info;
+  ULONG_PTR fs_base;
+  ULONG_PTR gs_base;
+  ULONG_PTR rip;
+  ULONG_PTR rsp;
+  ULONG_PTR cr3;
+};
+
+// Operands of CMP and flags that a processor computes for them
+struct LeTestCompareCase {
+  ULONG size;
+  ULONG64 lhs;
+  ULONG64 rhs;
+  ULONG_PTR flags;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static LeTestVmcs g_le_test_vmcs;
+static UCHAR g_le_test_memory[kLeTestpMemorySize];
+
+// Flags from CMP executed on a processor
+static const LeTestCompareCase kLeTestpCompareCases[] = {
+    {1, 0x0, 0x1, 0x095},
+    {1, 0x80, 0x1, 0x810},
+    {1, 0x7f, 0xff, 0x881},
+    {1, 0x10, 0x10, 0x044},
+    {1, 0x1, 0x80, 0x885},
+    {1, 0x20, 0x11, 0x014},
+    {2, 0x8000, 0x1, 0x814},
+    {2, 0x1234, 0x1234, 0x044},
+    {2, 0x0, 0x10, 0x085},
+    {2, 0x7fff, 0x8000, 0x885},
+    {4, 0x80000000, 0x1, 0x814},
+    {4, 0x0, 0x1, 0x095},
+    {4, 0x7fffffff, 0xffffffff, 0x885},
+    {4, 0x5, 0x3, 0x000},
+    {8, 0x8000000000000000, 0x1, 0x814},
+    {8, 0x0, 0x8000000000000000, 0x885},
+    {8, 0x10, 0x1, 0x014},
+    {8, 0xffffffffffffffff, 0xffffffffffffffff, 0x044},
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Reads the fake VMCS
+_Use_decl_annotations_ ULONG_PTR UtilVmRead(VmcsField field) {
+  // clang-format off
+  switch (field) {
+    case VmcsField::kGuestCsArBytes: return g_le_test_vmcs.cs_ar_bytes;
+    case VmcsField::kGuestRflags: return g_le_test_vmcs.rflags;
+    case VmcsField::kGuestInterruptibilityInfo:
+      return g_le_test_vmcs.interruptibility_info;
+    case VmcsField::kGuestFsBase: return g_le_test_vmcs.fs_base;
+    case VmcsField::kGuestGsBase: return g_le_test_vmcs.gs_base;
+    case VmcsField::kGuestRip: return g_le_test_vmcs.rip;
+    case VmcsField::kGuestRsp: return g_le_test_vmcs.rsp;
+    case VmcsField::kGuestCr3: return g_le_test_vmcs.cr3;
+    default: break;
+  }
+  // clang-format on
+  HYPERPLATFORM_TEST_EXPECT(!"An unexpected field is read");
+  return 0;
+}
+
+// Writes the fake VMCS
+_Use_decl_annotations_ VmxStatus UtilVmWrite(VmcsField field,
+                                             ULONG_PTR field_value) {
+  // clang-format off
+  switch (field) {
+    case VmcsField::kGuestRflags: g_le_test_vmcs.rflags = field_value; break;
+    case VmcsField::kGuestRip: g_le_test_vmcs.rip = field_value; break;
+    case VmcsField::kGuestRsp: g_le_test_vmcs.rsp = field_value; break;
+    default:
+      HYPERPLATFORM_TEST_EXPECT(!"An unexpected field is written");
+      return VmxStatus::kErrorWithoutStatus;
+  }
+  // clang-format on
+  return VmxStatus::kOk;
+}
+
+// Copies the fake guest memory up to its end like a page walk that stops at a
+// non-present page
+_Use_decl_annotations_ SIZE_T GmReadGuestMemory(ULONG_PTR cr3, const void *va,
+                                                void *buffer, SIZE_T size) {
+  HYPERPLATFORM_TEST_EXPECT(cr3 == kLeTestpCr3);
+  const auto address = reinterpret_cast<ULONG_PTR>(va);
+  if (address < kLeTestpMemoryBase ||
+      address - kLeTestpMemoryBase >= kLeTestpMemorySize) {
+    return 0;
+  }
+  const auto offset = address - kLeTestpMemoryBase;
+  const auto copied =
+      (size < kLeTestpMemorySize - offset) ? size : kLeTestpMemorySize - offset;
+  memcpy(buffer, &g_le_test_memory[offset], copied);
+  return copied;
+}
+
+// Sets up 64-bit mode guest state and clears the fake guest memory
+static void LeTestpReset() {
+  VmxRegmentDescriptorAccessRight cs_ar = {};
+  cs_ar.fields.type = 0xb;
+  cs_ar.fields.system = true;
+  cs_ar.fields.present = true;
+  cs_ar.fields.l = true;
+  g_le_test_vmcs = {};
+  g_le_test_vmcs.cs_ar_bytes = cs_ar.all;
+  g_le_test_vmcs.rflags = kLeTestpRflags;
+  g_le_test_vmcs.rip = kLeTestpRip;
+  g_le_test_vmcs.cr3 = kLeTestpCr3;
+  memset(g_le_test_memory, 0, sizeof(g_le_test_memory));
+}
+
+// Writes a little endian value of size bytes to the fake guest memory
+static void LeTestpSetMemory(ULONG_PTR offset, ULONG64 value, ULONG size) {
+  for (auto i = 0ul; i < size; ++i) {
+    g_le_test_memory[offset + i] = static_cast<UCHAR>(value >> (i * 8));
+  }
+}
+
+// Emulates the instruction and checks if the guest RIP is moved past it
+template <SIZE_T N>
+static bool LeTestpEmulate(GpRegisters *gp_regs, const UCHAR (&instruction)[N],
+                           ULONG_PTR fault_va) {
+  const auto rip = g_le_test_vmcs.rip;
+  return LeEmulateLoad(gp_regs, instruction, N, fault_va) &&
+         g_le_test_vmcs.rip == rip + N;
+}
+
+// Executes MOV EAX, [memory operand] with a value at the offset and returns
+// the loaded value
+template <SIZE_T N>
+static ULONG_PTR LeTestpLoadEax(GpRegisters *gp_regs,
+                                const UCHAR (&instruction)[N],
+                                ULONG_PTR offset, ULONG value) {
+  gp_regs->ax = MAXULONG64;
+  LeTestpSetMemory(offset, value, 4);
+  if (!LeTestpEmulate(gp_regs, instruction, kLeTestpMemoryBase + offset)) {
+    return MAXULONG64;
+  }
+  return gp_regs->ax;
+}
+
+// Returns RFLAGS expected after CMP that resulted in the status flags
+static ULONG_PTR LeTestpExpectedRflags(ULONG_PTR status_flags) {
+  return (kLeTestpRflags & ~kLeTestpStatusFlags) | status_flags;
+}
+
+// A memory operand is addressed with ModRM, SIB and displacements
+static void LeTestModRmAndSibAddressing() {
+  LeTestpReset();
+  GpRegisters gp_regs = {};
+
+  // mov eax, [rbx]
+  const UCHAR mov_rbx[] = {0x8b, 0x03};
+  gp_regs.bx = kLeTestpMemoryBase + 0x10;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpLoadEax(&gp_regs, mov_rbx, 0x10, 0x11111111) == 0x11111111);
+
+  // mov eax, [rbx - 8]
+  const UCHAR mov_rbx_disp8[] = {0x8b, 0x43, 0xf8};
+  gp_regs.bx = kLeTestpMemoryBase + 0x20;
+  HYPERPLATFORM_TEST_EXPECT(LeTestpLoadEax(&gp_regs, mov_rbx_disp8, 0x18,
+                                           0x22222222) == 0x22222222);
+
+  // mov eax, [rbx - 0x100]
+  const UCHAR mov_rbx_disp32[] = {0x8b, 0x83, 0x00, 0xff, 0xff, 0xff};
+  gp_regs.bx = kLeTestpMemoryBase + 0x140;
+  HYPERPLATFORM_TEST_EXPECT(LeTestpLoadEax(&gp_regs, mov_rbx_disp32, 0x40,
+                                           0x33333333) == 0x33333333);
+
+  // mov eax, [rbp + 8]; not RIP-relative with a displacement
+  const UCHAR mov_rbp_disp8[] = {0x8b, 0x45, 0x08};
+  gp_regs.bp = kLeTestpMemoryBase + 0x50;
+  HYPERPLATFORM_TEST_EXPECT(LeTestpLoadEax(&gp_regs, mov_rbp_disp8, 0x58,
+                                           0x44444444) == 0x44444444);
+
+  // mov eax, [rbx + rcx * 4]
+  const UCHAR mov_sib[] = {0x8b, 0x04, 0x8b};
+  gp_regs.bx = kLeTestpMemoryBase;
+  gp_regs.cx = 0x18;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpLoadEax(&gp_regs, mov_sib, 0x60, 0x55555555) == 0x55555555);
+
+  // mov eax, [rsp]; RSP is in the VMCS and is not an index
+  const UCHAR mov_rsp[] = {0x8b, 0x04, 0x24};
+  g_le_test_vmcs.rsp = kLeTestpMemoryBase + 0x70;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpLoadEax(&gp_regs, mov_rsp, 0x70, 0x66666666) == 0x66666666);
+
+  // mov eax, [rcx * 8 + kLeTestpMemoryBase]; no base register
+  const UCHAR mov_sib_disp32[] = {0x8b, 0x04, 0xcd, 0x00, 0x00, 0xfe, 0x7f};
+  gp_regs.bp = 0x1000000;
+  gp_regs.cx = 0x10;
+  HYPERPLATFORM_TEST_EXPECT(LeTestpLoadEax(&gp_regs, mov_sib_disp32, 0x80,
+                                           0x77777777) == 0x77777777);
+
+  // mov eax, [rbp + rcx * 8 + 8]
+  const UCHAR mov_sib_rbp_disp8[] = {0x8b, 0x44, 0xcd, 0x08};
+  gp_regs.bp = kLeTestpMemoryBase + 0x80;
+  gp_regs.cx = 0x2;
+  HYPERPLATFORM_TEST_EXPECT(LeTestpLoadEax(&gp_regs, mov_sib_rbp_disp8, 0x98,
+                                           0x88888888) == 0x88888888);
+
+  // mov eax, [rip + 0x20a0]; relative to the next instruction
+  const UCHAR mov_rip[] = {0x8b, 0x05, 0xa0, 0x20, 0x00, 0x00};
+  g_le_test_vmcs.rip = kLeTestpRip;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpLoadEax(&gp_regs, mov_rip, 0xa6, 0x99999999) == 0x99999999);
+}
+
+// REX.B, REX.X and REX.R select R8 to R15, and REX selects SPL to DIL over AH
+// to BH
+static void LeTestRexPrefixes() {
+  LeTestpReset();
+  GpRegisters gp_regs = {};
+  gp_regs.bx = kLeTestpMemoryBase;
+  gp_regs.cx = 0x400;
+  gp_regs.sp = kLeTestpMemoryBase + 0x400;
+
+  // mov eax, [r8]
+  const UCHAR mov_r8[] = {0x41, 0x8b, 0x00};
+  gp_regs.r8 = kLeTestpMemoryBase + 0xb0;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpLoadEax(&gp_regs, mov_r8, 0xb0, 0x11111111) == 0x11111111);
+
+  // mov eax, [rbx + r9]
+  const UCHAR mov_index_r9[] = {0x42, 0x8b, 0x04, 0x0b};
+  gp_regs.r9 = 0xb8;
+  HYPERPLATFORM_TEST_EXPECT(LeTestpLoadEax(&gp_regs, mov_index_r9, 0xb8,
+                                           0x22222222) == 0x22222222);
+
+  // mov eax, [rbx + r12]; R12 is an index unlike RSP
+  const UCHAR mov_index_r12[] = {0x42, 0x8b, 0x04, 0x23};
+  gp_regs.r12 = 0xc0;
+  HYPERPLATFORM_TEST_EXPECT(LeTestpLoadEax(&gp_regs, mov_index_r12, 0xc0,
+                                           0x33333333) == 0x33333333);
+
+  // mov eax, [r11 + r9]
+  const UCHAR mov_r11_r9[] = {0x43, 0x8b, 0x04, 0x0b};
+  gp_regs.r11 = kLeTestpMemoryBase + 0x10;
+  HYPERPLATFORM_TEST_EXPECT(LeTestpLoadEax(&gp_regs, mov_r11_r9, 0xc8,
+                                           0x44444444) == 0x44444444);
+
+  // mov r8d, [rbx]; clears the upper 32 bits
+  const UCHAR mov_r8d[] = {0x44, 0x8b, 0x03};
+  gp_regs.ax = 0;
+  gp_regs.r8 = MAXULONG64;
+  LeTestpSetMemory(0, 0x55555555, 4);
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, mov_r8d, kLeTestpMemoryBase));
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.r8 == 0x55555555);
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.ax == 0);
+
+  // mov r15, [rbx]
+  const UCHAR mov_r15[] = {0x4c, 0x8b, 0x3b};
+  LeTestpSetMemory(0, 0x0123456789abcdef, 8);
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, mov_r15, kLeTestpMemoryBase));
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.r15 == 0x0123456789abcdef);
+
+  // mov ah, [rbx]
+  const UCHAR mov_ah[] = {0x8a, 0x23};
+  LeTestpSetMemory(0, 0xab, 1);
+  gp_regs.ax = 0x1111111111111111;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, mov_ah, kLeTestpMemoryBase));
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.ax == 0x111111111111ab11);
+
+  // mov spl, [rbx]
+  const UCHAR mov_spl[] = {0x40, 0x8a, 0x23};
+  g_le_test_vmcs.rsp = 0x2222222222222222;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, mov_spl, kLeTestpMemoryBase));
+  HYPERPLATFORM_TEST_EXPECT(g_le_test_vmcs.rsp == 0x22222222222222ab);
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.ax == 0x111111111111ab11);
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.sp == kLeTestpMemoryBase + 0x400);
+
+  // mov ch, [rsi]
+  const UCHAR mov_ch[] = {0x8a, 0x2e};
+  gp_regs.si = kLeTestpMemoryBase;
+  gp_regs.cx = 0x3333333333333333;
+  gp_regs.bp = 0x4444444444444444;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, mov_ch, kLeTestpMemoryBase));
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.cx == 0x333333333333ab33);
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.bp == 0x4444444444444444);
+
+  // mov bpl, [rsi]
+  const UCHAR mov_bpl[] = {0x40, 0x8a, 0x2e};
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, mov_bpl, kLeTestpMemoryBase));
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.bp == 0x44444444444444ab);
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.cx == 0x333333333333ab33);
+
+  // mov dil, [rbx]
+  const UCHAR mov_dil[] = {0x40, 0x8a, 0x3b};
+  gp_regs.di = 0x5555555555555555;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, mov_dil, kLeTestpMemoryBase));
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.di == 0x55555555555555ab);
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.bx == kLeTestpMemoryBase);
+
+  // mov r8b, [rbx]
+  const UCHAR mov_r8b[] = {0x44, 0x8a, 0x03};
+  gp_regs.r8 = 0x6666666666666666;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, mov_r8b, kLeTestpMemoryBase));
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.r8 == 0x66666666666666ab);
+
+  // cmp ah, [rbx] and cmp spl, [rbx] read different registers
+  const UCHAR cmp_ah[] = {0x3a, 0x23};
+  const UCHAR cmp_spl[] = {0x40, 0x3a, 0x23};
+  gp_regs.ax = 0xab00;
+  g_le_test_vmcs.rsp = 0xac;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, cmp_ah, kLeTestpMemoryBase));
+  HYPERPLATFORM_TEST_EXPECT(g_le_test_vmcs.rflags ==
+                            LeTestpExpectedRflags(0x044));
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, cmp_spl, kLeTestpMemoryBase));
+  HYPERPLATFORM_TEST_EXPECT(g_le_test_vmcs.rflags ==
+                            LeTestpExpectedRflags(0x000));
+}
+
+// The operand-size prefix and FS and GS prefixes are honored, and the other
+// segment prefixes are ignored
+static void LeTestLegacyPrefixes() {
+  LeTestpReset();
+  GpRegisters gp_regs = {};
+  gp_regs.bx = kLeTestpMemoryBase;
+
+  // mov ax, [rbx]; preserves the upper 48 bits
+  const UCHAR mov_ax[] = {0x66, 0x8b, 0x03};
+  LeTestpSetMemory(0, 0x2222beef, 4);
+  gp_regs.ax = 0x1111111111111111;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, mov_ax, kLeTestpMemoryBase));
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.ax == 0x111111111111beef);
+
+  // mov rax, [rbx]; REX.W takes precedence over the operand-size prefix
+  const UCHAR mov_rax[] = {0x66, 0x48, 0x8b, 0x03};
+  LeTestpSetMemory(0, 0x0123456789abcdef, 8);
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, mov_rax, kLeTestpMemoryBase));
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.ax == 0x0123456789abcdef);
+
+  // mov eax, fs:[rbx]
+  const UCHAR mov_fs[] = {0x64, 0x8b, 0x03};
+  g_le_test_vmcs.fs_base = kLeTestpMemoryBase + 0x200;
+  gp_regs.bx = 0x10;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpLoadEax(&gp_regs, mov_fs, 0x210, 0x11111111) == 0x11111111);
+
+  // mov rax, gs:[rbx]
+  const UCHAR mov_gs[] = {0x65, 0x48, 0x8b, 0x03};
+  g_le_test_vmcs.gs_base = kLeTestpMemoryBase + 0x300;
+  LeTestpSetMemory(0x310, 0xfedcba9876543210, 8);
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, mov_gs, kLeTestpMemoryBase + 0x314));
+  HYPERPLATFORM_TEST_EXPECT(gp_regs.ax == 0xfedcba9876543210);
+
+  // mov eax, cs:[rbx] and mov eax, ds:[rbx]
+  const UCHAR mov_cs[] = {0x2e, 0x8b, 0x03};
+  const UCHAR mov_ds[] = {0x3e, 0x8b, 0x03};
+  gp_regs.bx = kLeTestpMemoryBase + 0x20;
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpLoadEax(&gp_regs, mov_cs, 0x20, 0x22222222) == 0x22222222);
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpLoadEax(&gp_regs, mov_ds, 0x20, 0x33333333) == 0x33333333);
+}
+
+// MOVSXD, MOVZX and MOVSX extend memory operands to the register size
+static void LeTestExtendingLoads() {
+  LeTestpReset();
+  GpRegisters gp_regs = {};
+  gp_regs.bx = kLeTestpMemoryBase;
+  LeTestpSetMemory(0, 0x80008080, 4);
+
+  const struct {
+    UCHAR instruction[4];
+    SIZE_T size;
+    ULONG_PTR expected;
+  } tests[] = {
+      {{0x48, 0x63, 0x03}, 3, 0xffffffff80008080},        // movsxd rax, dword
+      {{0x0f, 0xb6, 0x03}, 3, 0x0000000000000080},        // movzx eax, byte
+      {{0x66, 0x0f, 0xb6, 0x03}, 4, 0x1111111111110080},  // movzx ax, byte
+      {{0x0f, 0xb7, 0x03}, 3, 0x0000000000008080},        // movzx eax, word
+      {{0x48, 0x0f, 0xb7, 0x03}, 4, 0x0000000000008080},  // movzx rax, word
+      {{0x0f, 0xbe, 0x03}, 3, 0x00000000ffffff80},        // movsx eax, byte
+      {{0x66, 0x0f, 0xbe, 0x03}, 4, 0x111111111111ff80},  // movsx ax, byte
+      {{0x48, 0x0f, 0xbe, 0x03}, 4, 0xffffffffffffff80},  // movsx rax, byte
+      {{0x0f, 0xbf, 0x03}, 3, 0x00000000ffff8080},        // movsx eax, word
+      {{0x48, 0x0f, 0xbf, 0x03}, 4, 0xffffffffffff8080},  // movsx rax, word
+  };
+  for (const auto &test : tests) {
+    gp_regs.ax = 0x1111111111111111;
+    g_le_test_vmcs.rip = kLeTestpRip;
+    HYPERPLATFORM_TEST_EXPECT(LeEmulateLoad(&gp_regs, test.instruction,
+                                            test.size, kLeTestpMemoryBase));
+    HYPERPLATFORM_TEST_EXPECT(g_le_test_vmcs.rip == kLeTestpRip + test.size);
+    HYPERPLATFORM_TEST_EXPECT(gp_regs.ax == test.expected);
+  }
+
+  // movsxd eax, dword is not supported without REX.W
+  const UCHAR movsxd_eax[] = {0x63, 0x03};
+  HYPERPLATFORM_TEST_EXPECT(
+      !LeTestpEmulate(&gp_regs, movsxd_eax, kLeTestpMemoryBase));
+}
+
+// CMP updates the status flags as a processor does and preserves the others
+static void LeTestCompareFlags() {
+  LeTestpReset();
+  GpRegisters gp_regs = {};
+  gp_regs.bx = kLeTestpMemoryBase;
+
+  // cmp r, [rbx] and cmp [rbx], r with AL, AX, EAX and RAX
+  const struct {
+    ULONG size;
+    UCHAR cmp_register_with_memory[3];
+    UCHAR cmp_memory_with_register[3];
+    SIZE_T length;
+  } encodings[] = {
+      {1, {0x3a, 0x03}, {0x38, 0x03}, 2},
+      {2, {0x66, 0x3b, 0x03}, {0x66, 0x39, 0x03}, 3},
+      {4, {0x3b, 0x03}, {0x39, 0x03}, 2},
+      {8, {0x48, 0x3b, 0x03}, {0x48, 0x39, 0x03}, 3},
+  };
+  for (const auto &test : kLeTestpCompareCases) {
+    for (const auto &encoding : encodings) {
+      if (encoding.size != test.size) {
+        continue;
+      }
+      const auto expected_rflags = LeTestpExpectedRflags(test.flags);
+
+      g_le_test_vmcs.rflags = kLeTestpRflags | kLeTestpStatusFlags;
+      gp_regs.ax = test.lhs;
+      LeTestpSetMemory(0, test.rhs, 8);
+      HYPERPLATFORM_TEST_EXPECT(
+          LeEmulateLoad(&gp_regs, encoding.cmp_register_with_memory,
+                        encoding.length, kLeTestpMemoryBase));
+      HYPERPLATFORM_TEST_EXPECT(g_le_test_vmcs.rflags == expected_rflags);
+
+      g_le_test_vmcs.rflags = kLeTestpRflags;
+      gp_regs.ax = test.rhs;
+      LeTestpSetMemory(0, test.lhs, 8);
+      HYPERPLATFORM_TEST_EXPECT(
+          LeEmulateLoad(&gp_regs, encoding.cmp_memory_with_register,
+                        encoding.length, kLeTestpMemoryBase));
+      HYPERPLATFORM_TEST_EXPECT(g_le_test_vmcs.rflags == expected_rflags);
+      HYPERPLATFORM_TEST_EXPECT(gp_regs.ax == test.rhs);
+    }
+  }
+
+  // cmp [rbx], imm with immediates sign extended to the operand size
+  const struct {
+    UCHAR instruction[7];
+    SIZE_T size;
+    ULONG64 memory;
+    ULONG_PTR flags;
+  } tests[] = {
+      {{0x80, 0x3b, 0x80}, 3, 0x1, 0x885},              // cmp byte, 0x80
+      {{0x66, 0x83, 0x3b, 0x10}, 4, 0x0, 0x085},        // cmp word, 0x10
+      {{0x66, 0x81, 0x3b, 0x00, 0x80}, 5, 0x7fff, 0x885},  // cmp word, 0x8000
+      {{0x83, 0x3b, 0xff}, 3, 0x7fffffff, 0x885},       // cmp dword, -1
+      {{0x81, 0x3b, 0x01, 0x00, 0x00, 0x80}, 6, 0x80000000, 0x095},
+      {{0x48, 0x83, 0x3b, 0xff}, 4, 0x10, 0x015},  // cmp qword, -1
+      {{0x48, 0x81, 0x3b, 0x01, 0x00, 0x00, 0x80}, 7, 0x0, 0x015},
+  };
+  for (const auto &test : tests) {
+    g_le_test_vmcs.rflags = kLeTestpRflags;
+    g_le_test_vmcs.rip = kLeTestpRip;
+    LeTestpSetMemory(0, test.memory, 8);
+    HYPERPLATFORM_TEST_EXPECT(LeEmulateLoad(&gp_regs, test.instruction,
+                                            test.size, kLeTestpMemoryBase));
+    HYPERPLATFORM_TEST_EXPECT(g_le_test_vmcs.rip == kLeTestpRip + test.size);
+    HYPERPLATFORM_TEST_EXPECT(g_le_test_vmcs.rflags ==
+                              LeTestpExpectedRflags(test.flags));
+  }
+}
+
+// Unsupported instructions and accesses other than the one that caused the
+// violation are left to the processor
+static void LeTestRejectedLoads() {
+  LeTestpReset();
+  GpRegisters gp_regs = {};
+  gp_regs.ax = 0x1111111111111111;
+  gp_regs.bx = kLeTestpMemoryBase + 0x10;
+  const auto expected_regs = gp_regs;
+
+  // mov eax, ebx; not a memory operand
+  const UCHAR mov_register[] = {0x8b, 0xc3};
+  HYPERPLATFORM_TEST_EXPECT(
+      !LeTestpEmulate(&gp_regs, mov_register, gp_regs.bx));
+
+  // add dword [rbx], 1; not CMP
+  const UCHAR add_immediate[] = {0x83, 0x03, 0x01};
+  HYPERPLATFORM_TEST_EXPECT(
+      !LeTestpEmulate(&gp_regs, add_immediate, gp_regs.bx));
+
+  // mov eax, [rbx + disp32] truncated
+  const UCHAR truncated[] = {0x8b, 0x83, 0x00, 0x00};
+  HYPERPLATFORM_TEST_EXPECT(!LeTestpEmulate(&gp_regs, truncated, gp_regs.bx));
+
+  // mov eax, [rbx] and mov ax, [rbx] with fault_va outside of the operand
+  const UCHAR mov_eax[] = {0x8b, 0x03};
+  const UCHAR mov_ax[] = {0x66, 0x8b, 0x03};
+  HYPERPLATFORM_TEST_EXPECT(
+      !LeTestpEmulate(&gp_regs, mov_eax, gp_regs.bx - 1));
+  HYPERPLATFORM_TEST_EXPECT(
+      !LeTestpEmulate(&gp_regs, mov_eax, gp_regs.bx + 4));
+  HYPERPLATFORM_TEST_EXPECT(!LeTestpEmulate(&gp_regs, mov_ax, gp_regs.bx + 2));
+
+  // mov eax, [rbx] across the end of present memory
+  gp_regs.bx = kLeTestpMemoryBase + kLeTestpMemorySize - 2;
+  HYPERPLATFORM_TEST_EXPECT(!LeTestpEmulate(&gp_regs, mov_eax, gp_regs.bx));
+  gp_regs.bx = expected_regs.bx;
+
+  // mov eax, [rbx] when not in 64-bit mode, single-stepping or blocking
+  // interrupts
+  g_le_test_vmcs.cs_ar_bytes &= ~(1ul << 13);
+  HYPERPLATFORM_TEST_EXPECT(!LeTestpEmulate(&gp_regs, mov_eax, gp_regs.bx));
+  LeTestpReset();
+  g_le_test_vmcs.rflags |= 0x100;
+  HYPERPLATFORM_TEST_EXPECT(!LeTestpEmulate(&gp_regs, mov_eax, gp_regs.bx));
+  LeTestpReset();
+  g_le_test_vmcs.interruptibility_info = 1;
+  HYPERPLATFORM_TEST_EXPECT(!LeTestpEmulate(&gp_regs, mov_eax, gp_regs.bx));
+
+  HYPERPLATFORM_TEST_EXPECT(
+      !memcmp(&gp_regs, &expected_regs, sizeof(gp_regs)));
+  HYPERPLATFORM_TEST_EXPECT(g_le_test_vmcs.rip == kLeTestpRip);
+  HYPERPLATFORM_TEST_EXPECT(g_le_test_vmcs.rflags == kLeTestpRflags);
+
+  // The last byte of the operand is accepted
+  LeTestpReset();
+  HYPERPLATFORM_TEST_EXPECT(
+      LeTestpEmulate(&gp_regs, mov_eax, gp_regs.bx + 3));
+}
+
+int main() {
+  LeTestModRmAndSibAddressing();
+  LeTestRexPrefixes();
+  LeTestLegacyPrefixes();
+  LeTestExtendingLoads();
+  LeTestCompareFlags();
+  LeTestRejectedLoads();
+  return TestGetExitCode();
+}
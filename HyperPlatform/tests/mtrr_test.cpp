@@ -0,0 +1,411 @@
+// Copyright (c) 2015-2017, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Tests compiling MTRRs into memory type ranges and looking them up.
+
+#include "../HyperPlatform/mtrr.h"
+#include "test.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const auto kUC = memory_type::kUncacheable;
+static const auto kWC = memory_type::kWriteCombining;
+static const auto kWT = memory_type::kWriteThrough;
+static const auto kWP = memory_type::kWriteProtected;
+static const auto kWB = memory_type::kWriteBack;
+
+// A seed of random MTRRs. It is fixed so that a failure is reproducible.
+static const auto kMtrrTestRandomSeed = 0x2017ull;
+
+// A number of random sets of MTRRs compared against MtrrResolveMemoryType()
+static const auto kMtrrTestRandomSets = 2000ul;
+
+// A number of random addresses looked up in each set in addition to addresses
+// around boundaries
+static const auto kMtrrTestRandomAddresses = 256ul;
+
+// Upper bounds of random MTRRs in each set
+static const auto kMtrrTestMaxFixedEntries = 11ul;
+static const auto kMtrrTestMaxVariableEntries = 20ul;
+static const auto kMtrrTestMaxIgnoredEntries = 4ul;
+static const auto kMtrrTestRandomEntriesSize =
+    kMtrrTestMaxFixedEntries + kMtrrTestMaxVariableEntries + 1 +
+    kMtrrTestMaxIgnoredEntries;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Memory type ranges compiled from MTRRs under test
+struct MtrrTestRanges {
+  MemoryTypeRange ranges[kMtrrMemoryTypeRangesSize];
+  ULONG count;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns an enabled MTRR entry
+static MtrrData MtrrTestpEntry(bool fixed, memory_type type, ULONG64 base,
+                               ULONG64 end) {
+  MtrrData entry = {};
+  entry.enabled = true;
+  entry.fixedMtrr = fixed;
+  entry.type = static_cast<UCHAR>(type);
+  entry.range_base = base;
+  entry.range_end = end;
+  return entry;
+}
+
+// Compiles MTRRs terminated by a disabled entry
+static void MtrrTestpBuild(const MtrrData *entries, ULONG entries_count,
+                           memory_type default_type, MtrrTestRanges *ranges) {
+  ranges->count = MtrrBuildMemoryTypeRanges(
+      entries, entries_count, static_cast<UCHAR>(default_type),
+      ranges->ranges);
+}
+
+// Returns a memory type of the physical_address
+static memory_type MtrrTestpGetType(const MtrrTestRanges &ranges,
+                                    ULONG64 physical_address) {
+  const auto index =
+      MtrrFindMemoryTypeRange(ranges.ranges, ranges.count, physical_address);
+  return ranges.ranges[index].type;
+}
+
+// Returns a next pseudo-random number with xorshift64*. Unlike rand(), it gives
+// the same sequence with any C runtime.
+static ULONG64 MtrrTestpRandom(ULONG64 *state) {
+  auto x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545f4914f6cdd1dull;
+}
+
+// Returns a random memory type MTRRs can specify
+static memory_type MtrrTestpRandomType(ULONG64 *state) {
+  static const memory_type kTypes[] = {kUC, kWC, kWT, kWP, kWB};
+  return kTypes[MtrrTestpRandom(state) % RTL_NUMBER_OF(kTypes)];
+}
+
+// Fills entries with random MTRRs: fixed ranges splitting the first 1 MB,
+// variable ranges overlapping each other and the fixed ranges, a disabled
+// entry, and then enabled entries that must be ignored. Returns a number of
+// entries filled.
+static ULONG MtrrTestpRandomEntries(ULONG64 *state, MtrrData *entries) {
+  ULONG count = 0;
+
+  // Fixed ranges are in 4 KB pages and in ascending order, as those read from
+  // the fixed range MTRRs
+  if (MtrrTestpRandom(state) % 2) {
+    const auto fixed_count =
+        1 + static_cast<ULONG>(MtrrTestpRandom(state) %
+                               kMtrrTestMaxFixedEntries);
+    ULONG64 base = 0;
+    auto pages_left = 0x100000ull / 0x1000;
+    for (auto i = 0ul; i < fixed_count; ++i) {
+      auto pages = pages_left;
+      if (i != fixed_count - 1) {
+        pages = 1 + MtrrTestpRandom(state) % (pages_left - (fixed_count - i));
+      }
+      entries[count++] = MtrrTestpEntry(true, MtrrTestpRandomType(state), base,
+                                        base + pages * 0x1000 - 1);
+      base += pages * 0x1000;
+      pages_left -= pages;
+    }
+  }
+
+  // Variable ranges are naturally aligned powers of two of up to 128 GB. Some
+  // are placed in the first 2 MB to overlap the fixed ranges, and some reach
+  // the end of the address space.
+  const auto variable_count =
+      1 + static_cast<ULONG>(MtrrTestpRandom(state) %
+                             kMtrrTestMaxVariableEntries);
+  for (auto i = 0ul; i < variable_count; ++i) {
+    const auto size = 0x1000ull << (MtrrTestpRandom(state) % 26);
+    const auto limit =
+        (MtrrTestpRandom(state) % 4) ? 0x2000000000ull : 0x200000ull;
+    const auto base = (MtrrTestpRandom(state) % limit) & ~(size - 1);
+    const auto end =
+        (MtrrTestpRandom(state) % 16) ? base + size - 1 : MAXULONG64;
+    entries[count++] =
+        MtrrTestpEntry(false, MtrrTestpRandomType(state), base, end);
+  }
+
+  // A disabled entry terminates the MTRRs. Entries after it are garbage.
+  entries[count++] = MtrrData{};
+  const auto ignored_count = static_cast<ULONG>(
+      MtrrTestpRandom(state) % (kMtrrTestMaxIgnoredEntries + 1));
+  for (auto i = 0ul; i < ignored_count; ++i) {
+    entries[count++] = MtrrTestpEntry(MtrrTestpRandom(state) % 2,
+                                      MtrrTestpRandomType(state), 0,
+                                      MtrrTestpRandom(state));
+  }
+  return count;
+}
+
+// Checks if looking up the ranges gives the same memory type as resolving
+// the MTRRs for the physical_address
+static void MtrrTestpExpectResolvedType(const MtrrData *entries,
+                                        ULONG entries_count,
+                                        memory_type default_type,
+                                        const MtrrTestRanges &ranges,
+                                        ULONG64 physical_address) {
+  const auto expected = MtrrResolveMemoryType(
+      entries, entries_count, static_cast<UCHAR>(default_type),
+      physical_address);
+  const auto actual = MtrrTestpGetType(ranges, physical_address);
+  if (actual != expected) {
+    printf("Mismatch at %016llx: %d, expected %d\n",
+           static_cast<unsigned long long>(physical_address),
+           static_cast<int>(actual), static_cast<int>(expected));
+  }
+  HYPERPLATFORM_TEST_EXPECT(actual == expected);
+}
+
+// Checks if both addresses are in the same range
+static bool MtrrTestpIsSameRange(const MtrrTestRanges &ranges, ULONG64 first,
+                                 ULONG64 last) {
+  return MtrrFindMemoryTypeRange(ranges.ranges, ranges.count, first) ==
+         MtrrFindMemoryTypeRange(ranges.ranges, ranges.count, last);
+}
+
+// The whole address space has the default type without MTRRs
+static void MtrrTestNoMtrrs() {
+  MtrrData entries[1] = {};
+  MtrrTestRanges ranges = {};
+  MtrrTestpBuild(entries, 1, kWB, &ranges);
+
+  HYPERPLATFORM_TEST_EXPECT(ranges.count == 1);
+  HYPERPLATFORM_TEST_EXPECT(ranges.ranges[0].range_base == 0);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0) == kWB);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, MAXULONG64) == kWB);
+}
+
+// The first and last bytes of a variable range have its type, and the bytes
+// around it have the default type
+static void MtrrTestVariableRangeBoundaries() {
+  MtrrData entries[] = {
+      MtrrTestpEntry(false, kWB, 0x100000, 0x7fffffff),
+      {},
+  };
+  MtrrTestRanges ranges = {};
+  MtrrTestpBuild(entries, RTL_NUMBER_OF(entries), kUC, &ranges);
+
+  HYPERPLATFORM_TEST_EXPECT(ranges.count == 3);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0) == kUC);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0xfffff) == kUC);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x100000) == kWB);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x7fffffff) == kWB);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x80000000) == kUC);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, MAXULONG64) == kUC);
+  HYPERPLATFORM_TEST_EXPECT(
+      MtrrTestpIsSameRange(ranges, 0x100000, 0x7fffffff));
+  HYPERPLATFORM_TEST_EXPECT(
+      !MtrrTestpIsSameRange(ranges, 0xfffff, 0x100000));
+  HYPERPLATFORM_TEST_EXPECT(
+      !MtrrTestpIsSameRange(ranges, 0x7fffffff, 0x80000000));
+}
+
+// A range reaching the end of the address space adds no boundary after it
+static void MtrrTestRangeToEndOfAddressSpace() {
+  MtrrData entries[] = {
+      MtrrTestpEntry(false, kUC, 0xfffff000, MAXULONG64),
+      {},
+  };
+  MtrrTestRanges ranges = {};
+  MtrrTestpBuild(entries, RTL_NUMBER_OF(entries), kWB, &ranges);
+
+  HYPERPLATFORM_TEST_EXPECT(ranges.count == 2);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0xffffefff) == kWB);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0xfffff000) == kUC);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, MAXULONG64) == kUC);
+}
+
+// UC takes precedence over any other type of overlapping variable ranges
+// regardless of their order
+static void MtrrTestUncacheablePrecedence() {
+  const MtrrData uc = MtrrTestpEntry(false, kUC, 0x80000000, 0x8fffffff);
+  const MtrrData wb = MtrrTestpEntry(false, kWB, 0, 0xffffffff);
+  const MtrrData wt = MtrrTestpEntry(false, kWT, 0x80000000, 0x8fffffff);
+  const MtrrData orders[][4] = {
+      {uc, wb, wt, {}}, {wb, uc, wt, {}}, {wb, wt, uc, {}}, {wt, wb, uc, {}},
+  };
+  for (const auto &entries : orders) {
+    MtrrTestRanges ranges = {};
+    MtrrTestpBuild(entries, RTL_NUMBER_OF(entries), kWC, &ranges);
+
+    HYPERPLATFORM_TEST_EXPECT(ranges.count == 4);
+    HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x7fffffff) == kWB);
+    HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x80000000) == kUC);
+    HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x8fffffff) == kUC);
+    HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x90000000) == kWB);
+    HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x100000000) == kWC);
+  }
+}
+
+// WT takes precedence over WB of overlapping variable ranges regardless of
+// their order
+static void MtrrTestWriteThroughPrecedence() {
+  const MtrrData wb = MtrrTestpEntry(false, kWB, 0, 0xffffffff);
+  const MtrrData wt = MtrrTestpEntry(false, kWT, 0x80000000, 0x8fffffff);
+  const MtrrData orders[][3] = {{wb, wt, {}}, {wt, wb, {}}};
+  for (const auto &entries : orders) {
+    MtrrTestRanges ranges = {};
+    MtrrTestpBuild(entries, RTL_NUMBER_OF(entries), kUC, &ranges);
+
+    HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x7fffffff) == kWB);
+    HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x80000000) == kWT);
+    HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x8fffffff) == kWT);
+    HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x90000000) == kWB);
+  }
+}
+
+// Fixed ranges take precedence over overlapping variable ranges, including UC
+// ones, and variable ranges apply right after the fixed ranges end
+static void MtrrTestFixedOverVariableRanges() {
+  MtrrData entries[] = {
+      MtrrTestpEntry(true, kWB, 0x0, 0x7ffff),
+      MtrrTestpEntry(true, kWB, 0x80000, 0x9ffff),
+      MtrrTestpEntry(true, kUC, 0xa0000, 0xbffff),
+      MtrrTestpEntry(true, kWP, 0xc0000, 0xfffff),
+      MtrrTestpEntry(false, kUC, 0x0, 0xfffff),
+      MtrrTestpEntry(false, kWB, 0x0, 0x3fffffff),
+      {},
+  };
+  MtrrTestRanges ranges = {};
+  MtrrTestpBuild(entries, RTL_NUMBER_OF(entries), kUC, &ranges);
+
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x0) == kWB);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x9ffff) == kWB);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0xa0000) == kUC);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0xbffff) == kUC);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0xc0000) == kWP);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0xfffff) == kWP);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x100000) == kWB);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x3fffffff) == kWB);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x40000000) == kUC);
+
+  // Adjacent fixed ranges of the same type are coalesced into one
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpIsSameRange(ranges, 0x0, 0x9ffff));
+  HYPERPLATFORM_TEST_EXPECT(!MtrrTestpIsSameRange(ranges, 0x0, 0x100000));
+  HYPERPLATFORM_TEST_EXPECT(ranges.count == 5);
+}
+
+// Entries after the first disabled one are ignored
+static void MtrrTestStopsAtDisabledEntry() {
+  MtrrData entries[] = {
+      MtrrTestpEntry(false, kWB, 0x0, 0xfff),
+      {},
+      MtrrTestpEntry(false, kUC, 0x0, 0xffffffff),
+  };
+  MtrrTestRanges ranges = {};
+  MtrrTestpBuild(entries, RTL_NUMBER_OF(entries), kWT, &ranges);
+
+  HYPERPLATFORM_TEST_EXPECT(ranges.count == 2);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0xfff) == kWB);
+  HYPERPLATFORM_TEST_EXPECT(MtrrTestpGetType(ranges, 0x1000) == kWT);
+}
+
+// Looking up ranges returns the last range starting at or below the address
+static void MtrrTestFindRange() {
+  const MemoryTypeRange ranges[] = {
+      {0x0, kWB}, {0x1000, kUC}, {0x3000, kWB}, {0x100000000, kWC},
+  };
+  const auto count = static_cast<ULONG>(RTL_NUMBER_OF(ranges));
+
+  HYPERPLATFORM_TEST_EXPECT(MtrrFindMemoryTypeRange(ranges, count, 0) == 0);
+  HYPERPLATFORM_TEST_EXPECT(MtrrFindMemoryTypeRange(ranges, count, 0xfff) ==
+                            0);
+  HYPERPLATFORM_TEST_EXPECT(MtrrFindMemoryTypeRange(ranges, count, 0x1000) ==
+                            1);
+  HYPERPLATFORM_TEST_EXPECT(MtrrFindMemoryTypeRange(ranges, count, 0x2fff) ==
+                            1);
+  HYPERPLATFORM_TEST_EXPECT(MtrrFindMemoryTypeRange(ranges, count, 0x3000) ==
+                            2);
+  HYPERPLATFORM_TEST_EXPECT(
+      MtrrFindMemoryTypeRange(ranges, count, 0xffffffff) == 2);
+  HYPERPLATFORM_TEST_EXPECT(
+      MtrrFindMemoryTypeRange(ranges, count, 0x100000000) == 3);
+  HYPERPLATFORM_TEST_EXPECT(
+      MtrrFindMemoryTypeRange(ranges, count, MAXULONG64) == 3);
+  HYPERPLATFORM_TEST_EXPECT(MtrrFindMemoryTypeRange(ranges, 1, MAXULONG64) ==
+                            0);
+}
+
+// Looking up ranges compiled from random MTRRs gives the same memory type as
+// resolving the MTRRs at boundaries of the MTRRs and ranges, next to them, and
+// at random addresses
+static void MtrrTestRandomMtrrs() {
+  ULONG64 state = kMtrrTestRandomSeed;
+  for (auto set = 0ul; set < kMtrrTestRandomSets; ++set) {
+    MtrrData entries[kMtrrTestRandomEntriesSize] = {};
+    const auto entries_count = MtrrTestpRandomEntries(&state, entries);
+    const auto default_type = MtrrTestpRandomType(&state);
+    MtrrTestRanges ranges = {};
+    MtrrTestpBuild(entries, entries_count, default_type, &ranges);
+
+    HYPERPLATFORM_TEST_EXPECT(ranges.count >= 1);
+    HYPERPLATFORM_TEST_EXPECT(ranges.count <= kMtrrMemoryTypeRangesSize);
+    HYPERPLATFORM_TEST_EXPECT(ranges.ranges[0].range_base == 0);
+    for (auto i = 1ul; i < ranges.count; ++i) {
+      HYPERPLATFORM_TEST_EXPECT(ranges.ranges[i - 1].range_base <
+                                ranges.ranges[i].range_base);
+      HYPERPLATFORM_TEST_EXPECT(ranges.ranges[i - 1].type !=
+                                ranges.ranges[i].type);
+    }
+
+    // Addresses wrap around at both ends of the address space, which are
+    // valid addresses to look up as well
+    for (auto i = 0ul; i < entries_count && entries[i].enabled; ++i) {
+      const ULONG64 addresses[] = {
+          entries[i].range_base - 1, entries[i].range_base,
+          entries[i].range_base + 1, entries[i].range_end - 1,
+          entries[i].range_end,      entries[i].range_end + 1,
+      };
+      for (const auto address : addresses) {
+        MtrrTestpExpectResolvedType(entries, entries_count, default_type,
+                                    ranges, address);
+      }
+    }
+    for (auto i = 0ul; i < ranges.count; ++i) {
+      const auto boundary = ranges.ranges[i].range_base;
+      const ULONG64 addresses[] = {boundary - 1, boundary, boundary + 1};
+      for (const auto address : addresses) {
+        MtrrTestpExpectResolvedType(entries, entries_count, default_type,
+                                    ranges, address);
+      }
+    }
+    for (auto i = 0ul; i < kMtrrTestRandomAddresses; ++i) {
+      auto address = MtrrTestpRandom(&state);
+      if (i % 2) {
+        address %= 0x4000000000ull;
+      }
+      MtrrTestpExpectResolvedType(entries, entries_count, default_type,
+                                  ranges, address);
+    }
+  }
+}
+
+int main() {
+  MtrrTestNoMtrrs();
+  MtrrTestVariableRangeBoundaries();
+  MtrrTestRangeToEndOfAddressSpace();
+  MtrrTestUncacheablePrecedence();
+  MtrrTestWriteThroughPrecedence();
+  MtrrTestFixedOverVariableRanges();
+  MtrrTestStopsAtDisabledEntry();
+  MtrrTestFindRange();
+  MtrrTestRandomMtrrs();
+  return TestGetExitCode();
+}
@@ -0,0 +1,8 @@
+// Copyright (c) 2015-2017, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Stands in for the SDK header for compilers other than MSVC.
+
+#pragma pack(push, 1)
@@ -0,0 +1,16 @@
+@echo off
+rem Builds and runs benchmarks of code without kernel dependencies in user mode.
+rem Run this from x64 Native Tools Command Prompt for Visual Studio.
+setlocal
+cd /d "%~dp0"
+set OUT_DIR=..\x64\tests
+if not exist %OUT_DIR% mkdir %OUT_DIR%
+
+call :RunBenchmark fake_page_index_bench || exit /b 1
+call :RunBenchmark fake_page_install_bench || exit /b 1
+exit /b 0
+
+:RunBenchmark
+cl /nologo /W4 /O2 /EHsc /I. /Fo%OUT_DIR%\ /Fe%OUT_DIR%\%1.exe %1.cpp || exit /b 1
+%OUT_DIR%\%1.exe
+exit /b
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Builds and runs benchmarks of code without kernel dependencies in user mode.
+# Run this on x64 Linux with g++ or clang++ (set CXX to choose one).
+set -e
+cd "$(dirname "$0")"
+OUT_DIR=../x64/tests
+mkdir -p "$OUT_DIR"
+CXX=${CXX:-g++}
+
+run_benchmark() {
+  "$CXX" -std=c++14 -O2 -Wall -Wextra -I. -o "$OUT_DIR/$1" "$1.cpp"
+  "$OUT_DIR/$1"
+}
+
+run_benchmark fake_page_index_bench
+run_benchmark fake_page_install_bench
@@ -0,0 +1,17 @@
+@echo off
+rem Builds and runs tests of code without kernel dependencies in user mode.
+rem Run this from x64 Native Tools Command Prompt for Visual Studio.
+setlocal
+cd /d "%~dp0"
+set OUT_DIR=..\x64\tests
+if not exist %OUT_DIR% mkdir %OUT_DIR%
+
+call :RunTest ept_entry_test "..\HyperPlatform\ept_entry.cpp ..\HyperPlatform\mtrr.cpp" || exit /b 1
+call :RunTest mtrr_test ..\HyperPlatform\mtrr.cpp || exit /b 1
+call :RunTest load_emulator_test ..\..\FU_Hypervisor\load_emulator.cpp || exit /b 1
+exit /b 0
+
+:RunTest
+cl /nologo /W4 /EHsc /I. /Fo%OUT_DIR%\ /Fe%OUT_DIR%\%1.exe %1.cpp %~2 || exit /b 1
+%OUT_DIR%\%1.exe
+exit /b
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Builds and runs tests of code without kernel dependencies in user mode.
+# Run this on x64 Linux with g++ or clang++ (set CXX to choose one).
+set -e
+cd "$(dirname "$0")"
+OUT_DIR=../x64/tests
+mkdir -p "$OUT_DIR"
+CXX=${CXX:-g++}
+
+run_test() {
+  name=$1
+  shift
+  "$CXX" -std=c++14 -O2 -Wall -Wextra -Wno-missing-field-initializers -I. \
+    -o "$OUT_DIR/$name" "$name.cpp" "$@"
+  "$OUT_DIR/$name"
+}
+
+run_test ept_entry_test ../HyperPlatform/ept_entry.cpp ../HyperPlatform/mtrr.cpp
+run_test mtrr_test ../HyperPlatform/mtrr.cpp
+run_test load_emulator_test ../../FU_Hypervisor/load_emulator.cpp
@@ -0,0 +1,58 @@
+// Copyright (c) 2015-2017, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares a minimal harness for user-mode tests.
+///
+/// Each test is a program that checks expectations with
+/// HYPERPLATFORM_TEST_EXPECT() and returns the result of TestGetExitCode().
+
+#ifndef HYPERPLATFORM_TESTS_TEST_H_
+#define HYPERPLATFORM_TESTS_TEST_H_
+
+#include <stdio.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+/// Reports a failure when the expression is false and continues the test
+#define HYPERPLATFORM_TEST_EXPECT(expression) \
+  TestExpect((expression), #expression, __FILE__, __LINE__)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+/// A number of failed expectations in the test program
+static int g_test_failures;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+/// Counts and reports a failed expectation
+inline void TestExpect(bool succeeded, const char *expression, const char *file,
+                       int line) {
+  if (!succeeded) {
+    printf("%s(%d): FAILED: %s\n", file, line, expression);
+    g_test_failures++;
+  }
+}
+
+/// Reports the result of the test program
+/// @return An exit code of the test program; 0 when all expectations held
+inline int TestGetExitCode() {
+  if (g_test_failures) {
+    printf("%d expectation(s) failed\n", g_test_failures);
+    return 1;
+  }
+  printf("All expectations held\n");
+  return 0;
+}
+
+#endif  // HYPERPLATFORM_TESTS_TEST_H_